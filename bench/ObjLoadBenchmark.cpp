@@ -0,0 +1,118 @@
+// Load time of every OBJ file in a folder, ../models by default like the scenes, with
+// OBJLoader and with the istringstream parser it replaced. OBJLoader is timed on one thread and on
+// [threads], 0 meaning every hardware thread. Usage: ObjLoadBenchmark [folder] [runs] [threads]
+#define MAIN
+#include "VectorUtils4.h"
+#include "OBJLoader.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+	// The parser OBJLoader used before, for v/vt/vn triangles only. Returns the triangle count.
+	size_t loadWithStreams(const std::string& path)
+	{
+		std::vector<vec3> positions, normals;
+		std::vector<vec3> outPositions, outNormals;
+		std::ifstream file(path);
+		std::string line;
+		while (std::getline(file, line)) {
+			std::istringstream ss(line);
+			std::string type;
+			ss >> type;
+			if (type == "v") {
+				vec3 v;
+				ss >> v.x >> v.y >> v.z;
+				positions.push_back(v);
+			}
+			else if (type == "vn") {
+				vec3 n;
+				ss >> n.x >> n.y >> n.z;
+				normals.push_back(n);
+			}
+			else if (type == "f") {
+				unsigned int vi, uvi, ni;
+				char slash;
+				for (int i = 0; i < 3; ++i) {
+					ss >> vi >> slash >> uvi >> slash >> ni;
+					if (vi == 0 || vi > positions.size() || ni == 0 || ni > normals.size()) {
+						return 0; // A face form it cannot read
+					}
+					outPositions.push_back(positions[vi - 1]);
+					outNormals.push_back(normals[ni - 1]);
+				}
+			}
+		}
+		return outPositions.size() / 3;
+	}
+
+	// Fastest of the runs, the first one also pays for reading the file from disk
+	template<typename Load>
+	double fastestMs(int runs, Load load)
+	{
+		double best = 1e30;
+		for (int i = 0; i < runs; i++) {
+			auto start = std::chrono::high_resolution_clock::now();
+			load();
+			best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+		}
+		return best;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string folder = argc > 1 ? argv[1] : "../models";
+	int runs = argc > 2 ? std::max(1, std::atoi(argv[2])) : 5;
+	int threads = argc > 3 ? std::atoi(argv[3]) : 0;
+
+	std::vector<std::filesystem::path> files;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(folder, error)) {
+		if (entry.is_regular_file() && entry.path().extension() == ".obj") {
+			files.push_back(entry.path());
+		}
+	}
+	if (error || files.empty()) {
+		std::fprintf(stderr, "No .obj files in %s\n", folder.c_str());
+		return 1;
+	}
+	std::sort(files.begin(), files.end());
+
+	std::printf("%-28s %9s %10s %10s %12s %12s %12s %9s %8s %8s\n", "file", "MB", "triangles", "vertices", "streams ms", "1 thread ms", "mapped ms", "MB/s", "scaling", "speedup");
+	for (const auto& path : files) {
+		double megabytes = std::filesystem::file_size(path) / (1024.0 * 1024.0);
+		IndexedMesh mesh;
+		bool loaded = true;
+		double mappedMs = fastestMs(runs, [&]() { loaded = OBJLoader::loadOBJ(path.string(), mesh, threads); });
+		if (!loaded) {
+			std::printf("%-28s failed to load\n", path.filename().string().c_str());
+			continue;
+		}
+		double singleMs = fastestMs(runs, [&]() { OBJLoader::loadOBJ(path.string(), mesh, 1); });
+		size_t streamTriangles = 0;
+		double streamMs = fastestMs(runs, [&]() { streamTriangles = loadWithStreams(path.string()); });
+
+		std::printf("%-28s %9.2f %10zu %10zu ", path.filename().string().c_str(), megabytes, mesh.triangleCount(), mesh.positions.size());
+		if (streamTriangles == mesh.triangleCount()) {
+			std::printf("%12.2f ", streamMs);
+		}
+		else {
+			std::printf("%12s ", "-");
+		}
+		std::printf("%12.2f %12.2f %9.1f %7.1fx ", singleMs, mappedMs, megabytes / (mappedMs / 1000.0), singleMs / mappedMs);
+		if (streamTriangles == mesh.triangleCount()) {
+			std::printf("%7.1fx\n", streamMs / mappedMs);
+		}
+		else {
+			std::printf("%8s\n", "-");
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,354 @@
+// Timings of the core for comparing commits: OBJ parsing of every file in models/, the BVH build of
+// every preset scene and model with each builder, and the CPU traversal of primary, shadow and diffuse
+// rays, one ray at a time and in packets. Every measurement is repeated after a few untimed warm-up
+// runs and summarized by its median and percentiles, and everything is written to a JSON file.
+// Run from the build directory like the application.
+// Usage: RaytracerBenchmark [--models DIR] [--runs N] [--warmup N] [--threads N] [--output FILE]
+#define MAIN
+#include "VectorUtils4.h"
+#include "Camera.h"
+#include "OBJLoader.h"
+#include "Scene.h"
+#include "SceneBVH.h"
+#include "ThreadPool.h"
+#include "ToolSupport.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+	struct Options {
+		std::string models = "../models";
+		int runs = 10;
+		int warmup = 2;
+		int threads = 0;	// Parsing and building, the rays are traced on one thread
+		std::string output = "benchmark.json";
+	};
+
+	// Of the timed runs in milliseconds
+	struct Summary {
+		double min = 0.0;
+		double p10 = 0.0;
+		double median = 0.0;
+		double p90 = 0.0;
+		double max = 0.0;
+	};
+
+	struct NamedScene {
+		std::string name;
+		Scene scene;
+		Camera camera;
+	};
+
+	// A set of rays that is traced as a whole
+	struct RaySet {
+		std::vector<vec3> origins;
+		std::vector<vec3> directions;
+	};
+
+	const int RAY_WIDTH = 256;
+	const int RAY_HEIGHT = 192;
+
+	bool parseOptions(int argc, char** argv, Options& options)
+	{
+		return ToolSupport::parseOptions(argc, argv, {}, [&](const std::string& name, const char* value) {
+			bool valid = true;
+			if (name == "--models") {
+				options.models = value;
+			}
+			else if (name == "--runs") {
+				options.runs = std::atoi(value);
+				valid = options.runs > 0;
+			}
+			else if (name == "--warmup") {
+				options.warmup = std::atoi(value);
+				valid = options.warmup >= 0;
+			}
+			else if (name == "--threads") {
+				options.threads = std::atoi(value);
+				valid = options.threads >= 0;
+			}
+			else if (name == "--output") {
+				options.output = value;
+			}
+			else {
+				return ToolSupport::OptionResult::Unknown;
+			}
+			return valid ? ToolSupport::OptionResult::Valid : ToolSupport::OptionResult::Invalid;
+		});
+	}
+
+	// Linear interpolation between the closest ranks
+	double percentile(const std::vector<double>& sorted, double fraction)
+	{
+		double position = fraction * (sorted.size() - 1);
+		size_t lower = size_t(position);
+		size_t upper = std::min(lower + 1, sorted.size() - 1);
+		return sorted[lower] + (sorted[upper] - sorted[lower]) * (position - lower);
+	}
+
+	template<typename Work>
+	Summary timeRuns(const Options& options, Work work)
+	{
+		for (int i = 0; i < options.warmup; i++) {
+			work();
+		}
+		std::vector<double> ms;
+		for (int i = 0; i < options.runs; i++) {
+			auto start = std::chrono::steady_clock::now();
+			work();
+			ms.push_back(ToolSupport::msSince(start));
+		}
+		std::sort(ms.begin(), ms.end());
+		return { ms.front(), percentile(ms, 0.1), percentile(ms, 0.5), percentile(ms, 0.9), ms.back() };
+	}
+
+	std::string jsonSummary(const Summary& summary)
+	{
+		std::ostringstream out;
+		out << "{ \"min\": " << summary.min << ", \"p10\": " << summary.p10 << ", \"median\": " << summary.median
+			<< ", \"p90\": " << summary.p90 << ", \"max\": " << summary.max << " }";
+		return out.str();
+	}
+
+	std::vector<std::filesystem::path> findModels(const std::string& folder)
+	{
+		std::vector<std::filesystem::path> files;
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(folder, error)) {
+			if (entry.is_regular_file() && entry.path().extension() == ".obj") {
+				files.push_back(entry.path());
+			}
+		}
+		std::sort(files.begin(), files.end());
+		return files;
+	}
+
+	// The presets are seen from the default camera of the application, a model alone from in front of its bounds
+	Camera frameModel(const IndexedMesh& model)
+	{
+		AABB bounds;
+		for (const vec3& position : model.positions) {
+			for (int axis = 0; axis < 3; axis++) {
+				bounds.min[axis] = std::min(bounds.min[axis], position[axis]);
+				bounds.max[axis] = std::max(bounds.max[axis], position[axis]);
+			}
+		}
+		vec3 center = (bounds.min + bounds.max) * 0.5f;
+		float size = Norm(bounds.max - bounds.min);
+		return Camera(center - vec3(0.0f, 0.0f, size), vec3(0.0f, 0.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f), 80.0f, RAY_WIDTH, RAY_HEIGHT);
+	}
+
+	// A camera ray through every pixel in rows, which keeps neighbouring rays in the same packet
+	RaySet primaryRays(Camera& camera)
+	{
+		RaySet rays;
+		for (int y = 0; y < RAY_HEIGHT; y++) {
+			for (int x = 0; x < RAY_WIDTH; x++) {
+				float u = (x + 0.5f) / RAY_WIDTH * camera.GetImagePlaneWidth() - camera.GetImagePlaneWidth() / 2.0f;
+				float v = ((y + 0.5f) / RAY_HEIGHT - 0.5f) * camera.GetImagePlaneHeight();
+				rays.origins.push_back(camera.position);
+				rays.directions.push_back(normalize(camera.GetForward() + camera.GetRight() * u + camera.GetUp() * v));
+			}
+		}
+		return rays;
+	}
+
+	// From the primary hits, towards a random point on the first area light and into the cosine-weighted
+	// hemisphere of the surface, as the path tracer samples them
+	void secondaryRays(const SceneBVH& sceneBVH, const Scene& scene, const RaySet& primary, RaySet& shadow, RaySet& diffuse)
+	{
+		std::mt19937 random(1);
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		for (size_t i = 0; i < primary.origins.size(); i++) {
+			SceneHit hit = sceneBVH.intersect(primary.origins[i], primary.directions[i]);
+			if (hit.primitive == -1) {
+				continue;
+			}
+			SceneSurface surface = sceneBVH.getSurface(hit);
+			vec3 point = primary.origins[i] + primary.directions[i] * hit.t;
+			vec3 normal = surface.ID == 1 ? normalize(point - surface.vertex1) : surface.normal;
+			if (normal * primary.directions[i] > 0.0f) {
+				normal = normal * -1.0f;
+			}
+			vec3 start = point + normal * 0.0001f;
+
+			if (!scene.areaLights.empty()) {
+				const AreaLight& light = scene.areaLights[0];
+				float s = uniform(random);
+				float t = uniform(random);
+				vec3 target = light.vertex1 + (light.vertex2 - light.vertex1) * s + (light.vertex4 - light.vertex1) * t;
+				shadow.origins.push_back(start);
+				shadow.directions.push_back(normalize(target - start));
+			}
+
+			float azimuth = 2.0f * float(M_PI) * uniform(random);
+			float inclination = std::acos(std::sqrt(1.0f - uniform(random)));
+			vec3 tangent = normalize(std::abs(normal.x) > 0.9f ? cross(normal, vec3(0.0f, 1.0f, 0.0f)) : cross(normal, vec3(1.0f, 0.0f, 0.0f)));
+			vec3 bitangent = cross(normal, tangent);
+			diffuse.origins.push_back(start);
+			diffuse.directions.push_back(normalize(normal * std::cos(inclination)
+				+ tangent * (std::cos(azimuth) * std::sin(inclination)) + bitangent * (std::sin(azimuth) * std::sin(inclination))));
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		std::fprintf(stderr, "Usage: %s [--models DIR] [--runs N] [--warmup N] [--threads N] [--output FILE]\n", argv[0]);
+		return 1;
+	}
+	// Every build reports itself on std::cout, which would bury the tables and be timed with them
+	std::cout.setstate(std::ios::failbit);
+
+	std::vector<std::filesystem::path> modelFiles = findModels(options.models);
+	std::ostringstream json;
+	json << "{\n  \"runs\": " << options.runs << ",\n  \"warmup\": " << options.warmup
+		<< ",\n  \"threads\": " << (options.threads > 0 ? options.threads : ThreadPool::hardwareThreads())
+		<< ",\n  \"simd\": " << ToolSupport::jsonString(simdLevelName(detectSIMDLevel())) << ",\n";
+
+	// OBJ parsing
+	std::printf("%-28s %10s %10s %10s %10s %10s\n", "OBJ parse", "MB", "triangles", "median ms", "p90 ms", "MB/s");
+	json << "  \"objParse\": [";
+	bool first = true;
+	for (const auto& file : modelFiles) {
+		std::string path = file.string();
+		std::string name = file.filename().string();
+		double megabytes = std::filesystem::file_size(file) / (1024.0 * 1024.0);
+		IndexedMesh mesh;
+		bool loaded = true;
+		Summary summary = timeRuns(options, [&]() { loaded = OBJLoader::loadOBJ(path, mesh, options.threads); });
+		json << (first ? "\n    " : ",\n    ") << "{ \"file\": " << ToolSupport::jsonString(name) << ", \"megabytes\": " << megabytes;
+		first = false;
+		// Kept in the table and the file, a model that stopped loading is a difference between two runs too
+		if (!loaded) {
+			std::printf("%-28s %10.2f  failed to load\n", name.c_str(), megabytes);
+			json << ", \"failed\": true }";
+			continue;
+		}
+		double throughput = megabytes / (summary.median / 1000.0);
+		std::printf("%-28s %10.2f %10zu %10.2f %10.2f %10.1f\n", name.c_str(), megabytes, mesh.triangleCount(), summary.median, summary.p90, throughput);
+		json << ", \"triangles\": " << mesh.triangleCount() << ", \"ms\": " << jsonSummary(summary)
+			<< ", \"megabytesPerSecond\": " << throughput << " }";
+	}
+	json << "\n  ],\n";
+
+	// The presets, then every model alone under the light of the model scenes
+	std::vector<NamedScene> scenes;
+	for (int preset = 0; preset <= 4; preset++) {
+		Scene scene(preset);
+		if (scene.primitives.empty() && scene.models.empty()) {
+			std::fprintf(stderr, "Preset %d is empty, its models are missing\n", preset);
+			continue;
+		}
+		scenes.push_back({ "preset " + std::to_string(preset), std::move(scene),
+			Camera(vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, 0.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f), 80.0f, RAY_WIDTH, RAY_HEIGHT) });
+	}
+	for (const auto& file : modelFiles) {
+		Scene scene;
+		scene.CreateSceneFromModel(file.string());
+		if (scene.models.empty()) {
+			std::fprintf(stderr, "%s failed to load, it is left out of the builds and rays\n", file.filename().string().c_str());
+			continue;
+		}
+		Camera camera = frameModel(scene.models[0]);
+		scenes.push_back({ file.filename().string(), std::move(scene), camera });
+	}
+
+	// BVH builds, every mesh tree and the top level, without the cache
+	const char* builderNames[] = { "binned SAH", "SBVH", "LBVH" };
+	std::printf("\n%-28s %-12s %10s %10s %10s %12s\n", "BVH build", "builder", "primitives", "median ms", "p90 ms", "Mprims/s");
+	json << "  \"bvhBuild\": [";
+	first = true;
+	for (const NamedScene& named : scenes) {
+		for (int builder = 0; builder < 3; builder++) {
+			BVHBuildSettings settings;
+			settings.builder = static_cast<BVHBuilder>(builder);
+			settings.threadCount = options.threads;
+			SceneBVH sceneBVH;
+			sceneBVH.setBuildSettings(settings);
+			Summary summary = timeRuns(options, [&]() {
+				sceneBVH.clear();
+				ToolSupport::addSceneToBVH(sceneBVH, named.scene);
+				sceneBVH.build();
+			});
+			int primitives = int(named.scene.primitives.size());
+			for (const IndexedMesh& model : named.scene.models) {
+				primitives += int(model.triangleCount());
+			}
+			double throughput = primitives / (summary.median / 1000.0) / 1e6;
+			std::printf("%-28s %-12s %10d %10.2f %10.2f %12.2f\n", named.name.c_str(), builderNames[builder], primitives, summary.median, summary.p90, throughput);
+			json << (first ? "\n    " : ",\n    ") << "{ \"scene\": " << ToolSupport::jsonString(named.name) << ", \"builder\": " << ToolSupport::jsonString(builderNames[builder])
+				<< ", \"primitives\": " << primitives << ", \"nodes\": " << sceneBVH.getNodeCount() << ", \"ms\": " << jsonSummary(summary)
+				<< ", \"megaPrimitivesPerSecond\": " << throughput << " }";
+			first = false;
+		}
+	}
+	json << "\n  ],\n";
+
+	// Ray throughput on one thread with the default build
+	std::printf("\n%-28s %-8s %-7s %10s %10s %10s %10s\n", "Rays", "kind", "mode", "rays", "median ms", "p90 ms", "Mrays/s");
+	json << "  \"rays\": [";
+	first = true;
+	for (NamedScene& named : scenes) {
+		SceneBVH sceneBVH;
+		sceneBVH.setThreadCount(options.threads);
+		ToolSupport::addSceneToBVH(sceneBVH, named.scene);
+		sceneBVH.build();
+
+		RaySet primary = primaryRays(named.camera);
+		RaySet shadow, diffuse;
+		secondaryRays(sceneBVH, named.scene, primary, shadow, diffuse);
+		const std::pair<const char*, const RaySet*> sets[] = { { "primary", &primary }, { "shadow", &shadow }, { "diffuse", &diffuse } };
+
+		for (const auto& [kind, rays] : sets) {
+			int count = int(rays->origins.size());
+			if (count == 0) {
+				continue;
+			}
+			// Shadow rays do not see glass, like in the path tracer
+			bool includeGlass = std::string(kind) != "shadow";
+			std::vector<SceneHit> hits(count);
+			for (int packets = 0; packets < 2; packets++) {
+				Summary summary = timeRuns(options, [&]() {
+					if (packets) {
+						sceneBVH.intersectPacket(rays->origins.data(), rays->directions.data(), count, hits.data(), includeGlass);
+					}
+					else {
+						for (int i = 0; i < count; i++) {
+							hits[i] = sceneBVH.intersect(rays->origins[i], rays->directions[i], includeGlass);
+						}
+					}
+				});
+				int hitCount = int(std::count_if(hits.begin(), hits.end(), [](const SceneHit& hit) { return hit.primitive != -1; }));
+				const char* mode = packets ? "packet" : "scalar";
+				double throughput = count / (summary.median / 1000.0) / 1e6;
+				std::printf("%-28s %-8s %-7s %10d %10.2f %10.2f %10.2f\n", named.name.c_str(), kind, mode, count, summary.median, summary.p90, throughput);
+				json << (first ? "\n    " : ",\n    ") << "{ \"scene\": " << ToolSupport::jsonString(named.name) << ", \"kind\": " << ToolSupport::jsonString(kind)
+					<< ", \"mode\": " << ToolSupport::jsonString(mode) << ", \"rays\": " << count << ", \"hits\": " << hitCount
+					<< ", \"ms\": " << jsonSummary(summary) << ", \"megaRaysPerSecond\": " << throughput << " }";
+				first = false;
+			}
+		}
+	}
+	json << "\n  ]\n}\n";
+
+	std::ofstream out(options.output, std::ios::trunc);
+	out << json.str();
+	if (!out.good()) {
+		std::fprintf(stderr, "Failed to write %s\n", options.output.c_str());
+		return 1;
+	}
+	std::printf("\nWrote %s\n", options.output.c_str());
+	return 0;
+}
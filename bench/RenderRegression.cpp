@@ -0,0 +1,716 @@
+// Renders the preset scenes 0-4 with the CPU path tracer at a fixed resolution and sample count and
+// compares the peak memory and the image with a baseline checked in under bench/baseline, and the wall
+// time and samples per second with a time baseline measured on this machine. Exits with 1 and lists
+// every regression when a number is worse than its baseline by more than its tolerance or the image
+// differs from the reference render, so it can gate a commit. Run from the build directory like the
+// application. A preset whose model files are missing cannot be rendered and is listed as skipped.
+// Usage: RenderRegression [options]
+//   --baseline DIR            Baseline JSON and reference images (../bench/baseline)
+//   --update                  Render and write a new baseline and time baseline instead of comparing
+//   --update-times            Render and write only a new time baseline, for a fresh checkout or machine
+//   --times FILE              Time baseline of this machine, not checked in (render_times.json)
+//   --size WxH                Resolution, only with --update, otherwise from the baseline (160x120)
+//   --spp N                   Samples per pixel, only with --update (16)
+//   --bounces N               Max bounces, only with --update (5)
+//   --runs N                  Renders per scene, the times are of the fastest (3)
+//   --threads N               Build and render threads, 0 for all (0)
+//   --time-tolerance F        Allowed slowdown of wall time and samples/s as a fraction (0.25)
+//   --memory-tolerance F      Allowed growth of the peak memory as a fraction (0.10)
+//   --image-tolerance F       Allowed relative mean squared error against the reference (1e-6)
+//   --output FILE             Results of this run as JSON (render_regression.json)
+#define MAIN
+#include "VectorUtils4.h"
+#include "CPUPathTracer.h"
+#include "ImageFile.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "ToolSupport.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__linux__)
+#include <malloc.h>
+#else
+#include <sys/resource.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+namespace {
+	struct Options {
+		std::string baseline = "../bench/baseline";
+		bool update = false;
+		bool updateTimes = false;
+		std::string times = "render_times.json";
+		int width = 160;
+		int height = 120;
+		int samplesPerPixel = 16;
+		int maxBounces = 5;
+		int runs = 3;
+		int threads = 0;
+		double timeTolerance = 0.25;
+		double memoryTolerance = 0.10;
+		double imageTolerance = 0.000001;
+		std::string output = "render_regression.json";
+	};
+
+	// What one preset measured, and what the baseline holds for it
+	struct SceneResult {
+		int scene = 0;
+		size_t primitives = 0;
+		size_t triangles = 0;
+		std::string missingModel;	// Set when the preset could not be rendered
+		double wallMs = 0.0;
+		double samplesPerSecond = 0.0;
+		double peakMegabytes = 0.0;
+		std::vector<vec3> image;
+	};
+
+	const int PRESET_COUNT = 5;
+	const char* BASELINE_FILE = "render_baseline.json";
+
+	bool parseOptions(int argc, char** argv, Options& options)
+	{
+		return ToolSupport::parseOptions(argc, argv, { "--update", "--update-times" }, [&](const std::string& name, const char* value) {
+			bool valid = true;
+			if (name == "--update") {
+				options.update = true;
+			}
+			else if (name == "--update-times") {
+				options.updateTimes = true;
+			}
+			else if (name == "--times") {
+				options.times = value;
+			}
+			else if (name == "--baseline") {
+				options.baseline = value;
+			}
+			else if (name == "--size") {
+				valid = std::sscanf(value, "%dx%d", &options.width, &options.height) == 2 && options.width > 0 && options.height > 0;
+			}
+			else if (name == "--spp") {
+				options.samplesPerPixel = std::atoi(value);
+				valid = options.samplesPerPixel > 0;
+			}
+			else if (name == "--bounces") {
+				options.maxBounces = std::atoi(value);
+				valid = options.maxBounces > 0;
+			}
+			else if (name == "--runs") {
+				options.runs = std::atoi(value);
+				valid = options.runs > 0;
+			}
+			else if (name == "--threads") {
+				options.threads = std::atoi(value);
+				valid = options.threads >= 0;
+			}
+			else if (name == "--time-tolerance") {
+				options.timeTolerance = std::atof(value);
+				valid = options.timeTolerance >= 0.0;
+			}
+			else if (name == "--memory-tolerance") {
+				options.memoryTolerance = std::atof(value);
+				valid = options.memoryTolerance >= 0.0;
+			}
+			else if (name == "--image-tolerance") {
+				options.imageTolerance = std::atof(value);
+				valid = options.imageTolerance >= 0.0;
+			}
+			else if (name == "--output") {
+				options.output = value;
+			}
+			else {
+				return ToolSupport::OptionResult::Unknown;
+			}
+			return valid ? ToolSupport::OptionResult::Valid : ToolSupport::OptionResult::Invalid;
+		});
+	}
+
+	// The brand string of the CPU. With the thread count and the instruction set it tells whether a time
+	// baseline was measured on this machine, a host name like "vm" or "localhost" says too little.
+	std::string cpuModel()
+	{
+		unsigned int brand[12] = {};
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int info[4];
+		__cpuid(info, 0x80000000);
+		if (unsigned(info[0]) >= 0x80000004) {
+			for (int leaf = 0; leaf < 3; leaf++) {
+				__cpuid(reinterpret_cast<int*>(brand + leaf * 4), 0x80000002 + leaf);
+			}
+		}
+#elif defined(__x86_64__) || defined(__i386__)
+		if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004) {
+			for (unsigned int leaf = 0; leaf < 3; leaf++) {
+				__get_cpuid(0x80000002 + leaf, &brand[leaf * 4], &brand[leaf * 4 + 1], &brand[leaf * 4 + 2], &brand[leaf * 4 + 3]);
+			}
+		}
+#endif
+		std::string model(reinterpret_cast<const char*>(brand), strnlen(reinterpret_cast<const char*>(brand), sizeof(brand)));
+		size_t first = model.find_first_not_of(' ');
+		size_t last = model.find_last_not_of(' ');
+		return first == std::string::npos ? "unknown CPU" : model.substr(first, last - first + 1);
+	}
+
+	// Peak resident memory of the process in bytes, 0 where it cannot be read
+	size_t peakMemoryBytes()
+	{
+#if defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+			return counters.PeakWorkingSetSize;
+		}
+		return 0;
+#elif defined(__linux__)
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status, line)) {
+			if (line.compare(0, 6, "VmHWM:") == 0) {
+				return size_t(std::strtoull(line.c_str() + 6, nullptr, 10)) * 1024;
+			}
+		}
+		return 0;
+#else
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+		return size_t(usage.ru_maxrss);
+#else
+		return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+	}
+
+	// Starts the peak over at the current memory, so each scene gets its own peak. Only Linux allows
+	// it, elsewhere the peak is of the whole process so far, which still compares with a baseline
+	// from the same system since the scenes always run in the same order.
+	bool resetPeakMemory()
+	{
+#if defined(__linux__)
+		// Hand the memory of the previous scene back first, or it stays in the new peak
+		malloc_trim(0);
+		std::ofstream clear("/proc/self/clear_refs");
+		clear << "5";
+		clear.flush();
+		return clear.good();
+#else
+		return false;
+#endif
+	}
+
+	// Relative mean squared error over all channels, the usual measure for comparing renders: a
+	// difference counts relative to the brightness of the reference, with 0.01 keeping black pixels
+	// from dominating.
+	double relativeMSE(const std::vector<vec3>& image, const std::vector<vec3>& reference)
+	{
+		double sum = 0.0;
+		for (size_t i = 0; i < image.size(); i++) {
+			for (int channel = 0; channel < 3; channel++) {
+				double difference = double(image[i][channel]) - reference[i][channel];
+				double value = reference[i][channel];
+				sum += difference * difference / (value * value + 0.01);
+			}
+		}
+		return image.empty() ? 0.0 : sum / (image.size() * 3.0);
+	}
+
+	// Loads, builds and renders one preset like HeadlessRender, repeated options.runs times
+	bool renderScene(const Options& options, int preset, SceneResult& result)
+	{
+		std::vector<double> wallMs;
+		std::vector<double> samplesPerSecond;
+		size_t peakBytes = 0;
+		result.scene = preset;
+		for (int run = 0; run < options.runs; run++) {
+			resetPeakMemory();
+			auto start = std::chrono::steady_clock::now();
+			Scene scene(preset);
+			// Rendered without its model a preset would only be another scene with the same number
+			if (!scene.missingModels.empty()) {
+				result.missingModel = scene.missingModels[0];
+				return false;
+			}
+
+			SceneBVH sceneBVH;
+			sceneBVH.setThreadCount(options.threads);
+			ToolSupport::addSceneToBVH(sceneBVH, scene);
+			result.primitives = scene.primitives.size();
+			result.triangles = 0;
+			for (const IndexedMesh& model : scene.models) {
+				result.triangles += model.triangleCount();
+			}
+			sceneBVH.build();
+
+			// The start camera of the application
+			Camera camera(vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, 0.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f), 80.0f, options.width, options.height);
+			CPUPathTracer tracer(sceneBVH, scene.areaLights, scene.pointLights);
+			CPURenderSettings settings;
+			settings.width = options.width;
+			settings.height = options.height;
+			settings.samplesPerPixel = 1;
+			settings.maxBounces = options.maxBounces;
+			settings.threadCount = options.threads;
+			tracer.setSettings(settings);
+			for (int frame = 0; frame < options.samplesPerPixel; frame++) {
+				tracer.renderFrame(camera);
+			}
+
+			wallMs.push_back(ToolSupport::msSince(start));
+			samplesPerSecond.push_back(tracer.getSamplesPerSecond());
+			peakBytes = std::max(peakBytes, peakMemoryBytes());
+			// The renders are deterministic, every run gives the same image
+			if (run == 0) {
+				result.image = tracer.getImage();
+			}
+		}
+
+		// Other work on the machine only ever slows a run down, so the fastest run is the steadiest number
+		result.wallMs = *std::min_element(wallMs.begin(), wallMs.end());
+		result.samplesPerSecond = *std::max_element(samplesPerSecond.begin(), samplesPerSecond.end());
+		result.peakMegabytes = peakBytes / (1024.0 * 1024.0);
+		return true;
+	}
+
+	std::string imageName(int preset)
+	{
+		return "preset" + std::to_string(preset) + ".pfm";
+	}
+
+	// Just enough JSON to read back the baseline this program writes: objects, arrays, numbers and
+	// strings without escapes other than \" and \\.
+	struct JsonValue {
+		double number = 0.0;
+		std::string text;
+		std::vector<JsonValue> items;
+		std::vector<std::pair<std::string, JsonValue>> members;
+
+		const JsonValue* find(const std::string& key) const
+		{
+			for (const auto& member : members) {
+				if (member.first == key) {
+					return &member.second;
+				}
+			}
+			return nullptr;
+		}
+
+		double get(const std::string& key, double fallback = 0.0) const
+		{
+			const JsonValue* value = find(key);
+			return value ? value->number : fallback;
+		}
+	};
+
+	// Reads from text, which must outlive the reader
+	class JsonReader
+	{
+	public:
+		explicit JsonReader(const std::string& text) : current(text.c_str()), end(text.c_str() + text.size()) {}
+
+		bool parse(JsonValue& value)
+		{
+			skipSpace();
+			if (current == end) {
+				return false;
+			}
+			if (*current == '{') {
+				current++;
+				skipSpace();
+				if (current < end && *current == '}') {
+					current++;
+					return true;
+				}
+				while (true) {
+					JsonValue key;
+					skipSpace();
+					if (current == end || *current != '"' || !parseString(key.text) || !expect(':')) {
+						return false;
+					}
+					value.members.emplace_back(key.text, JsonValue());
+					if (!parse(value.members.back().second)) {
+						return false;
+					}
+					skipSpace();
+					if (current < end && *current == ',') {
+						current++;
+						continue;
+					}
+					return expect('}');
+				}
+			}
+			if (*current == '[') {
+				current++;
+				skipSpace();
+				if (current < end && *current == ']') {
+					current++;
+					return true;
+				}
+				while (true) {
+					value.items.emplace_back();
+					if (!parse(value.items.back())) {
+						return false;
+					}
+					skipSpace();
+					if (current < end && *current == ',') {
+						current++;
+						continue;
+					}
+					return expect(']');
+				}
+			}
+			if (*current == '"') {
+				return parseString(value.text);
+			}
+			char* numberEnd = nullptr;
+			value.number = std::strtod(current, &numberEnd);
+			if (numberEnd == current) {
+				return false;
+			}
+			current = numberEnd;
+			return true;
+		}
+
+	private:
+		const char* current;
+		const char* end;
+
+		void skipSpace()
+		{
+			while (current < end && std::strchr(" \t\r\n", *current)) {
+				current++;
+			}
+		}
+
+		bool expect(char c)
+		{
+			skipSpace();
+			if (current == end || *current != c) {
+				return false;
+			}
+			current++;
+			return true;
+		}
+
+		bool parseString(std::string& text)
+		{
+			current++;
+			while (current < end && *current != '"') {
+				if (*current == '\\' && current + 1 < end) {
+					current++;
+				}
+				text += *current++;
+			}
+			if (current == end) {
+				return false;
+			}
+			current++;
+			return true;
+		}
+	};
+
+	int threadCount(const Options& options)
+	{
+		return options.threads > 0 ? options.threads : ThreadPool::hardwareThreads();
+	}
+
+	// The checked-in baseline leaves out the times, they only mean something on the machine that measured
+	// them. The time baseline and the results of a run have them along with the machine.
+	std::string resultsJson(const Options& options, const std::vector<SceneResult>& results, bool withTimes, bool withImages)
+	{
+		std::ostringstream json;
+		json << "{\n  \"settings\": { \"width\": " << options.width << ", \"height\": " << options.height
+			<< ", \"samplesPerPixel\": " << options.samplesPerPixel << ", \"maxBounces\": " << options.maxBounces << ", \"runs\": " << options.runs << " },\n";
+		if (withTimes) {
+			json << "  \"machine\": { \"cpu\": " << ToolSupport::jsonString(cpuModel()) << ", \"threads\": " << threadCount(options)
+				<< ", \"simd\": " << ToolSupport::jsonString(simdLevelName(detectSIMDLevel())) << " },\n";
+		}
+		json << "  \"scenes\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			const SceneResult& result = results[i];
+			json << (i > 0 ? ",\n    " : "\n    ") << "{ \"scene\": " << result.scene << ", \"primitives\": " << result.primitives
+				<< ", \"triangles\": " << result.triangles;
+			if (withTimes) {
+				json << ", \"wallMs\": " << result.wallMs << ", \"samplesPerSecond\": " << result.samplesPerSecond;
+			}
+			json << ", \"peakMegabytes\": " << result.peakMegabytes;
+			if (withImages) {
+				json << ", \"image\": " << ToolSupport::jsonString(imageName(result.scene));
+			}
+			json << " }";
+		}
+		json << "\n  ]\n}\n";
+		return json.str();
+	}
+
+	bool writeText(const std::string& path, const std::string& text)
+	{
+		std::ofstream out(path, std::ios::trunc);
+		out << text;
+		if (!out.good()) {
+			std::fprintf(stderr, "Failed to write %s\n", path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool readBaseline(const std::string& path, JsonValue& baseline)
+	{
+		std::ifstream in(path);
+		if (!in.is_open()) {
+			std::fprintf(stderr, "No baseline at %s, run with --update to create it\n", path.c_str());
+			return false;
+		}
+		std::stringstream text;
+		text << in.rdbuf();
+		std::string json = text.str();
+		JsonReader reader(json);
+		if (!reader.parse(baseline) || !baseline.find("settings") || !baseline.find("scenes")) {
+			std::fprintf(stderr, "Baseline is damaged: %s\n", path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	double change(double value, double baseline)
+	{
+		return baseline > 0.0 ? value / baseline - 1.0 : 0.0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		std::fprintf(stderr, "Usage: %s [--baseline DIR] [--update] [--update-times] [--times FILE] [--size WxH] [--spp N] [--bounces N] [--runs N] [--threads N]\n"
+			"  [--time-tolerance F] [--memory-tolerance F] [--image-tolerance F] [--output FILE]\n", argv[0]);
+		return 1;
+	}
+	std::filesystem::path baselineDirectory = options.baseline;
+	std::string baselinePath = (baselineDirectory / BASELINE_FILE).string();
+
+	// The comparison renders exactly what the baseline rendered
+	JsonValue baseline;
+	bool measuring = options.update || options.updateTimes;
+	if (!options.update) {
+		if (!readBaseline(baselinePath, baseline)) {
+			return 1;
+		}
+		const JsonValue& settings = *baseline.find("settings");
+		options.width = int(settings.get("width"));
+		options.height = int(settings.get("height"));
+		options.samplesPerPixel = int(settings.get("samplesPerPixel"));
+		options.maxBounces = int(settings.get("maxBounces"));
+		if (options.width <= 0 || options.height <= 0 || options.samplesPerPixel <= 0 || options.maxBounces <= 0) {
+			std::fprintf(stderr, "Baseline has invalid settings: %s\n", baselinePath.c_str());
+			return 1;
+		}
+	}
+
+	// Times measured with other settings or on another machine say nothing about this change, memory and the image still do
+	JsonValue times;
+	bool checkTimes = false;
+	if (!measuring) {
+		std::string reason;
+		if (!std::filesystem::exists(options.times)) {
+			reason = "there is no time baseline at " + options.times;
+		}
+		else if (!readBaseline(options.times, times)) {
+			reason = options.times + " cannot be read";
+		}
+		else {
+			const JsonValue& settings = *times.find("settings");
+			const JsonValue* machine = times.find("machine");
+			const JsonValue* cpu = machine ? machine->find("cpu") : nullptr;
+			const JsonValue* simd = machine ? machine->find("simd") : nullptr;
+			if (int(settings.get("width")) != options.width || int(settings.get("height")) != options.height
+				|| int(settings.get("samplesPerPixel")) != options.samplesPerPixel || int(settings.get("maxBounces")) != options.maxBounces) {
+				reason = options.times + " was measured with other settings than the baseline";
+			}
+			else if (!cpu || cpu->text != cpuModel() || int(machine->get("threads")) != threadCount(options)
+				|| !simd || simd->text != simdLevelName(detectSIMDLevel())) {
+				reason = options.times + " was measured on " + (cpu ? cpu->text : "an unknown CPU") + " with "
+					+ std::to_string(machine ? int(machine->get("threads")) : 0) + " threads and " + (simd ? simd->text : "?")
+					+ ", this is " + cpuModel() + " with " + std::to_string(threadCount(options)) + " threads and " + simdLevelName(detectSIMDLevel());
+			}
+			else {
+				checkTimes = true;
+			}
+		}
+		if (!checkTimes) {
+			std::printf("The times are shown but not checked: %s.\nRun with --update-times to measure a time baseline on this machine.\n", reason.c_str());
+		}
+	}
+
+	// Every scene and BVH build reports itself on std::cout, which would bury the results
+	std::cout.setstate(std::ios::failbit);
+
+	std::printf("Rendering presets 0-%d at %dx%d, %d samples per pixel, %d bounces, %d runs each\n",
+		PRESET_COUNT - 1, options.width, options.height, options.samplesPerPixel, options.maxBounces, options.runs);
+
+	std::vector<SceneResult> results;
+	std::vector<std::string> failures;
+	std::vector<std::string> skipped;
+	for (int preset = 0; preset < PRESET_COUNT; preset++) {
+		SceneResult result;
+		bool rendered = renderScene(options, preset, result);
+		const JsonValue* expected = nullptr;
+		const JsonValue* expectedTimes = nullptr;
+		if (!options.update) {
+			for (const JsonValue& entry : baseline.find("scenes")->items) {
+				if (int(entry.get("scene", -1)) == preset) {
+					expected = &entry;
+				}
+			}
+		}
+		if (checkTimes) {
+			for (const JsonValue& entry : times.find("scenes")->items) {
+				if (int(entry.get("scene", -1)) == preset) {
+					expectedTimes = &entry;
+				}
+			}
+		}
+
+		std::string name = "preset " + std::to_string(preset);
+		if (!rendered) {
+			std::printf("\n%s SKIPPED, %s is missing\n", name.c_str(), result.missingModel.c_str());
+			skipped.push_back(name);
+			if (expected) {
+				failures.push_back(name + " is in the baseline but could not be loaded");
+			}
+			continue;
+		}
+		results.push_back(result);
+
+		std::printf("\n%s, %zu primitives, %zu triangles\n", name.c_str(), result.primitives, result.triangles);
+		if (measuring) {
+			std::printf("  wall time    %12.1f ms\n  samples/s    %12.0f\n  peak memory  %12.1f MB\n", result.wallMs, result.samplesPerSecond, result.peakMegabytes);
+			continue;
+		}
+		if (!expected) {
+			std::printf("  not in the baseline, rerun with --update to add it\n");
+			continue;
+		}
+		if (size_t(expected->get("primitives")) != result.primitives || size_t(expected->get("triangles")) != result.triangles) {
+			failures.push_back(name + " has different geometry than the baseline");
+			std::printf("  REGRESSION   the baseline has %zu primitives and %zu triangles\n", size_t(expected->get("primitives")), size_t(expected->get("triangles")));
+			continue;
+		}
+
+		// Slower, less throughput and more memory are regressions, improvements are only reported
+		struct Check {
+			const char* label;
+			const char* unit;
+			double value;
+			double baseline;
+			double tolerance;
+			bool higherIsWorse;
+			bool checked;
+		};
+		Check checks[] = {
+			{ "wall time", "ms", result.wallMs, expectedTimes ? expectedTimes->get("wallMs") : 0.0, options.timeTolerance, true, expectedTimes != nullptr },
+			{ "samples/s", "", result.samplesPerSecond, expectedTimes ? expectedTimes->get("samplesPerSecond") : 0.0, options.timeTolerance, false, expectedTimes != nullptr },
+			{ "peak memory", "MB", result.peakMegabytes, expected->get("peakMegabytes"), options.memoryTolerance, true, true },
+		};
+		for (const Check& check : checks) {
+			if (!check.checked) {
+				std::printf("  %-12s %12.1f %-2s  not checked\n", check.label, check.value, check.unit);
+				continue;
+			}
+			double difference = change(check.value, check.baseline);
+			double worse = check.higherIsWorse ? difference : -difference;
+			bool regressed = worse > check.tolerance;
+			const char* status = regressed ? "REGRESSION" : (worse < -check.tolerance ? "better" : "ok");
+			std::printf("  %-12s %12.1f %-2s  baseline %12.1f %-2s  %+6.1f%%  %s\n", check.label, check.value, check.unit,
+				check.baseline, check.unit, difference * 100.0, status);
+			if (regressed) {
+				char message[256];
+				std::snprintf(message, sizeof(message), "%s: %s %.1f%% %s than the baseline, allowed %.1f%%", name.c_str(), check.label,
+					std::abs(difference) * 100.0, difference > 0.0 ? "higher" : "lower", check.tolerance * 100.0);
+				failures.push_back(message);
+			}
+		}
+
+		const JsonValue* image = expected->find("image");
+		std::string referencePath = (baselineDirectory / (image ? image->text : imageName(preset))).string();
+		std::vector<vec3> reference;
+		int referenceWidth = 0;
+		int referenceHeight = 0;
+		if (!ImageFile::readPFM(referencePath, reference, referenceWidth, referenceHeight)
+			|| referenceWidth != options.width || referenceHeight != options.height) {
+			failures.push_back(name + ": no reference image of the right size at " + referencePath);
+			std::printf("  image        REGRESSION, no usable reference image\n");
+			continue;
+		}
+		double error = relativeMSE(result.image, reference);
+		bool imageFailed = error > options.imageTolerance;
+		std::printf("  image relMSE %12.3g     limit    %12.3g      %s\n", error, options.imageTolerance, imageFailed ? "REGRESSION" : "ok");
+		if (imageFailed) {
+			// Left behind for a look next to the reference
+			std::string output = "regression_preset" + std::to_string(preset);
+			ImageFile::writePFM(output + ".pfm", result.image, options.width, options.height);
+			ImageFile::writePPM(output + ".ppm", result.image, options.width, options.height);
+			char message[256];
+			std::snprintf(message, sizeof(message), "%s: image differs from the reference, relMSE %.3g, allowed %.3g, written to %s.ppm",
+				name.c_str(), error, options.imageTolerance, output.c_str());
+			failures.push_back(message);
+		}
+	}
+
+	// Not a failure unless the baseline has them, but these presets are not covered by the check
+	if (!skipped.empty()) {
+		std::string names;
+		for (const std::string& name : skipped) {
+			names += (names.empty() ? "" : ", ") + name;
+		}
+		std::printf("\nSkipped for missing models, not covered: %s\n", names.c_str());
+	}
+
+	if (options.update) {
+		std::error_code ec;
+		std::filesystem::create_directories(baselineDirectory, ec);
+		for (const SceneResult& result : results) {
+			if (!ImageFile::writePFM((baselineDirectory / imageName(result.scene)).string(), result.image, options.width, options.height)) {
+				return 1;
+			}
+		}
+		if (!writeText(baselinePath, resultsJson(options, results, false, true))) {
+			return 1;
+		}
+		std::printf("\nWrote the baseline to %s\n", baselinePath.c_str());
+	}
+	if (measuring) {
+		if (!writeText(options.times, resultsJson(options, results, true, false))) {
+			return 1;
+		}
+		std::printf("Wrote the time baseline of this machine to %s\n", options.times.c_str());
+		return 0;
+	}
+
+	writeText(options.output, resultsJson(options, results, true, false));
+	if (!failures.empty()) {
+		std::fflush(stdout);
+		std::fprintf(stderr, "\nFAILED: %zu regression%s against %s\n", failures.size(), failures.size() == 1 ? "" : "s", baselinePath.c_str());
+		for (const std::string& failure : failures) {
+			std::fprintf(stderr, "  %s\n", failure.c_str());
+		}
+		return 1;
+	}
+	std::printf("\nAll rendered scenes are within the tolerances of the baseline\n");
+	return 0;
+}
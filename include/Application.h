@@ -9,9 +9,11 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "Scene.h"
+#include "Object.h"
 #include "Shader.h"
 #include "Camera.h"
-#include "BVHTree.h"
+#include "SceneBVH.h"
+#include "ModelLoader.h"
 
 class Application
 {
@@ -26,6 +28,13 @@ public:
 
 	void BindBuffersPathtraced();
 	void BindBuffersRasterized();
+	// Links the path tracing program with a traversal stack of stackSize entries, replacing the old one
+	void CompilePathtraceShader(int stackSize);
+	// Moves an object that is already in the path traced scene, only the top-level BVH is rebuilt
+	void UpdateObjectPathtraced(int objectIndex);
+	// Gives an object another model. The path traced scene borrows the geometry of every mesh, so
+	// while path tracing it is built again around the new one before the old one can be freed.
+	void SetObjectMesh(int objectIndex, const std::shared_ptr<Mesh>& mesh, const std::string& name);
 
 	//void SetScene(Scene* scene);
 	//Scene* GetScene() const;
@@ -46,9 +55,13 @@ private:
 	GLuint textures[2];
 	Camera mainCamera;
 	Scene currentScene;
+	// Placed from the object panel on top of the scene, each an instance in the path traced scene
+	std::vector<Object> objects;
 	GLuint framebuffer;
 
-	unsigned int PathtraceShader;
+	unsigned int PathtraceShader = 0;
+	// BVH_STACK_SIZE the path tracing program was compiled with
+	int pathtraceStackSize = 0;
 	unsigned int DisplayShader;
 	unsigned int RasterShader;
 
@@ -56,18 +69,33 @@ private:
 	bool presetSceneButton2 = false;
 
 	int selectedIndex = -1;
+
+	// A model file chosen for object loadingObject, parsed by modelLoader and then uploaded a slice per frame
+	ModelLoader modelLoader;
+	std::shared_ptr<Mesh> uploadingMesh;
+	int loadingObject = -1;
+	std::string loadingName;
 	int frameCount = 0;
 	float previousTime = 0;
 	float deltaTime = 0;
 	int currentTexture;
 	unsigned int VAO;
-	BVHTree bvhTree;
+	SceneBVH sceneBVH;
+	GLuint SSBO_Instances = 0;
+	GLuint SSBO_TopLevelNodes = 0;
+	GLuint SSBO_Triangles = 0;
+	GLuint SSBO_Vertices = 0;
+	std::vector<int> objectInstances; // Instance of each object in sceneBVH, -1 if it has no mesh
+	std::vector<BVHStats> meshBVHStats; // Computed once per build, walking big trees every frame is too slow
+	int statsMesh = 0;
 
 	int numberOfSamples = 1;
 	int maxBounces = 5;
+	int bvhBuildThreads = ThreadPool::hardwareThreads();
 
 	void Init();
 	GLFWwindow* createWindow(const std::string& title);
 	void RenderGui(GLFWwindow* window);
+	void UpdateModelLoading();
 	static void Application::clearAccumulationBuffer(GLFWwindow* window);
 };
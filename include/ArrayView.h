@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Non-owning view of a contiguous array, a minimal stand-in for C++20 std::span.
+template<typename T>
+class ArrayView
+{
+public:
+	ArrayView() {};
+	ArrayView(T* data, size_t size) : ptr(data), count(size) {};
+
+	// Views of a const T can be made from both const and non-const vectors
+	template<typename U>
+	ArrayView(std::vector<U>& vector) : ptr(vector.data()), count(vector.size()) {};
+	template<typename U>
+	ArrayView(const std::vector<U>& vector) : ptr(vector.data()), count(vector.size()) {};
+
+	T* data() const { return ptr; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T& operator[](size_t i) const { return ptr[i]; }
+	T* begin() const { return ptr; }
+	T* end() const { return ptr + count; }
+
+private:
+	T* ptr = nullptr;
+	size_t count = 0;
+};
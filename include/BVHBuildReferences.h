@@ -0,0 +1,58 @@
+#pragma once
+#include "AABB.h"
+#include <vector>
+
+// Everything the BVH builder reads from a primitive, computed once per build.
+// Kept as a structure of arrays so every pass only streams the floats it needs
+// and the binning loops can later be vectorized over contiguous data.
+struct BVHBuildReferences {
+	std::vector<float> minX, minY, minZ;
+	std::vector<float> maxX, maxY, maxZ;
+	std::vector<float> centroidX, centroidY, centroidZ;
+	// The primitive a reference belongs to. Spatial splits give one primitive several references.
+	std::vector<int> primitive;
+
+	size_t size() const { return centroidX.size(); }
+	size_t bytes() const { return centroidX.capacity() * 9 * sizeof(float) + primitive.capacity() * sizeof(int); }
+
+	void resize(size_t count) {
+		minX.resize(count); minY.resize(count); minZ.resize(count);
+		maxX.resize(count); maxY.resize(count); maxZ.resize(count);
+		centroidX.resize(count); centroidY.resize(count); centroidZ.resize(count);
+		primitive.resize(count);
+	}
+
+	void clear() {
+		*this = BVHBuildReferences();
+	}
+
+	void set(int i, const AABB& bounds, const vec3& centroid) {
+		minX[i] = bounds.min.x; minY[i] = bounds.min.y; minZ[i] = bounds.min.z;
+		maxX[i] = bounds.max.x; maxY[i] = bounds.max.y; maxZ[i] = bounds.max.z;
+		centroidX[i] = centroid.x; centroidY[i] = centroid.y; centroidZ[i] = centroid.z;
+	}
+
+	AABB bounds(int i) const {
+		AABB result;
+		result.min = vec3(minX[i], minY[i], minZ[i]);
+		result.max = vec3(maxX[i], maxY[i], maxZ[i]);
+		return result;
+	}
+
+	float minOf(int i, int axis) const {
+		return axis == 0 ? minX[i] : (axis == 1 ? minY[i] : minZ[i]);
+	}
+
+	float maxOf(int i, int axis) const {
+		return axis == 0 ? maxX[i] : (axis == 1 ? maxY[i] : maxZ[i]);
+	}
+
+	vec3 centroid(int i) const {
+		return vec3(centroidX[i], centroidY[i], centroidZ[i]);
+	}
+
+	// The centroid coordinates along one axis, 0 = x, 1 = y, 2 = z.
+	const float* centroids(int axis) const {
+		return axis == 0 ? centroidX.data() : (axis == 1 ? centroidY.data() : centroidZ.data());
+	}
+};
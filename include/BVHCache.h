@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "ArrayView.h"
+#include "BVHTree.h"
+#include "MappedFile.h"
+
+// Bump whenever BVHNode, the cache layout or the meaning of the node data changes.
+constexpr uint32_t BVH_CACHE_VERSION = 1;
+
+// Stores built BVHs on disk so that unchanged scenes skip the build on the next start.
+// Files are named after a hash of the primitive geometry and the build parameters.
+// The header repeats that key and a checksum of the payload, so a stale or damaged
+// file is rejected and the caller simply builds again.
+class BVHCache
+{
+public:
+	// Prevent instantiation of the class
+	BVHCache() = delete;
+
+	static uint64_t computeKey(ArrayView<const Primitive> primitives, const BVHBuildSettings& settings, int maxPrimitives);
+	// The key of the same triangles expanded into Primitives, both build the same tree.
+	static uint64_t computeKey(ArrayView<const vec3> positions, ArrayView<const uint32_t> indices, const BVHBuildSettings& settings, int maxPrimitives);
+	static std::string pathFor(const std::string& directory, uint64_t key);
+
+	// Maps the file and points nodes/indices straight into the mapping, nothing is copied.
+	static bool load(const std::string& path, uint64_t key, MappedFile& file,
+		ArrayView<const BVHNode>& nodes, ArrayView<const int>& indices);
+
+	static bool save(const std::string& path, uint64_t key,
+		ArrayView<const BVHNode> nodes, ArrayView<const int> indices);
+
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t nodeSize;
+		uint64_t key;
+		uint64_t nodeCount;
+		uint64_t indexCount;
+		uint64_t payloadHash;
+	};
+
+	static uint64_t hashBytes(const void* data, size_t size, uint64_t seed);
+	static uint64_t hashPayload(ArrayView<const BVHNode> nodes, ArrayView<const int> indices);
+	// Parts of computeKey(), geometryOf(i) gives the vertices of primitive i
+	template<typename GeometryOf>
+	static uint64_t hashGeometry(size_t count, GeometryOf geometryOf);
+	static uint64_t hashSettings(const BVHBuildSettings& settings, int maxPrimitives, uint64_t hash);
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include "ArrayView.h"
+#include <string>
+#include <vector>
+
+struct BVHNode;
+
+// Wall time of the build phases in milliseconds. A tree loaded from the cache only has cacheMs.
+struct BVHBuildTimings {
+	float cacheMs = 0.0f;		// Hashing the primitives and reading or writing the cache file
+	float referencesMs = 0.0f;	// Bounds and centroids of every primitive
+	float hierarchyMs = 0.0f;	// Splitting the nodes, for the LBVH also sorting and the treelet pass
+	float optimizeMs = 0.0f;	// Reinsertion pass, bounded by BVHBuildSettings::optimizationBudgetMs
+	float flattenMs = 0.0f;		// Pre-order layout and escape indices
+	float totalMs = 0.0f;
+};
+
+// Outcome of the reinsertion pass after a build, all zero when it did not run.
+struct BVHOptimizationReport {
+	float sahBefore = 0.0f;
+	float sahAfter = 0.0f;
+	int passes = 0;			// Sweeps over all nodes, the last one may be cut short by the budget
+	int reinsertions = 0;	// Nodes that were moved to a better place
+	bool budgetExhausted = false;
+};
+
+// Quality and size of one flattened BVH, so that builders and build settings can be compared by numbers.
+struct BVHStats {
+	float sahCost = 0.0f;	// Same cost model as the builders, relative to the surface area of the root
+	int nodeCount = 0;
+	int leafCount = 0;
+	int primitiveCount = 0;
+	int referenceCount = 0;	// More than primitiveCount when the SBVH has split primitives
+	int minLeafDepth = 0;
+	int maxLeafDepth = 0;
+	float averageLeafDepth = 0.0f;
+	std::vector<int> leafSizeHistogram;		// [n] is the number of leaves with n references
+	std::vector<int> leafDepthHistogram;	// [d] is the number of leaves at depth d
+	// Surface area of the overlap of the two children of an inner node, relative to the root
+	// and averaged over the inner nodes. Rays in the overlap have to visit both children.
+	float averageSiblingOverlap = 0.0f;
+	size_t nodeBytes = 0;
+	size_t indexBytes = 0;
+	size_t buildPeakBytes = 0; // See BVHTree::getBuildPeakBytes()
+	bool loadedFromCache = false;
+	BVHBuildTimings buildTimings;
+	BVHOptimizationReport optimization;
+
+	// Everything but the timings, the optimization report and the cache flag, which only the tree knows.
+	static BVHStats compute(ArrayView<const BVHNode> nodes, ArrayView<const int> indices, int primitiveCount);
+
+	// One JSON object, every line after the first indented by indent spaces so it can be nested.
+	std::string toJson(int indent = 0) const;
+	bool writeJson(const std::string& path) const;
+};
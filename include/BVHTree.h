@@ -1,8 +1,15 @@
 #pragma once
 #include "VectorUtils4.h"
 #include "Primitive.h"
+#include "IndexedMesh.h"
 #include "AABB.h"
 #include "BoundingHelper.h"
+#include "ThreadPool.h"
+#include "BVHBuildReferences.h"
+#include "ArrayView.h"
+#include "MappedFile.h"
+#include "BVHStats.h"
+#include <string>
 #include <vector>
 #include <numeric> // For std::iota
 
@@ -18,24 +25,148 @@ struct BVHNode {
 	int pad1;
 };
 
+enum class BVHBuilder {
+	BinnedSAH,		// Object splits only, every primitive ends up in exactly one leaf
+	SpatialSplits,	// SBVH, may also split space and reference a primitive from several leaves
+	Linear			// LBVH, sorts the primitives along a Morton curve, builds in a fraction of the time
+};
+
+struct BVHBuildSettings {
+	BVHBuilder builder = BVHBuilder::BinnedSAH;
+	int threadCount = 0; // 0 means every hardware thread
+
+	// SBVH only. Spatial splits are tried when the overlap of the best object split,
+	// relative to the surface area of the root, is larger than splitAlpha.
+	float splitAlpha = 1e-5f;
+	// SBVH only. Extra references allowed as a fraction of the primitive count, 0.5 = 50% more.
+	float maxDuplication = 0.5f;
+
+	// LBVH only. 63-bit Morton codes tell apart primitives that 30 bits put in the same grid cell,
+	// which matters for large or very unevenly spread meshes, at twice the sorting work.
+	bool mortonCodes64 = false;
+	// LBVH only. Reorders every treelet of up to 7 subtrees for the lowest SAH cost after the build,
+	// which wins back most of the trace speed lost to the Morton order.
+	bool optimizeTreelets = false;
 
+	// Any builder. Time in milliseconds the reinsertion pass may spend lowering the SAH cost after
+	// the build, 0 skips it. Worth seconds for a static scene that is rendered for hours.
+	float optimizationBudgetMs = 0.0f;
+
+	// SceneBVH::refitInstance() rebuilds the top-level tree instead once its SAH cost has grown
+	// past this factor of the cost right after the last build.
+	float refitRebuildRatio = 1.5f;
+};
 
 class BVHTree {
 public:
-	BVHTree(std::vector<Primitive>& primitives);
+	// An empty tree, built by the first rebuild() so that settings and cache directory can be set first.
+	BVHTree() {};
+	// The primitives are borrowed, not copied. They must stay alive and in place until the next
+	// rebuild(), so a temporary vector cannot be passed here.
+	BVHTree(ArrayView<const Primitive> primitives);
+
+	void rebuild(ArrayView<const Primitive> newPrims);
+	// The same tree as for the mesh expanded into Primitives, built straight from the shared vertices.
+	// Borrowed like the primitives, the indices then take the place of primitive numbers.
+	void rebuild(const IndexedMesh& mesh);
 
-	void rebuild(const std::vector<Primitive>& newPrims);
+	// Point either into the built arrays or straight into a memory-mapped cache file.
+	// Valid until the next rebuild().
+	ArrayView<const BVHNode> getNodes() const { return nodeView; }
+	ArrayView<const int> getIndices() const { return indexView; }
+	ArrayView<const Primitive> getPrimitives() const { return primitives; }
+	// Primitives, or triangles of the IndexedMesh, the tree was built over
+	int getPrimitiveCount() const { return meshIndices.empty() ? int(primitives.size()) : int(meshIndices.size() / 3); }
 
-	const std::vector<BVHNode>& getNodes() { return nodes; }
-	const std::vector<int>& getIndices() { return triangleIndices; }
+	// Built trees are stored in this directory and reused by rebuild() when the primitives and
+	// build settings match. Empty disables the cache.
+	void setCacheDirectory(const std::string& directory) { cacheDirectory = directory; }
+	bool wasLoadedFromCache() const { return loadedFromCache; }
+
+	// Used by the next rebuild().
+	void setBuildSettings(const BVHBuildSettings& newSettings) { settings = newSettings; }
+	const BVHBuildSettings& getBuildSettings() const { return settings; }
+	// Number of threads used by rebuild(), 0 means every hardware thread.
+	void setThreadCount(int count) { settings.threadCount = count; }
+	int getThreadCount() const { return settings.threadCount; }
+	float getBuildTimeMs() const { return buildTimeMs; }
+	// SAH cost of the current tree
+	float getSAHCost() const { return sahCost; }
+	// Phases of the last rebuild(), or only the cache load when the tree came from the cache.
+	const BVHBuildTimings& getBuildTimings() const { return buildTimings; }
+	// SAH cost before and after the reinsertion pass of the last rebuild(), zero if it did not run.
+	const BVHOptimizationReport& getOptimizationReport() const { return optimizationReport; }
+	// Most memory the tree and its build arrays held at once during the last rebuild(), not counting
+	// the borrowed primitives.
+	size_t getBuildPeakBytes() const { return buildPeakBytes; }
+	// Walks the whole tree, meant for the UI and reports rather than every frame.
+	BVHStats computeStats() const;
 private:
-	int largestDepth;
-	int smallestDepth;
-	int maxPrimitives;
-	std::vector<Primitive> primitives; //Trianglarna
+	struct ObjectSplit {
+		int axis = 0;
+		float position = 0.0f;	// Centroids below the position go left
+		float cost = FLT_MAX;	// FLT_MAX if no bin boundary passed the balance filter
+		AABB leftBounds;
+		AABB rightBounds;
+		bool degenerate = false; // The centroids are too close together to split
+	};
+	struct SpatialSplit {
+		int axis = 0;
+		float position = 0.0f;
+		float cost = FLT_MAX;
+	};
+
+	int largestDepth = 0;
+	int smallestDepth = 0;
+	int maxPrimitives = 2;
+	ArrayView<const Primitive> primitives; //Trianglarna, lnade frn scenen
+	// Or the positions and indices of an IndexedMesh, also borrowed. Empty when built over primitives.
+	ArrayView<const vec3> meshPositions;
+	ArrayView<const uint32_t> meshIndices;
 	std::vector<int> triangleIndices; //Denna listan hittar trianglarna relaterat till noderna i trdet.
 	std::vector<BVHNode> nodes; //Noderna med children  AABB
-	AABB computeBounds(int start, int count);
-	int buildRecursive(int start, int count, int depth);
+	BVHBuildSettings settings;
+	float buildTimeMs = 0.0f;
+	BVHBuildTimings buildTimings;
+	BVHOptimizationReport optimizationReport;
+	size_t buildPeakBytes = 0;
+	float sahCost = 0.0f;
+
+	std::string cacheDirectory;
+	MappedFile cacheFile;
+	bool loadedFromCache = false;
+	ArrayView<const BVHNode> nodeView;
+	ArrayView<const int> indexView;
+
+	// Per-reference bounds and centroids, only alive during a build.
+	BVHBuildReferences refs;
+	// Nodes in the order the build tasks created them, flattened into pre-order afterwards.
+	std::vector<BVHNode> buildNodes;
+	std::atomic<int> buildNodeCount{ 0 };
+
+	// SBVH bookkeeping, references are allocated from refs and leaves from triangleIndices.
+	float rootArea = 0.0f;
+	int maxReferences = 0;
+	std::atomic<int> referenceCount{ 0 };
+	std::atomic<int> leafReferenceCount{ 0 };
+
+	void chooseLeafSize();
+	void rebuildInput();
+	void build();
+	void notePeakMemory(size_t extraBytes = 0);
+	AABB computeBounds(ThreadPool& pool, const int* ids, int count);
+	AABB computeCentroidBounds(ThreadPool& pool, const int* ids, int count);
+	ObjectSplit findObjectSplit(ThreadPool& pool, const int* ids, int count, const AABB& bounds);
+	SpatialSplit findSpatialSplit(const int* ids, int count, const AABB& bounds);
+	void splitReference(int ref, const AABB& refBounds, int axis, float position, AABB& left, AABB& right);
+	void buildRecursive(ThreadPool& pool, TaskGroup& group, int nodeIndex, int start, int count);
+	void buildSpatialRecursive(ThreadPool& pool, TaskGroup& group, int nodeIndex, std::vector<int> ids);
+	struct LinearHierarchy;
+	void buildLinear(ThreadPool& pool);
+	void emitLinearRecursive(ThreadPool& pool, LinearHierarchy& hierarchy, int nodeIndex, int linearNode);
+	void optimizeTreelet(int nodeIndex, std::vector<float>& costs);
+	void optimizeByReinsertion();
+	int flattenRecursive(int buildIndex, int depth, std::vector<int>& packedIndices);
+	float computeSAHCost() const;
 	void traverseTree();
 };
\ No newline at end of file
@@ -6,26 +6,27 @@
 #include <algorithm>
 
 
+// A flat side is padded, the slab test hardly ever hits a box of zero thickness
+inline AABB computeAABB(const vec3& vertex1, const vec3& vertex2, const vec3& vertex3) {
+	AABB aabb;
+	float eps = 1e-4f;
+	aabb.max = vec3::max(vec3::max(vertex1, vertex2), vertex3);
+	aabb.min = vec3::min(vec3::min(vertex1, vertex2), vertex3);
+	for (int axis = 0; axis < 3; axis++) {
+		if (aabb.max[axis] == aabb.min[axis]) {
+			aabb.max[axis] += eps;
+			aabb.min[axis] -= eps;
+		}
+	}
+	return aabb;
+}
+
 inline AABB computeAABB(const Primitive& tri) {
 	AABB aabb;
 	vec3 max;
 	vec3 min;
-	float eps = 1e-4f;
 	if (tri.ID == 0) {
-		max = vec3::max(vec3::max(tri.vertex1, tri.vertex2), tri.vertex3);
-		min = vec3::min(vec3::min(tri.vertex1, tri.vertex2), tri.vertex3);
-		if (max.x == min.x) {
-			max.x += eps;
-			min.x -= eps;
-		}
-		if (max.y == min.y) {
-			max.y += eps;
-			min.y -= eps;
-		}
-		if (max.z == min.z) {
-			max.z += eps;
-			min.z -= eps;
-		}
+		return computeAABB(tri.vertex1, tri.vertex2, tri.vertex3);
 	}
 	else if (tri.ID == 1) {
 		max = vec3(tri.vertex1) + vec3(tri.vertex2.x);
@@ -56,6 +57,18 @@ inline AABB mergeAABB(const AABB& a, const AABB& b) {
 	return result;
 }
 
+// The part of space covered by both boxes. Empty (min > max on some axis) if they do not overlap.
+inline AABB intersectionAABB(const AABB& a, const AABB& b) {
+	AABB result;
+	result.min = vec3::max(a.min, b.min);
+	result.max = vec3::min(a.max, b.max);
+	return result;
+}
+
+inline bool isEmptyAABB(const AABB& aabb) {
+	return aabb.min.x > aabb.max.x || aabb.min.y > aabb.max.y || aabb.min.z > aabb.max.z;
+}
+
 inline float surfaceArea(const AABB& aabb) {
 	vec3 extents = aabb.max - aabb.min;
 	return 2.0f * (extents.x * extents.y + extents.x * extents.z + extents.y * extents.z);
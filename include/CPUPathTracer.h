@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "ArrayView.h"
+#include "Camera.h"
+#include "Light.h"
+#include "SceneBVH.h"
+#include "ThreadPool.h"
+
+struct CPURenderSettings {
+	int width = 800;
+	int height = 600;
+	int samplesPerPixel = 1;	// Per frame, numberOfSamples in the shader
+	int maxBounces = 5;
+	int threadCount = 0;		// 0 means every hardware thread
+	int tileSize = 16;			// Pixels along the side of the square tiles handed to the threads
+};
+
+// The path tracer of PathtraceShader.frag on the CPU, for machines without a GPU and as a reference.
+// It traverses the same SceneBVH, shades the same materials, samples the area lights the same way and
+// seeds its random numbers per pixel and frame like the shader, so frames accumulate to the same image.
+// Each frame is split into tiles that the threads of a work-stealing pool take as they become free.
+// Camera rays and the shadow rays of their first hits are traced in packets, see SceneBVH::intersectPacket().
+class CPUPathTracer
+{
+public:
+	// The scene and the lights are borrowed and must stay alive and unchanged while rendering.
+	CPUPathTracer(const SceneBVH& scene, ArrayView<const AreaLight> areaLights, ArrayView<const PointLight> pointLights);
+
+	void setSettings(const CPURenderSettings& newSettings);
+	const CPURenderSettings& getSettings() const { return settings; }
+
+	// Adds samplesPerPixel samples to every pixel, blended into the image like frameCount in the shader.
+	void renderFrame(Camera camera);
+	// Starts the accumulation over, needed after the camera or the scene changed.
+	void reset();
+
+	// Average of all frames so far, linear radiance, rows from the top.
+	const std::vector<vec3>& getImage() const { return image; }
+	int getFrameCount() const { return frameCount; }
+	float getLastFrameMs() const { return lastFrameMs; }
+	// Camera paths per second over all frames since reset()
+	double getSamplesPerSecond() const;
+
+private:
+	// The camera uniforms of the shader
+	struct CameraFrame {
+		vec3 position;
+		vec3 forward;
+		vec3 right;
+		vec3 up;
+		float imagePlaneWidth;
+		float imagePlaneHeight;
+	};
+	struct Ray {
+		vec3 direction;
+		vec3 startPoint;
+		vec3 endPoint;
+	};
+
+	const SceneBVH& scene;
+	ArrayView<const AreaLight> areaLights;
+	ArrayView<const PointLight> pointLights;
+	CPURenderSettings settings;
+	std::unique_ptr<ThreadPool> pool;
+
+	std::vector<vec3> image;
+	int frameCount = 0;
+	float lastFrameMs = 0.0f;
+	double renderSeconds = 0.0;
+	long long renderedSamples = 0;
+
+	void renderTile(const CameraFrame& camera, int tileX, int tileY);
+	// The first hit and, if it is glossy, whether each area light sample is shadowed can be passed in
+	// when they were traced in a packet. Everything after the first hit is traced here.
+	vec3 raytrace(Ray ray, uint32_t& seed, const SceneHit* firstHit = nullptr, const char* firstShadows = nullptr) const;
+	// shadows holds a flag per area light, or is null to trace the shadow rays here
+	vec3 directIllumination(const vec3& hitPoint, const vec3& normal, const vec3& surfaceColor, uint32_t& seed, const char* shadows = nullptr) const;
+	// A random point on the light, two numbers from seed
+	static vec3 lightSample(const AreaLight& light, uint32_t& seed);
+	bool isInShadow(const vec3& startPoint, const vec3& target) const;
+};
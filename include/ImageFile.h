@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "VectorUtils4.h"
+
+// Writes and reads rendered images, given as rows from the top like CPUPathTracer::getImage().
+class ImageFile
+{
+public:
+	// Prevent instantiation of the class
+	ImageFile() = delete;
+
+	// Linear radiance in 32-bit floats as a Portable Float Map, which HDR viewers and most image tools open.
+	static bool writePFM(const std::string& path, const std::vector<vec3>& pixels, int width, int height);
+	// 8 bits per channel with the gamma of DisplayShader.frag, so it looks like the window.
+	static bool writePPM(const std::string& path, const std::vector<vec3>& pixels, int width, int height);
+	// One of the above by the extension of path, .pfm or .ppm
+	static bool write(const std::string& path, const std::vector<vec3>& pixels, int width, int height);
+
+	// Reads a color Portable Float Map as written by writePFM(), in either byte order, into rows from the top.
+	static bool readPFM(const std::string& path, std::vector<vec3>& pixels, int& width, int& height);
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include "VectorUtils4.h"
+#include "Primitive.h"
+#include <cstdint>
+#include <vector>
+
+// Triangles that share their corners. A vertex is one distinct pair of position and normal from the
+// file, so a closed mesh stores each corner once rather than once for each of the ~6 triangles around it.
+struct IndexedMesh {
+	std::vector<vec3> positions;
+	std::vector<vec3> normals;		// One per position
+	std::vector<uint32_t> indices;	// Three per triangle, in the winding of the file
+	// OBJ materials are not read, the whole mesh has this one
+	Material material;
+
+	size_t triangleCount() const { return indices.size() / 3; }
+	size_t bytes() const {
+		return positions.capacity() * sizeof(vec3) + normals.capacity() * sizeof(vec3) + indices.capacity() * sizeof(uint32_t);
+	}
+};
+
+// Matches MeshVertex in PathtraceShader.frag (std430).
+struct MeshVertex {
+	vec3 position;
+	uint32_t normal;	// See packNormal()
+};
+
+// Matches IndexedTriangle in PathtraceShader.frag (std430). The tracer computes the edges from the
+// vertices, which is a few subtractions against 32 bytes less to fetch per triangle.
+struct IndexedTriangle {
+	uint32_t vertex1, vertex2, vertex3;	// Relative to the first vertex of the mesh
+	int material;
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <atomic>
+
+// Shared between a loader running on a worker thread and the UI showing it. The loader raises
+// fraction from 0 to 1 and gives up at its next check once cancelled is set.
+struct LoadProgress {
+	std::atomic<float> fraction{ 0.0f };
+	std::atomic<bool> cancelled{ false };
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <VectorUtils4.h>
+#include "IndexedMesh.h"
+
+// The geometry of one model file. Every Object that loads the same file shares one Mesh,
+// so the triangles are stored, uploaded and given a BVH once however many times it is placed.
+class Mesh
+{
+public:
+	// Returns the already loaded mesh if some object still uses the file.
+	static std::shared_ptr<Mesh> Load(const std::string& path);
+	// The mesh of the file if some object still uses it, null otherwise.
+	static std::shared_ptr<Mesh> Find(const std::string& path);
+	// Shares geometry loaded elsewhere, e.g. on a worker thread, like Load() would have.
+	static std::shared_ptr<Mesh> Create(const std::string& path, IndexedMesh geometry);
+
+	// Uploads everything at once.
+	void BindBuffers();
+	// Or creates the buffers and fills them at most maxBytes per call, so a large model does not
+	// stall a frame. ContinueUpload() returns true once everything is on the GPU.
+	void BeginUpload();
+	bool ContinueUpload(size_t maxBytes);
+	bool IsUploaded() const;
+	float GetUploadProgress() const;
+
+	std::string path;
+	unsigned int VAO = 0, VBO = 0, NBO = 0, EBO = 0;
+
+	// In object space. Drawn as it is by the rasterizer and traced through its index buffer by the path tracer.
+	IndexedMesh geometry;
+
+private:
+	size_t uploadedBytes = 0;
+
+	size_t UploadBytes() const;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "AABB.h"
+#include "IndexedMesh.h"
+#include "LoadProgress.h"
+
+// Bump whenever the header, the range layout or Material changes.
+constexpr uint32_t MESH_FILE_VERSION = 1;
+
+// A converted model, see tools/ObjToMesh. The arrays are stored exactly as IndexedMesh and the
+// vertex buffers hold them, so loading is a few copies out of the memory mapping instead of a parse:
+//   Header, MaterialRange[rangeCount], vec3 positions[vertexCount], vec3 normals[vertexCount],
+//   uint32_t indices[3 * triangleCount]
+class MeshFile
+{
+public:
+	// Prevent instantiation of the class
+	MeshFile() = delete;
+
+	// Triangles [firstTriangle, firstTriangle + triangleCount) use material
+	struct MaterialRange {
+		uint32_t firstTriangle;
+		uint32_t triangleCount;
+		Material material;
+	};
+
+	static bool load(const std::string& path, IndexedMesh& mesh, AABB* bounds = nullptr);
+	static bool save(const std::string& path, const IndexedMesh& mesh);
+
+	// A .mesh or an .obj file by its extension. For an .obj with an up to date .mesh next to it
+	// the .mesh is loaded instead, so converted models skip the parse without renaming them anywhere.
+	// The progress is only followed while parsing an .obj, a .mesh loads too fast to need it.
+	static bool loadModel(const std::string& path, IndexedMesh& mesh, LoadProgress* progress = nullptr);
+	static bool isMeshFile(const std::string& path);
+
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t rangeSize;	// sizeof(MaterialRange), catches a changed Material
+		uint64_t vertexCount;
+		uint64_t triangleCount;
+		uint64_t rangeCount;
+		vec3 boundsMin;
+		vec3 boundsMax;
+	};
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include "IndexedMesh.h"
+#include "LoadProgress.h"
+
+// Loads one model file on a worker thread, so the window keeps drawing while a large OBJ is parsed.
+// Everything touching OpenGL stays on the render thread, which takes the finished geometry and
+// uploads it from there.
+class ModelLoader
+{
+public:
+	ModelLoader() {};
+	~ModelLoader();
+
+	ModelLoader(const ModelLoader&) = delete;
+	ModelLoader& operator=(const ModelLoader&) = delete;
+
+	// Ignored while another file is still loading.
+	void Start(const std::string& path);
+	// The worker stops at its next check and the result is dropped.
+	void Cancel();
+
+	bool IsLoading() const { return worker.joinable() && !finished; }
+	bool IsFinished() const { return worker.joinable() && finished; }
+	float GetProgress() const { return progress.fraction; }
+	const std::string& GetPath() const { return path; }
+
+	// Once IsFinished(), hands over the geometry and makes the loader idle again.
+	// False if the file failed to load or the load was cancelled.
+	bool TakeResult(IndexedMesh& mesh);
+
+private:
+	std::thread worker;
+	std::string path;
+	LoadProgress progress;
+	std::atomic<bool> finished{ false };
+	bool succeeded = false;
+	IndexedMesh result;
+};
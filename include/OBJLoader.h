@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 #include "VectorUtils4.h"
+#include "IndexedMesh.h"
+#include "LoadProgress.h"
 
 class OBJLoader
 {
@@ -10,11 +12,13 @@ public:
 	// Prevent instantiation of the class
 	OBJLoader() = delete;
 
-	static bool loadOBJ(const std::string& path,
-		std::vector<vec3>& out_vertices,
-		std::vector<vec2>& out_uvs,
-		std::vector<vec3>& out_normals);
+	// Corners that use the same position and normal become one vertex of the mesh. Faces may be
+	// v, v/vt, v//vn or v/vt/vn with negative indices, polygons are split into triangles.
+	// Large files are parsed in chunks on threadCount threads, 0 means every hardware thread.
+	// With a progress the load can be followed and cancelled from another thread, false is then returned.
+	static bool loadOBJ(const std::string& path, IndexedMesh& mesh, int threadCount = 0, LoadProgress* progress = nullptr);
 
 private:
 
 };
+
@@ -1,11 +1,11 @@
 #pragma once
 
 #include <glad/glad.h>
-#include <vector>
+#include <memory>
 #include <VectorUtils4.h>
 #include "Primitive.h"
 #include <string>
-#include "OBJLoader.h"
+#include "Mesh.h"
 
 class Object
 {
@@ -27,16 +27,8 @@ public:
 
 	mat4 modelMatrix = S(scale.x, scale.y, scale.z) * T(position.x, position.y, position.z) * Rz(rotation.z * M_PI / 180.0f) * Ry(rotation.y * M_PI / 180.0f) * Rx(rotation.x * M_PI / 180.0f);
 
-	unsigned int VAO, VBO, NBO;
-
-	// For rendering using rasterization
-	std::vector<vec3> vertices;
-	std::vector<vec2> uvs;
-	std::vector<vec3> normals;
-	// ----------------------------------
-
-	// For rendering using ray tracing
-	std::vector<Primitive> primitives;
+	// Shared with every other object using the same model file
+	std::shared_ptr<Mesh> mesh;
 
 private:
 
@@ -0,0 +1,276 @@
+// The packet traversal of SceneBVH::intersectPacket(), written once for every instruction set.
+// Not a normal header: SceneBVHPacket.cpp includes it once per set, with the Float and Mask types of
+// that set declared in PACKET_NAMESPACE and PACKET_TARGET, PACKET_WIDTH and PACKET_FUNCTION defined.
+// Every function here carries PACKET_TARGET, so only these functions use the wider instructions and
+// the rest of the program still runs on any CPU.
+
+namespace PACKET_NAMESPACE {
+	// PACKET_WIDTH rays in one space, one ray per lane
+	struct Rays {
+		Float originX, originY, originZ;
+		Float directionX, directionY, directionZ;
+		Float inverseX, inverseY, inverseZ;
+	};
+
+	PACKET_TARGET inline Rays loadRays(const float (*origins)[PACKET_WIDTH], const float (*directions)[PACKET_WIDTH]) {
+		Rays rays;
+		rays.originX = load(origins[0]);
+		rays.originY = load(origins[1]);
+		rays.originZ = load(origins[2]);
+		rays.directionX = load(directions[0]);
+		rays.directionY = load(directions[1]);
+		rays.directionZ = load(directions[2]);
+		Float one = broadcast(1.0f);
+		rays.inverseX = one / rays.directionX;
+		rays.inverseY = one / rays.directionY;
+		rays.inverseZ = one / rays.directionZ;
+		return rays;
+	}
+
+	// The slab test of intersectBox() for every lane. Set for the lanes that enter the box before their
+	// closest hit, tNear gets the entry distances.
+	PACKET_TARGET inline Mask intersectBox(const Rays& rays, float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+		const Float& closest, Float& tNear) {
+		Float x1 = (broadcast(minX) - rays.originX) * rays.inverseX;
+		Float x2 = (broadcast(maxX) - rays.originX) * rays.inverseX;
+		Float y1 = (broadcast(minY) - rays.originY) * rays.inverseY;
+		Float y2 = (broadcast(maxY) - rays.originY) * rays.inverseY;
+		Float z1 = (broadcast(minZ) - rays.originZ) * rays.inverseZ;
+		Float z2 = (broadcast(maxZ) - rays.originZ) * rays.inverseZ;
+		tNear = max(max(min(x1, x2), min(y1, y2)), min(z1, z2));
+		Float tFar = min(min(max(x1, x2), max(y1, y2)), max(z1, z2));
+		return (tFar >= max(tNear, broadcast(0.0f))) & (tNear < closest);
+	}
+
+	// intersectTriangle() for every lane, in the same order of operations so each lane gets the same t.
+	// Set for the lanes that hit the front face closer than their closest hit.
+	PACKET_TARGET inline Mask intersectTriangle(const Rays& rays, const PrimitiveGeometry& triangle, const Float& closest, Float& t) {
+		vec3 normal = unpackNormal(triangle.normal);
+		Float facing = rays.directionX * broadcast(normal.x) + rays.directionY * broadcast(normal.y) + rays.directionZ * broadcast(normal.z);
+
+		Float e1x = broadcast(triangle.edge1.x), e1y = broadcast(triangle.edge1.y), e1z = broadcast(triangle.edge1.z);
+		Float e2x = broadcast(triangle.edge2.x), e2y = broadcast(triangle.edge2.y), e2z = broadcast(triangle.edge2.z);
+		Float px = rays.directionY * e2z - rays.directionZ * e2y;
+		Float py = rays.directionZ * e2x - rays.directionX * e2z;
+		Float pz = rays.directionX * e2y - rays.directionY * e2x;
+		Float det = e1x * px + e1y * py + e1z * pz;
+
+		Float tx = rays.originX - broadcast(triangle.vertex1.x);
+		Float ty = rays.originY - broadcast(triangle.vertex1.y);
+		Float tz = rays.originZ - broadcast(triangle.vertex1.z);
+		Float u = (tx * px + ty * py + tz * pz) / det;
+
+		Float qx = ty * e1z - tz * e1y;
+		Float qy = tz * e1x - tx * e1z;
+		Float qz = tx * e1y - ty * e1x;
+		Float v = (rays.directionX * qx + rays.directionY * qy + rays.directionZ * qz) / det;
+		t = (e2x * qx + e2y * qy + e2z * qz) / det;
+
+		Float zero = broadcast(0.0f);
+		Float one = broadcast(1.0f);
+		return (facing < zero) & (u >= zero) & (u <= one) & (v >= zero) & (v <= one - u) & (t > zero) & (t < closest);
+	}
+
+	PACKET_TARGET inline float largestLane(const Float& values, int laneBits) {
+		alignas(64) float lanes[PACKET_WIDTH];
+		store(lanes, values);
+		float largest = -FLT_MAX;
+		for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+			if (laneBits & (1 << lane)) {
+				largest = std::max(largest, lanes[lane]);
+			}
+		}
+		return largest;
+	}
+
+	PACKET_TARGET inline float smallestLane(const Float& values, int laneBits) {
+		alignas(64) float lanes[PACKET_WIDTH];
+		store(lanes, values);
+		float smallest = FLT_MAX;
+		for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+			if (laneBits & (1 << lane)) {
+				smallest = std::min(smallest, lanes[lane]);
+			}
+		}
+		return smallest;
+	}
+}
+
+PACKET_TARGET void PacketTraversal::PACKET_FUNCTION(const SceneBVH& scene, const vec3* origins, const vec3* directions, int count, SceneHit* hits, bool includeGlass)
+{
+	using namespace PACKET_NAMESPACE;
+
+	// Lanes past count repeat the first ray and are masked out
+	alignas(64) float worldOrigins[3][PACKET_WIDTH];
+	alignas(64) float worldDirections[3][PACKET_WIDTH];
+	alignas(64) float laneIndex[PACKET_WIDTH];
+	for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+		int ray = lane < count ? lane : 0;
+		for (int axis = 0; axis < 3; axis++) {
+			worldOrigins[axis][lane] = origins[ray][axis];
+			worldDirections[axis][lane] = directions[ray][axis];
+		}
+		laneIndex[lane] = float(lane);
+	}
+	Rays world = loadRays(worldOrigins, worldDirections);
+	Mask active = load(laneIndex) < broadcast(float(count));
+	int activeBits = bits(active);
+
+	Float closest = broadcast(1e30f);
+	float closestLargest = 1e30f;
+	int hitPrimitive[PACKET_WIDTH];
+	int hitInstance[PACKET_WIDTH];
+	std::fill(hitPrimitive, hitPrimitive + PACKET_WIDTH, -1);
+	std::fill(hitInstance, hitInstance + PACKET_WIDTH, -1);
+
+	struct Entry {
+		int node;
+		float t;	// Nearest entry of the rays that hit the node
+	};
+	// Kept per thread, so that a packet only allocates when a deeper tree than before comes along
+	static thread_local std::vector<Entry> stack;
+
+	int topIndex = 0;
+	int topCount = int(scene.topLevelNodes.size());
+	while (topIndex < topCount) {
+		const BVHNode& topNode = scene.topLevelNodes[topIndex];
+		Float tNear;
+		Mask entering = intersectBox(world, topNode.bBoxMin.x, topNode.bBoxMin.y, topNode.bBoxMin.z,
+			topNode.bBoxMax.x, topNode.bBoxMax.y, topNode.bBoxMax.z, closest, tNear) & active;
+		if (!bits(entering)) {
+			topIndex = topNode.escapeIndex;
+			continue;
+		}
+		if (topNode.triangleCount == 0) {
+			topIndex = topNode.leftChild;
+			continue;
+		}
+
+		for (int instanceIndex = topNode.startTriangle; instanceIndex < topNode.startTriangle + topNode.triangleCount; instanceIndex++) {
+			const auto& instance = scene.instances[scene.instanceOrder[instanceIndex]];
+			const auto& mesh = scene.meshes[instance.mesh];
+			if (mesh.wideTree.getNodeCount() == 0) {
+				continue;
+			}
+
+			// Into object space lane by lane, exactly as intersect() does it
+			alignas(64) float localOrigins[3][PACKET_WIDTH];
+			alignas(64) float localDirections[3][PACKET_WIDTH];
+			for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+				vec3 origin(worldOrigins[0][lane], worldOrigins[1][lane], worldOrigins[2][lane]);
+				vec3 direction(worldDirections[0][lane], worldDirections[1][lane], worldDirections[2][lane]);
+				vec3 localOrigin = instance.worldToObject * origin;
+				vec3 localDirection = instance.worldToObject * (origin + direction) - localOrigin;
+				for (int axis = 0; axis < 3; axis++) {
+					localOrigins[axis][lane] = localOrigin[axis];
+					localDirections[axis][lane] = localDirection[axis];
+				}
+			}
+			Rays local = loadRays(localOrigins, localDirections);
+
+			bool quantized = mesh.wideTree.getFormat() == BVHNodeFormat::Quantized;
+			stack.clear();
+			stack.reserve(mesh.wideTree.getMaxStackSize());
+			stack.push_back({ 0, 0.0f });
+			while (!stack.empty()) {
+				Entry entry = stack.back();
+				stack.pop_back();
+				if (entry.t >= closestLargest) {
+					continue; // Every ray found a closer hit after the node was pushed
+				}
+				GPUBVHNode decoded;
+				const GPUBVHNode& node = quantized
+					? WideBVH<GPU_BVH_WIDTH>::decode(mesh.wideTree.getQuantizedNodes()[entry.node], decoded)
+					: mesh.wideTree.getNodes()[entry.node];
+
+				// Inner children that any ray enters, pushed far to near so the nearest is visited next
+				Entry inner[GPU_BVH_WIDTH];
+				int innerCount = 0;
+				for (int child = 0; child < GPU_BVH_WIDTH && node.count[child] >= 0; child++) {
+					Float childNear;
+					Mask childEntering = intersectBox(local, node.minX[child], node.minY[child], node.minZ[child],
+						node.maxX[child], node.maxY[child], node.maxZ[child], closest, childNear) & active;
+					int enteringBits = bits(childEntering);
+					if (!enteringBits) {
+						continue;
+					}
+
+					if (node.count[child] == 0) {
+						float t = smallestLane(childNear, enteringBits);
+						int j = innerCount++;
+						while (j > 0 && inner[j - 1].t < t) {
+							inner[j] = inner[j - 1];
+							j--;
+						}
+						inner[j] = { node.child[child], t };
+						continue;
+					}
+
+					// A leaf, only the rays that entered it test its primitives
+					bool closestChanged = false;
+					for (int i = node.child[child]; i < node.child[child] + node.count[child]; i++) {
+						PrimitiveGeometry primitive = scene.loadPrimitive(mesh, i);
+						if (!includeGlass && scene.materials[primitive.material].materialType == 2) {
+							continue; // Glass does not cast shadows
+						}
+
+						if (primitive.ID == 0) {
+							Float t;
+							Mask hit = intersectTriangle(local, primitive, closest, t) & childEntering;
+							int hitBits = bits(hit);
+							if (!hitBits) {
+								continue;
+							}
+							closest = select(hit, t, closest);
+							for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+								if (hitBits & (1 << lane)) {
+									hitPrimitive[lane] = mesh.firstPrimitive + i;
+									hitInstance[lane] = instanceIndex;
+								}
+							}
+							closestChanged = true;
+							continue;
+						}
+
+						// Spheres are rare, they are tested one lane at a time
+						alignas(64) float closestLanes[PACKET_WIDTH];
+						store(closestLanes, closest);
+						for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+							if (!(enteringBits & (1 << lane))) {
+								continue;
+							}
+							vec3 origin(localOrigins[0][lane], localOrigins[1][lane], localOrigins[2][lane]);
+							vec3 direction(localDirections[0][lane], localDirections[1][lane], localDirections[2][lane]);
+							float t = intersectSphere(origin, direction, primitive);
+							if (t > 0.0f && t < closestLanes[lane]) {
+								closestLanes[lane] = t;
+								hitPrimitive[lane] = mesh.firstPrimitive + i;
+								hitInstance[lane] = instanceIndex;
+								closestChanged = true;
+							}
+						}
+						closest = load(closestLanes);
+					}
+					if (closestChanged) {
+						closestLargest = largestLane(closest, activeBits);
+					}
+				}
+				for (int i = 0; i < innerCount; i++) {
+					stack.push_back(inner[i]);
+				}
+			}
+		}
+		topIndex = topNode.escapeIndex;
+	}
+
+	alignas(64) float closestLanes[PACKET_WIDTH];
+	store(closestLanes, closest);
+	for (int lane = 0; lane < count; lane++) {
+		hits[lane] = SceneHit();
+		if (hitPrimitive[lane] >= 0) {
+			hits[lane].t = closestLanes[lane];
+			hits[lane].primitive = hitPrimitive[lane];
+			hits[lane].instance = hitInstance[lane];
+		}
+	}
+}
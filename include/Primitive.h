@@ -1,5 +1,6 @@
 #pragma once
 #include "VectorUtils4.h"
+#include <cstdint>
 
 struct Primitive {
     vec3 vertex1;
@@ -18,4 +19,35 @@ struct Primitive {
     
     
     
-};
\ No newline at end of file
+};
+
+// The shader does not read Primitive itself. A Primitive is split into the part that every intersection
+// test reads and its material, which is only fetched for the closest hit and shared by equal primitives.
+
+// Matches PrimitiveGeometry in PathtraceShader.frag (std430), 48 bytes instead of 112.
+struct PrimitiveGeometry {
+    vec3 vertex1;       // Sphere: the center
+    int ID;             // 0 == Triangle, 1 == Sphere
+    vec3 edge1;         // Sphere: the radius in x
+    int material;       // Index into the material table
+    vec3 edge2;
+    uint32_t normal;    // Octahedral encoding, see packNormal()
+};
+
+// Matches Material in PathtraceShader.frag (std430).
+struct Material {
+    vec3 color;
+    float smoothness;
+    int materialType;
+    float ior;
+    float bounceOdds;
+    int pad = 0;
+};
+
+PrimitiveGeometry geometryOf(const Primitive& primitive, int material);
+Material materialOf(const Primitive& primitive);
+
+// A unit vector folded onto an octahedron and stored as two 16-bit snorms, the layout of GLSL
+// packSnorm2x16, so the shader decodes it with unpackSnorm2x16 to within 1e-4 of the original.
+uint32_t packNormal(const vec3& normal);
+vec3 unpackNormal(uint32_t packed);
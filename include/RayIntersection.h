@@ -0,0 +1,69 @@
+#pragma once
+#include "BVHTree.h"
+#include "Primitive.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// The intersection tests of the CPU traversals, shared by SceneBVH::intersect() and the packet kernels,
+// so both find the same hits.
+
+// Same tests as triangleIntersectionTest/sphereIntersectionTest in PathtraceShader.frag, -1 on a miss
+inline float intersectTriangle(const vec3& origin, const vec3& direction, const PrimitiveGeometry& triangle) {
+	if (direction * unpackNormal(triangle.normal) >= 0.0f) {
+		return -1.0f; // Back face
+	}
+
+	vec3 P = cross(direction, triangle.edge2);
+	float det = triangle.edge1 * P;
+
+	vec3 T = origin - triangle.vertex1;
+	float u = (T * P) / det;
+	if (u < 0.0f || u > 1.0f) {
+		return -1.0f;
+	}
+
+	vec3 Q = cross(T, triangle.edge1);
+	float v = (direction * Q) / det;
+	if (v < 0.0f || v > 1.0f - u) {
+		return -1.0f;
+	}
+	float t = (triangle.edge2 * Q) / det;
+	return t < 0.0f ? -1.0f : t;
+}
+
+inline float intersectSphere(const vec3& origin, const vec3& direction, const PrimitiveGeometry& sphere) {
+	vec3 toOrigin = origin - sphere.vertex1;
+	float radius = sphere.edge1.x;
+	float c1 = direction * direction;
+	float c2 = 2.0f * (direction * toOrigin);
+	float c3 = toOrigin * toOrigin - radius * radius;
+
+	float arg = c2 * c2 - 4.0f * c1 * c3;
+	if (arg <= 0.0f) {
+		return -1.0f;
+	}
+
+	float t1 = (-c2 + std::sqrt(arg)) / (2.0f * c1);
+	float t2 = (-c2 - std::sqrt(arg)) / (2.0f * c1);
+	if (t1 > 0.0f && t2 > 0.0f) {
+		return std::min(t1, t2);
+	}
+	if (t1 > 0.0f) {
+		return t1;
+	}
+	return t2 > 0.0f ? t2 : -1.0f;
+}
+
+// Entry distance of the ray into the box, 1e30 if it misses, like intersectAABB in the shader
+inline float intersectBox(const vec3& origin, const vec3& directionInv, const BVHNode& node) {
+	float tNear = -FLT_MAX;
+	float tFar = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++) {
+		float t1 = (node.bBoxMin[axis] - origin[axis]) * directionInv[axis];
+		float t2 = (node.bBoxMax[axis] - origin[axis]) * directionInv[axis];
+		tNear = std::max(tNear, std::min(t1, t2));
+		tFar = std::min(tFar, std::max(t1, t2));
+	}
+	return tFar >= std::max(tNear, 0.0f) ? tNear : 1e30f;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// Instruction sets the packet traversal is compiled for. The binary is built for the baseline CPU and
+// the wider code paths are picked at runtime, so one build runs on every host and uses what it has.
+enum class SIMDLevel {
+	Scalar,	// One ray at a time, for CPUs without any of the below
+	SSE2,	// 4 rays per packet
+	AVX2,	// 8 rays per packet
+	AVX512	// 16 rays per packet, AVX-512F
+};
+
+// The widest level both the CPU and the operating system support, detected once.
+SIMDLevel detectSIMDLevel();
+const char* simdLevelName(SIMDLevel level);
+// Rays per packet
+int simdLevelWidth(SIMDLevel level);
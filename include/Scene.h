@@ -4,13 +4,11 @@
 #include <string>
 #include <fstream>
 #include <sstream>
-#include <glad/glad.h>
 #include <vector>
-#include "OBJLoader.h"
+#include "MeshFile.h"
 #include <VectorUtils4.h>
 #include "Primitive.h"
 #include "Light.h"
-#include "Object.h"
 
 class Scene
 {
@@ -24,11 +22,12 @@ public:
     void getRoom();
     void getSpheres();
     void getCrazyScene();;
-    void CreateSceneFromModel(const std::string& path, int index);
+    void CreateSceneFromModel(const std::string& path);
     
 
     std::vector<Primitive> primitives;
-    std::vector<Object> objects;
+    std::vector<IndexedMesh> models; // Placed as they are, in world space
+    std::vector<std::string> missingModels; // Files of CreateSceneFromModel() that failed to load
     std::vector<PointLight> pointLights;
     std::vector<AreaLight> areaLights;
 private:
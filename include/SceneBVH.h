@@ -0,0 +1,215 @@
+#pragma once
+
+#include "BVHTree.h"
+#include "WideBVH.h"
+#include "SIMDLevel.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One placed mesh as the shader sees it, matches Instance in PathtraceShader.frag (std430).
+struct BVHInstance {
+	float worldToObject[16]; // Column-major like GLSL
+	float objectToWorld[16];
+	// Where the mesh starts in the wide node and primitive buffers. The mesh trees are uploaded
+	// unchanged, so the shader adds these to the indices it reads from them.
+	int firstNode;
+	int nodeCount;
+	int firstPrimitive;	// In the triangle buffer for an IndexedMesh, else in the geometry buffer
+	int firstVertex;	// -1 unless the mesh is an IndexedMesh
+};
+
+struct SceneHit {
+	float t = -1.0f;
+	int primitive = -1;	// Numbers the primitives of all meshes after each other, see getPrimitiveSource()
+	int instance = -1;	// Index into getInstances()
+};
+
+// The hit primitive in world space with its material, what loadSurface() in the shader gathers for shading.
+struct SceneSurface {
+	vec3 vertex1;	// Sphere: the center
+	int ID = 0;		// 0 == Triangle, 1 == Sphere
+	vec3 normal;
+	Material material;
+};
+
+// Where an element of the primitive buffer came from.
+struct ScenePrimitiveSource {
+	int mesh = -1;
+	int primitive = -1; // Index into the vector given to addMesh(), or triangle of the IndexedMesh
+};
+
+// What SceneBVH::refitInstance() changed in getInstances() and getTopLevelNodes().
+struct SceneRefitResult {
+	bool rebuilt = false;	// The quality limit was hit and the top-level tree was rebuilt, everything changed
+	int instanceSlot = -1;	// Element of getInstances() holding the moved instance
+	int firstNode = 0;		// Top-level nodes [firstNode, firstNode + nodeCount) changed and have to be uploaded again
+	int nodeCount = 0;
+};
+
+// One mesh's part of the shader buffers, to be copied in at the given offsets.
+struct SceneMeshBuffers {
+	// A mesh of Primitives fills geometry, an IndexedMesh triangles and vertices. Either way element i
+	// holds primitive getIndices()[i] of the mesh tree, so a leaf covers the elements [startTriangle,
+	// startTriangle + triangleCount) directly and an SBVH reference becomes a copy of its primitive.
+	ArrayView<const PrimitiveGeometry> geometry;
+	ArrayView<const IndexedTriangle> triangles;
+	ArrayView<const MeshVertex> vertices;
+	// Only the view of the node format the scene was built with is filled
+	ArrayView<const GPUBVHNode> nodes;
+	ArrayView<const GPUQuantizedBVHNode> quantizedNodes;
+	int firstPrimitive = 0; // In the geometry or the triangle buffer, whichever the mesh fills
+	int firstVertex = 0;
+	int firstNode = 0;
+};
+
+// Two-level BVH. Every unique mesh gets its own tree in object space and a small top-level tree
+// over the instances places them in the world with their model matrix. Moving an instance only
+// rebuilds the top-level tree, and placing a mesh again costs one instance rather than a copy.
+// The mesh trees are traced as wide trees collapsed from the binary BVHTree, the top level stays binary.
+class SceneBVH {
+public:
+	// Every mesh and instance is dropped, meshes added again are rebuilt by the next build().
+	void clear();
+
+	// The same vector added twice is the same mesh, it must stay alive and unchanged until clear().
+	int addMesh(const std::vector<Primitive>& primitives);
+	// Traced through its shared vertices, see IndexedMesh. The same rules apply.
+	int addMesh(const IndexedMesh& mesh);
+	int addInstance(int mesh, const mat4& modelMatrix);
+	void setInstanceTransform(int instance, const mat4& modelMatrix);
+
+	// Builds the trees of meshes added since the last build, then the top-level tree.
+	void build();
+	// Enough after setInstanceTransform(), the mesh trees do not depend on the transforms.
+	void buildTopLevel();
+	// Moves an instance of a built scene without rebuilding: the top-level tree keeps its topology and
+	// only the boxes from the instance's leaf up to the root are recomputed. Once the SAH cost of the
+	// tree has grown past BVHBuildSettings::refitRebuildRatio times the cost after its last build, the
+	// top-level tree is rebuilt instead.
+	SceneRefitResult refitInstance(int instance, const mat4& modelMatrix);
+
+	// Closest hit along origin + t * direction with t > 0, the same traversal as the shader.
+	SceneHit intersect(const vec3& origin, const vec3& direction, bool includeGlass = true) const;
+	// The same for count rays, traced in packets of up to simdLevelWidth(getPacketLevel()) rays with one
+	// ray per SIMD lane. A node is entered when any ray of the packet hits it, which pays off for coherent
+	// rays like camera rays or shadow rays towards one light, and costs for scattered ones. Each ray gets
+	// the hit intersect() gives it, up to which of two primitives at exactly the same distance is taken.
+	void intersectPacket(const vec3* origins, const vec3* directions, int count, SceneHit* hits, bool includeGlass = true) const;
+	// The instruction set intersectPacket() uses, detectSIMDLevel() by default. Lower levels can be chosen
+	// for comparisons, higher ones than the CPU supports are clamped.
+	void setPacketLevel(SIMDLevel level);
+	SIMDLevel getPacketLevel() const { return packetLevel; }
+	// Shading data of a hit returned by intersect().
+	SceneSurface getSurface(const SceneHit& hit) const;
+
+	// The shader buffers hold the meshes after each other. The primitives of each mesh are stored in the
+	// leaf order of its tree, so the leaves need no index buffer, and a primitive that the SBVH split
+	// appears once for every leaf it is in. Node counts are wide nodes. Meshes of Primitives go into the
+	// geometry buffer, IndexedMeshes into the triangle and vertex buffers, getPrimitiveCount() counts both.
+	int getPrimitiveCount() const { return primitiveCount; }
+	int getGeometryCount() const { return geometryCount; }
+	int getTriangleCount() const { return triangleCount; }
+	int getVertexCount() const { return vertexCount; }
+	int getNodeCount() const { return nodeCount; }
+	// Stack entries a traversal of the deepest mesh tree can need, BVH_STACK_SIZE in the shader must
+	// be at least this.
+	int getMaxStackSize() const { return maxStackSize; }
+	SceneMeshBuffers getMesh(int mesh) const;
+	// The primitive as it was given to addMesh(), with its material. Triangles of an IndexedMesh are
+	// put together from its vertices.
+	Primitive getPrimitive(int primitive) const;
+	// Every distinct material of the scene once, PrimitiveGeometry::material indexes it
+	const std::vector<Material>& getMaterials() const { return materials; }
+	// The mesh and the element of the vector given to addMesh() that a primitive of the buffer came from
+	ScenePrimitiveSource getPrimitiveSource(int primitive) const;
+
+	// Ordered like the leaves of the top-level tree, which refer to them by startTriangle/triangleCount.
+	const std::vector<BVHInstance>& getInstances() const { return gpuInstances; }
+	const std::vector<BVHNode>& getTopLevelNodes() const { return topLevelNodes; }
+
+	// Applied to every mesh tree built after the call.
+	void setBuildSettings(const BVHBuildSettings& newSettings) { settings = newSettings; }
+	const BVHBuildSettings& getBuildSettings() const { return settings; }
+	void setThreadCount(int count) { settings.threadCount = count; }
+	int getThreadCount() const { return settings.threadCount; }
+	void setCacheDirectory(const std::string& directory) { cacheDirectory = directory; }
+	// Format of the wide mesh nodes, used from the next build(). getBuiltNodeFormat() is the
+	// format of the nodes getMesh() returns, which the shader has to be told.
+	void setNodeFormat(BVHNodeFormat format) { nodeFormat = format; }
+	BVHNodeFormat getNodeFormat() const { return nodeFormat; }
+	BVHNodeFormat getBuiltNodeFormat() const { return builtNodeFormat; }
+	size_t getNodeSize() const { return builtNodeFormat == BVHNodeFormat::Quantized ? sizeof(GPUQuantizedBVHNode) : sizeof(GPUBVHNode); }
+
+	int getMeshCount() const { return meshes.size(); }
+	int getCachedMeshCount() const;
+	int getInstanceCount() const { return instances.size(); }
+	float getBuildTimeMs() const { return buildTimeMs; }
+	float getTopLevelBuildTimeMs() const { return topLevelBuildTimeMs; }
+	// SAH cost of the top-level tree, and the cost right after its last build, refits only ever raise it
+	float getTopLevelSAHCost() const { return topLevelSAHCost; }
+	float getTopLevelBuildSAHCost() const { return topLevelBuildSAHCost; }
+
+	// Statistics of one mesh tree after build(), and of the top-level tree, whose leaves are instances.
+	BVHStats getMeshStats(int mesh) const;
+	BVHStats getTopLevelStats() const;
+	// Every mesh and the top-level tree in one JSON file.
+	bool writeStatsJson(const std::string& path) const;
+
+private:
+	struct MeshEntry {
+		// One of the two is set
+		const std::vector<Primitive>* source = nullptr;
+		const IndexedMesh* indexedSource = nullptr;
+		std::unique_ptr<BVHTree> tree; // Null until built
+		WideBVH<GPU_BVH_WIDTH> wideTree;
+		std::vector<PrimitiveGeometry> leafGeometry;
+		std::vector<IndexedTriangle> leafTriangles;
+		std::vector<MeshVertex> vertices;
+		int firstPrimitive = 0;	// In the numbering of SceneHit::primitive
+		int bufferOffset = 0;	// In the geometry or the triangle buffer
+		int firstVertex = -1;
+		int firstNode = 0;
+	};
+	struct Instance {
+		int mesh = 0;
+		mat4 objectToWorld;
+		mat4 worldToObject;
+	};
+
+	std::vector<MeshEntry> meshes;
+	std::vector<Instance> instances;
+	std::vector<int> instanceOrder; // Instance ids in the order of gpuInstances
+
+	int primitiveCount = 0;
+	int geometryCount = 0;
+	int triangleCount = 0;
+	int vertexCount = 0;
+	int nodeCount = 0;
+	int maxStackSize = 1;
+	std::vector<Material> materials;
+	std::vector<BVHInstance> gpuInstances;
+	std::vector<BVHNode> topLevelNodes;
+	std::vector<int> topLevelParents;	// -1 for the root
+	std::vector<int> instanceLeaves;	// Top-level leaf of each instance id
+	float topLevelSAHCost = 0.0f;
+	float topLevelBuildSAHCost = 0.0f;
+
+	BVHBuildSettings settings;
+	std::string cacheDirectory;
+	BVHNodeFormat nodeFormat = BVHNodeFormat::Full;
+	BVHNodeFormat builtNodeFormat = BVHNodeFormat::Full;
+	float buildTimeMs = 0.0f;
+	float topLevelBuildTimeMs = 0.0f;
+	SIMDLevel packetLevel = detectSIMDLevel();
+
+	// The packet traversals, one per instruction set, see SceneBVHPacket.cpp
+	friend struct PacketTraversal;
+
+	AABB worldBounds(const Instance& instance) const;
+	PrimitiveGeometry loadPrimitive(const MeshEntry& mesh, int index) const;
+	int findMaterial(const Material& material, std::map<std::vector<char>, int>& known);
+	int buildTopLevelRecursive(const std::vector<AABB>& bounds, int start, int count);
+	float computeTopLevelSAHCost() const;
+};
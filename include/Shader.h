@@ -9,8 +9,9 @@
 class Shader
 {
 public:
-	Shader(const char* filePath, GLenum shaderType) {
-		shaderCode = readShaderFile(filePath);
+	// defines are inserted after the #version line, to set constants of the shader at compile time
+	Shader(const char* filePath, GLenum shaderType, const std::string& defines = "") {
+		shaderCode = insertDefines(readShaderFile(filePath), defines);
 		shaderID = compileShader(shaderCode.c_str(), shaderType);
 	}
 
@@ -18,6 +19,7 @@ public:
 
 private:
 	std::string readShaderFile(const char* filePath);
+	std::string insertDefines(const std::string& source, const std::string& defines);
 	unsigned int compileShader(const char* shaderSource, GLenum shaderType);
 
 	std::string shaderCode;
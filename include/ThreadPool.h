@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts the unfinished tasks of one batch so the submitting thread can wait for them.
+struct TaskGroup {
+	std::atomic<int> pending{ 0 };
+};
+
+// Work-stealing thread pool. Every worker owns a deque, pops its own work from the back
+// and steals from the front of the other deques when it runs dry.
+// The thread calling wait() helps with the work, so a pool with threadCount == 1
+// owns no worker threads and runs everything on the caller.
+class ThreadPool
+{
+public:
+	// threadCount <= 0 uses every hardware thread.
+	explicit ThreadPool(int threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int getThreadCount() const { return threadCount; }
+	static int hardwareThreads();
+
+	void submit(TaskGroup& group, std::function<void()> task);
+	void wait(TaskGroup& group);
+
+	// Splits [begin, end) into chunkCount contiguous ranges and runs body(chunk, chunkBegin, chunkEnd) for each.
+	template<typename Func>
+	void parallelChunks(int begin, int end, int chunkCount, Func body) {
+		int count = end - begin;
+		chunkCount = std::max(1, std::min(chunkCount, count));
+		if (chunkCount == 1) {
+			body(0, begin, end);
+			return;
+		}
+		TaskGroup group;
+		for (int chunk = 0; chunk < chunkCount; chunk++) {
+			int chunkBegin = begin + int((long long)count * chunk / chunkCount);
+			int chunkEnd = begin + int((long long)count * (chunk + 1) / chunkCount);
+			submit(group, [=, &body]() { body(chunk, chunkBegin, chunkEnd); });
+		}
+		wait(group);
+	}
+
+	// Runs body(chunkBegin, chunkEnd) over [begin, end) in chunks of roughly grainSize elements.
+	template<typename Func>
+	void parallelFor(int begin, int end, int grainSize, Func body) {
+		int chunkCount = std::min(threadCount * 4, (end - begin + grainSize - 1) / std::max(1, grainSize));
+		parallelChunks(begin, end, chunkCount, [&](int, int chunkBegin, int chunkEnd) { body(chunkBegin, chunkEnd); });
+	}
+
+private:
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	int currentQueue() const;
+	bool popOrSteal(int queueIndex, std::function<void()>& task);
+	void workerLoop(int queueIndex);
+
+	int threadCount;
+	std::vector<std::unique_ptr<WorkQueue>> queues; // queues[0] is shared by threads outside the pool
+	std::vector<std::thread> workers;
+
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	std::atomic<int> queuedTasks{ 0 };
+	bool stopping = false;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+class Scene;
+class SceneBVH;
+
+// What the command line tools in tools/ and the benchmarks in bench/ have in common.
+class ToolSupport
+{
+public:
+	// Prevent instantiation of the class
+	ToolSupport() = delete;
+
+	enum class OptionResult { Valid, Invalid, Unknown };
+	using OptionHandler = std::function<OptionResult(const std::string& name, const char* value)>;
+
+	// Hands every option to handler, each as "--name value" except the switches listed in flags, which
+	// get a null value. A missing value, an unknown option or an invalid value is reported on stderr
+	// and stops the parse with false.
+	static bool parseOptions(int argc, char** argv, const std::vector<std::string>& flags, const OptionHandler& handler);
+
+	static double msSince(std::chrono::steady_clock::time_point start);
+	// text as a JSON string literal, quotes and backslashes escaped
+	static std::string jsonString(const std::string& text);
+
+	// Every mesh of the scene as an instance where it is, like Application::BindBuffersPathtraced().
+	static void addSceneToBVH(SceneBVH& sceneBVH, const Scene& scene);
+};
@@ -99,7 +99,10 @@
 #ifndef VECTORUTILS4
 #define VECTORUTILS4
 
-#ifdef __APPLE__
+#if defined(VECTORUTILS4_NO_GL)
+	// Math only, for code built without OpenGL. The shader upload helpers are left out.
+	typedef float GLfloat;
+#elif defined(__APPLE__)
 	#define GL_SILENCE_DEPRECATION
 	#include <OpenGL/gl3.h>
 #else
@@ -382,6 +385,7 @@
 
 /* Utility functions for easier uploads to shaders with error messages. */
 // NEW as prototype 2022, added to VU 2023
+#ifndef VECTORUTILS4_NO_GL
 	void uploadMat4ToShader(GLuint shader, const char *nameInShader, mat4 m);
 	void uploadUniformIntToShader(GLuint shader, const char *nameInShader, GLint i);
 	void uploadUniformFloatToShader(GLuint shader, const char *nameInShader, GLfloat f);
@@ -389,6 +393,7 @@
 	void uploadUniformVec3ToShader(GLuint shader, const char *nameInShader, vec3 v);
 	void uploadUniformVec3ArrayToShader(GLuint shader, const char *nameInShader, vec3 *a, int arrayLength);
 	void bindTextureToTextureUnit(GLuint tex, int unit);
+#endif
 
 #ifdef __cplusplus
 // Convenient overloads for C++, closer to GLSL
@@ -1572,6 +1577,7 @@ void printVec3(vec3 in)
 
 /* Utility functions for easier uploads to shaders with error messages. */
 // NEW as prototype 2022, added to VU 2023
+#ifndef VECTORUTILS4_NO_GL
 
 #define NUM_ERRORS 8
 
@@ -1661,6 +1667,7 @@ void bindTextureToTextureUnit(GLuint tex, int unit)
 	glActiveTexture(GL_TEXTURE0 + unit);
 	glBindTexture(GL_TEXTURE_2D, tex);
 }
+#endif
 
 #ifdef __cplusplus
 mat3 inverse(mat3 m)
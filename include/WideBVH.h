@@ -0,0 +1,206 @@
+#pragma once
+#include "BVHTree.h"
+#include "ArrayView.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Width and smallest traversal stack of the wide nodes in PathtraceShader.frag, BVH_WIDTH and BVH_STACK_SIZE
+// there. Deeper trees get a shader with a larger stack, see SceneBVH::getMaxStackSize().
+constexpr int GPU_BVH_WIDTH = 4;
+constexpr int GPU_BVH_STACK_SIZE = 64;
+
+// A node with up to Width children. The child boxes are stored as a structure of arrays, so one
+// fetch of the node is enough to test all of them, and the tests map directly onto SIMD lanes.
+template<int Width>
+struct WideBVHNode {
+	float minX[Width];
+	float minY[Width];
+	float minZ[Width];
+	float maxX[Width];
+	float maxY[Width];
+	float maxZ[Width];
+	// Inner child: child is the node index and count is 0. Leaf: count entries of the index buffer
+	// from child on. Unused slots have count -1 and come after the used ones.
+	int child[Width];
+	int count[Width];
+};
+
+// The same node in a bit more than half the memory. Each axis of the node box is split into 255
+// steps of a power of two, and the child planes are stored as 8-bit step counts rounded outwards,
+// so a decoded child box always contains the real one.
+template<int Width>
+struct QuantizedWideBVHNode {
+	static_assert(Width % 4 == 0, "The 8-bit planes are packed four to a word");
+
+	float originX, originY, originZ;	// Minimum corner of the node box
+	// Biased float exponents of the x, y and z step in the low three bytes, 2^(e - 127) is the step
+	uint32_t exponents;
+	// The plane of child i is byte i % 4 of word i / 4
+	uint32_t qMinX[Width / 4];
+	uint32_t qMinY[Width / 4];
+	uint32_t qMinZ[Width / 4];
+	uint32_t qMaxX[Width / 4];
+	uint32_t qMaxY[Width / 4];
+	uint32_t qMaxZ[Width / 4];
+	int child[Width];	// Same meaning as in WideBVHNode
+	int count[Width];
+};
+
+enum class BVHNodeFormat {
+	Full,		// WideBVHNode, 128 bytes per 4-wide node
+	Quantized	// QuantizedWideBVHNode, 72 bytes per 4-wide node
+};
+
+using GPUBVHNode = WideBVHNode<GPU_BVH_WIDTH>;
+using GPUQuantizedBVHNode = QuantizedWideBVHNode<GPU_BVH_WIDTH>;
+
+// The step of a quantized axis, built from the biased exponent like the shader does, so both
+// decode to exactly the same box.
+inline float quantizationStep(uint32_t biasedExponent) {
+	uint32_t bits = (biasedExponent & 0xff) << 23;
+	float step;
+	std::memcpy(&step, &bits, sizeof(step));
+	return step;
+}
+
+// A binary BVHTree collapsed into Width-ary nodes. The leaves keep their ranges in the index buffer
+// of the binary tree, so only the nodes are new. Only the nodes of the chosen format are kept.
+template<int Width>
+class WideBVH {
+public:
+	void build(ArrayView<const BVHNode> binaryNodes, BVHNodeFormat nodeFormat = BVHNodeFormat::Full);
+
+	BVHNodeFormat getFormat() const { return format; }
+	// Empty unless the tree was built in that format
+	const std::vector<WideBVHNode<Width>>& getNodes() const { return nodes; }
+	const std::vector<QuantizedWideBVHNode<Width>>& getQuantizedNodes() const { return quantizedNodes; }
+	int getNodeCount() const { return format == BVHNodeFormat::Quantized ? quantizedNodes.size() : nodes.size(); }
+	size_t getNodeBytes() const { return nodes.size() * sizeof(WideBVHNode<Width>) + quantizedNodes.size() * sizeof(QuantizedWideBVHNode<Width>); }
+	int getDepth() const { return depth; }
+	// Most stack entries a traversal that pushes every hit inner child can need
+	int getMaxStackSize() const { return depth * (Width - 1) + 1; }
+
+	// Calls leaf(start, count) for every leaf whose box the ray enters before tMax, nearest boxes first.
+	// leaf may lower tMax, which culls the boxes behind the new closest hit.
+	template<typename LeafFunc>
+	void traverse(const vec3& origin, const vec3& directionInv, float& tMax, LeafFunc leaf) const;
+
+	// A node of either format with its child boxes in full precision. Returns the node itself for the
+	// full format, else decoded, for traversals that read the nodes themselves.
+	static const WideBVHNode<Width>& decode(const WideBVHNode<Width>& node, WideBVHNode<Width>&) { return node; }
+	static const WideBVHNode<Width>& decode(const QuantizedWideBVHNode<Width>& node, WideBVHNode<Width>& decoded);
+
+private:
+	std::vector<WideBVHNode<Width>> nodes;
+	std::vector<QuantizedWideBVHNode<Width>> quantizedNodes;
+	BVHNodeFormat format = BVHNodeFormat::Full;
+	int depth = 0;
+
+	int collapseRecursive(ArrayView<const BVHNode> binaryNodes, int binaryIndex, int nodeDepth);
+	static QuantizedWideBVHNode<Width> quantize(const WideBVHNode<Width>& node);
+
+	template<typename Node, typename LeafFunc>
+	static void traverseNodes(const std::vector<Node>& nodes, const vec3& origin, const vec3& directionInv, float& tMax, LeafFunc& leaf, int maxStackSize);
+};
+
+template<int Width>
+const WideBVHNode<Width>& WideBVH<Width>::decode(const QuantizedWideBVHNode<Width>& node, WideBVHNode<Width>& decoded)
+{
+	float stepX = quantizationStep(node.exponents);
+	float stepY = quantizationStep(node.exponents >> 8);
+	float stepZ = quantizationStep(node.exponents >> 16);
+	for (int i = 0; i < Width; i++) {
+		int shift = (i % 4) * 8;
+		decoded.minX[i] = node.originX + float((node.qMinX[i / 4] >> shift) & 0xff) * stepX;
+		decoded.minY[i] = node.originY + float((node.qMinY[i / 4] >> shift) & 0xff) * stepY;
+		decoded.minZ[i] = node.originZ + float((node.qMinZ[i / 4] >> shift) & 0xff) * stepZ;
+		decoded.maxX[i] = node.originX + float((node.qMaxX[i / 4] >> shift) & 0xff) * stepX;
+		decoded.maxY[i] = node.originY + float((node.qMaxY[i / 4] >> shift) & 0xff) * stepY;
+		decoded.maxZ[i] = node.originZ + float((node.qMaxZ[i / 4] >> shift) & 0xff) * stepZ;
+		decoded.child[i] = node.child[i];
+		decoded.count[i] = node.count[i];
+	}
+	return decoded;
+}
+
+template<int Width>
+template<typename LeafFunc>
+void WideBVH<Width>::traverse(const vec3& origin, const vec3& directionInv, float& tMax, LeafFunc leaf) const
+{
+	if (format == BVHNodeFormat::Quantized) {
+		traverseNodes(quantizedNodes, origin, directionInv, tMax, leaf, getMaxStackSize());
+	}
+	else {
+		traverseNodes(nodes, origin, directionInv, tMax, leaf, getMaxStackSize());
+	}
+}
+
+template<int Width>
+template<typename Node, typename LeafFunc>
+void WideBVH<Width>::traverseNodes(const std::vector<Node>& nodes, const vec3& origin, const vec3& directionInv, float& tMax, LeafFunc& leaf, int maxStackSize)
+{
+	if (nodes.empty()) {
+		return;
+	}
+
+	struct Entry {
+		int node;
+		float t;
+	};
+	// A fixed array like the shader, only trees too deep for it take their stack from the heap
+	Entry localStack[GPU_BVH_STACK_SIZE];
+	std::vector<Entry> deepStack;
+	Entry* stack = localStack;
+	if (maxStackSize > GPU_BVH_STACK_SIZE) {
+		deepStack.resize(maxStackSize);
+		stack = deepStack.data();
+	}
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0.0f };
+
+	while (stackSize > 0) {
+		Entry entry = stack[--stackSize];
+		if (entry.t >= tMax) {
+			continue; // A closer hit was found after the node was pushed
+		}
+		WideBVHNode<Width> decoded;
+		const WideBVHNode<Width>& node = decode(nodes[entry.node], decoded);
+
+		// Slab test of every child at once, plain loops over the arrays that the compiler can vectorize
+		float tNear[Width];
+		float tFar[Width];
+		for (int i = 0; i < Width; i++) {
+			float x1 = (node.minX[i] - origin.x) * directionInv.x;
+			float x2 = (node.maxX[i] - origin.x) * directionInv.x;
+			float y1 = (node.minY[i] - origin.y) * directionInv.y;
+			float y2 = (node.maxY[i] - origin.y) * directionInv.y;
+			float z1 = (node.minZ[i] - origin.z) * directionInv.z;
+			float z2 = (node.maxZ[i] - origin.z) * directionInv.z;
+			tNear[i] = std::max(std::max(std::min(x1, x2), std::min(y1, y2)), std::min(z1, z2));
+			tFar[i] = std::min(std::min(std::max(x1, x2), std::max(y1, y2)), std::max(z1, z2));
+		}
+
+		// Inner children are pushed far to near, so the nearest is visited next
+		Entry hits[Width];
+		int hitCount = 0;
+		for (int i = 0; i < Width && node.count[i] >= 0; i++) {
+			if (tFar[i] < std::max(tNear[i], 0.0f) || tNear[i] >= tMax) {
+				continue;
+			}
+			if (node.count[i] > 0) {
+				leaf(node.child[i], node.count[i]);
+				continue;
+			}
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].t < tNear[i]) {
+				hits[j] = hits[j - 1];
+				j--;
+			}
+			hits[j] = { node.child[i], tNear[i] };
+		}
+		for (int i = 0; i < hitCount; i++) {
+			stack[stackSize++] = hits[i];
+		}
+	}
+}
@@ -7,6 +7,13 @@
 #define TRANSMISSIVE 2
 #define LIGHT 3
 
+// Must match GPU_BVH_WIDTH in WideBVH.h
+#define BVH_WIDTH 4
+// Set by the application from the depth of the mesh trees, see SceneBVH::getMaxStackSize()
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 64
+#endif
+
 struct BVHNode {
 	vec3 bBoxMin;
 	int leftChild;
@@ -18,9 +25,53 @@ struct BVHNode {
 	int pad1;
 };
 
+// Mesh tree node with up to BVH_WIDTH children, one fetch gives the boxes of all of them.
+// count is 0 for an inner child, the number of triangle indices from child on for a leaf,
+// and -1 for the unused slots at the end.
+struct WideBVHNode {
+	float minX[BVH_WIDTH];
+	float minY[BVH_WIDTH];
+	float minZ[BVH_WIDTH];
+	float maxX[BVH_WIDTH];
+	float maxY[BVH_WIDTH];
+	float maxZ[BVH_WIDTH];
+	int child[BVH_WIDTH];
+	int count[BVH_WIDTH];
+};
+
+// WideBVHNode in a bit more than half the memory, see QuantizedWideBVHNode in WideBVH.h. The child
+// planes are 8-bit step counts from the node origin, packed four to a word, and a step is the
+// power of two whose biased exponent is stored in exponents.
+struct QuantizedWideBVHNode {
+	float originX;
+	float originY;
+	float originZ;
+	uint exponents;
+	uint qMinX[BVH_WIDTH / 4];
+	uint qMinY[BVH_WIDTH / 4];
+	uint qMinZ[BVH_WIDTH / 4];
+	uint qMaxX[BVH_WIDTH / 4];
+	uint qMaxY[BVH_WIDTH / 4];
+	uint qMaxZ[BVH_WIDTH / 4];
+	int child[BVH_WIDTH];
+	int count[BVH_WIDTH];
+};
+
 struct HitResult {
     float t;
     int index;
+    int instance;
+};
+
+// A placed mesh. Its tree is stored unchanged at wideNodes[firstNode], so every index read from it is
+// local to the mesh and gets the offsets below added.
+struct Instance {
+	mat4 worldToObject;
+	mat4 objectToWorld;
+	int firstNode;
+	int nodeCount;
+	int firstPrimitive; // In triangles[] if firstVertex >= 0, else in primitives[]
+	int firstVertex;
 };
 
 struct PointLight {
@@ -44,31 +95,67 @@ struct Ray{
 	vec3 endPoint;
 };
 
-struct Primitive{
-	vec3 vertex1;
+// What the intersection tests read, see PrimitiveGeometry in Primitive.h. The material is only
+// fetched for the closest hit, and for glass in shadow rays.
+struct PrimitiveGeometry{
+	vec3 vertex1; // Sphere: the center
 	int ID; // 0 == Triangle, 1 == Sphere
-	vec3 vertex2;
+	vec3 edge1; // Sphere: the radius in x
+	int material;
+	vec3 edge2;
+	uint normal; // Octahedral, decoded by unpackNormal
+};
+
+// A triangle of a loaded model, see IndexedTriangle in IndexedMesh.h. The vertex numbers are
+// relative to the instance's firstVertex.
+struct IndexedTriangle{
+	uint vertex1;
+	uint vertex2;
+	uint vertex3;
+	int material;
+};
+
+struct MeshVertex{
+	vec3 position;
+	uint normal; // Octahedral, decoded by unpackNormal
+};
+
+struct Material{
+	vec3 color;
 	float smoothness; //Odds that the ray would bounce off of the surface.
-	vec3 vertex3;
 	int materialType;
-	vec3 color;
 	float ior;
+	float bounceOdds;
+	int pad;
+};
+
+// The closest hit with its material, in world space, gathered once for shading
+struct Surface{
+	vec3 vertex1;
+	int ID;
 	vec3 normal;
+	int materialType;
+	vec3 color;
+	float smoothness;
+	float ior;
 	float bounceOdds;
-	vec3 edge1;
-    vec3 edge2;
 };
 
 layout(std430, binding = 0) buffer PrimitiveBuffer{
-	Primitive primitives[];
+	PrimitiveGeometry primitives[];
 };
 
+// The mesh nodes in the format given by bvhNodeFormat, both blocks view the same buffer
 layout(std430, binding = 1) buffer BVHNodeBuffer{
-	BVHNode nodes[];
+	WideBVHNode wideNodes[];
 };
 
-layout(std430, binding = 2) buffer TriangleIndices {
-    int triangleIndices[];
+layout(std430, binding = 1) buffer QuantizedBVHNodeBuffer{
+	QuantizedWideBVHNode quantizedNodes[];
+};
+
+layout(std430, binding = 2) buffer MaterialBuffer{
+	Material materials[];
 };
 
 layout(std430, binding = 3) buffer PointLights{
@@ -79,6 +166,24 @@ layout(std430, binding = 4) buffer AreaLights{
 	AreaLight areaLights[];
 };
 
+layout(std430, binding = 5) buffer Instances{
+	Instance instances[];
+};
+
+// Top-level tree over the instances, the leaves index instances[] with startTriangle/triangleCount
+layout(std430, binding = 6) buffer TopLevelNodes{
+	BVHNode topLevelNodes[];
+};
+
+// Loaded models, which share their vertices between triangles
+layout(std430, binding = 7) buffer TriangleBuffer{
+	IndexedTriangle triangles[];
+};
+
+layout(std430, binding = 8) buffer VertexBuffer{
+	MeshVertex vertices[];
+};
+
 out vec4 FragColor;
 
 uniform sampler2D accumTexture;
@@ -93,6 +198,7 @@ uniform float imagePlaneHeight;
 
 uniform int numberOfSamples;
 uniform int maxBounces;
+uniform int bvhNodeFormat; // 0 = full precision, 1 = quantized, BVHNodeFormat in WideBVH.h
 
 uniform int screenWidth;
 uniform int screenHeight;
@@ -123,14 +229,24 @@ float RandomFloat(uint inputSeed){
 // ----------------------------------------------------------------------------------------------------
 HitResult traverseBVHTree(Ray ray, vec3 rayDirInv, bool includeGlass);
 
-float triangleIntersectionTest(Ray currentRay, Primitive targetTriangle) {
+// Inverse of packNormal in Primitive.cpp
+vec3 unpackNormal(uint packed) {
+	vec2 f = unpackSnorm2x16(packed);
+	float z = 1.0 - abs(f.x) - abs(f.y);
+	if (z < 0.0) {
+		f = (1.0 - abs(f.yx)) * vec2(f.x >= 0.0 ? 1.0 : -1.0, f.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(vec3(f, z));
+}
+
+float triangleIntersectionTest(Ray currentRay, PrimitiveGeometry targetTriangle) {
 
 	vec3 d = currentRay.direction;
 	vec3 s = currentRay.startPoint;
 
 	// If negative, then the surface is visible for the ray
 	
-	if (dot(d, targetTriangle.normal) >= 0.0){
+	if (dot(d, unpackNormal(targetTriangle.normal)) >= 0.0){
 		return -1.0;
 	}
 			
@@ -158,10 +274,10 @@ float triangleIntersectionTest(Ray currentRay, Primitive targetTriangle) {
 	return t;
 }
 
-float sphereIntersectionTest(Ray currentRay, Primitive targetSphere) {
+float sphereIntersectionTest(Ray currentRay, PrimitiveGeometry targetSphere) {
 	float c1 = dot(currentRay.direction,currentRay.direction);
 	float c2 = 2.0 * dot(currentRay.direction, currentRay.startPoint - targetSphere.vertex1);
-	float c3 = dot(currentRay.startPoint - targetSphere.vertex1, currentRay.startPoint - targetSphere.vertex1) - targetSphere.vertex2.x * targetSphere.vertex2.x;
+	float c3 = dot(currentRay.startPoint - targetSphere.vertex1, currentRay.startPoint - targetSphere.vertex1) - targetSphere.edge1.x * targetSphere.edge1.x;
 
 	float arg = c2 * c2 - 4.0 * c1 * c3;
 
@@ -209,47 +325,158 @@ float intersectAABB(vec3 rayOrigin, vec3 rayDirInv, vec3 minB, vec3 maxB) {
 }
 
 
-HitResult traverseBVHTree(Ray ray, vec3 rayDirInv, bool includeGlass) {
-    int nodeIndex = 0;
-    float closestT = 1e30;
-    int closestPrimIdx = -1;
+// Fetches a mesh node in either format. Quantized boxes decode with the same exact float operations
+// as on the CPU, where they were rounded outwards, so they always contain the original box.
+void loadWideNode(int nodeIndex, out vec3 childMin[BVH_WIDTH], out vec3 childMax[BVH_WIDTH], out int child[BVH_WIDTH], out int count[BVH_WIDTH]) {
+    if (bvhNodeFormat == 1) {
+        QuantizedWideBVHNode node = quantizedNodes[nodeIndex];
+        vec3 origin = vec3(node.originX, node.originY, node.originZ);
+        vec3 step = vec3(uintBitsToFloat((node.exponents & 0xffu) << 23),
+                         uintBitsToFloat(((node.exponents >> 8) & 0xffu) << 23),
+                         uintBitsToFloat(((node.exponents >> 16) & 0xffu) << 23));
+        for (int i = 0; i < BVH_WIDTH; ++i) {
+            int word = i / 4;
+            uint shift = uint(i % 4) * 8u;
+            vec3 qMin = vec3((node.qMinX[word] >> shift) & 0xffu, (node.qMinY[word] >> shift) & 0xffu, (node.qMinZ[word] >> shift) & 0xffu);
+            vec3 qMax = vec3((node.qMaxX[word] >> shift) & 0xffu, (node.qMaxY[word] >> shift) & 0xffu, (node.qMaxZ[word] >> shift) & 0xffu);
+            childMin[i] = origin + qMin * step;
+            childMax[i] = origin + qMax * step;
+            child[i] = node.child[i];
+            count[i] = node.count[i];
+        }
+    } else {
+        WideBVHNode node = wideNodes[nodeIndex];
+        for (int i = 0; i < BVH_WIDTH; ++i) {
+            childMin[i] = vec3(node.minX[i], node.minY[i], node.minZ[i]);
+            childMax[i] = vec3(node.maxX[i], node.maxY[i], node.maxZ[i]);
+            child[i] = node.child[i];
+            count[i] = node.count[i];
+        }
+    }
+}
 
-    
+// The primitive at index of the instance's buffer. A triangle of a loaded model gets its edges from its
+// vertices here, so the tests below do not need to know where it came from.
+PrimitiveGeometry loadPrimitive(int instanceIndex, int index) {
+	int firstVertex = instances[instanceIndex].firstVertex;
+	if (firstVertex < 0) {
+		return primitives[index];
+	}
+	IndexedTriangle triangle = triangles[index];
+	MeshVertex vertex1 = vertices[firstVertex + int(triangle.vertex1)];
+	vec3 position2 = vertices[firstVertex + int(triangle.vertex2)].position;
+	vec3 position3 = vertices[firstVertex + int(triangle.vertex3)].position;
+	return PrimitiveGeometry(vertex1.position, 0, position2 - vertex1.position, triangle.material, position3 - vertex1.position, vertex1.normal);
+}
 
-    while (nodeIndex != -1) {
-       
-        if (nodeIndex < 0 || nodeIndex >= nodes.length()) {
-			if(closestPrimIdx != -1){return HitResult(closestT,closestPrimIdx);}
-            return HitResult(-1,-1);
+// Traverses the tree of one mesh with a ray in its object space, closest is updated on a closer hit.
+// The wide nodes need a stack, the hit inner children are pushed far to near so the nearest comes next.
+void traverseMesh(Ray ray, vec3 rayDirInv, int instanceIndex, bool includeGlass, inout HitResult closest) {
+    int firstNode = instances[instanceIndex].firstNode;
+    int firstPrimitive = instances[instanceIndex].firstPrimitive;
+    if (instances[instanceIndex].nodeCount == 0) {
+        return;
+    }
+
+    int stack[BVH_STACK_SIZE];
+    float stackT[BVH_STACK_SIZE];
+    int stackSize = 1;
+    stack[0] = 0;
+    stackT[0] = 0.0;
+
+    while (stackSize > 0) {
+        --stackSize;
+        if (stackT[stackSize] >= closest.t) {
+            continue; // A closer hit was found after the node was pushed
         }
-		
-        BVHNode node = nodes[nodeIndex];
+        vec3 childMin[BVH_WIDTH];
+        vec3 childMax[BVH_WIDTH];
+        int child[BVH_WIDTH];
+        int count[BVH_WIDTH];
+        loadWideNode(firstNode + stack[stackSize], childMin, childMax, child, count);
+
+        int hitChild[BVH_WIDTH];
+        float hitT[BVH_WIDTH];
+        int hitCount = 0;
+        for (int i = 0; i < BVH_WIDTH && count[i] >= 0; ++i) {
+            float t = intersectAABB(ray.startPoint, rayDirInv, childMin[i], childMax[i]);
+            if (t >= closest.t) {
+                continue;
+            }
 
-        if (intersectAABB(ray.startPoint, rayDirInv, node.bBoxMin, node.bBoxMax) < closestT) {
-            if (node.triangleCount > 0) {
-                // Leaf node
-                for (int i = 0; i < node.triangleCount; ++i) {
-                    int primIndex = triangleIndices[node.startTriangle + i];
-                    Primitive prim = primitives[primIndex];
-					if(prim.materialType == TRANSMISSIVE && !includeGlass){continue;}
+            if (count[i] > 0) {
+                // Leaf node, its primitives are stored in leaf order
+                for (int j = 0; j < count[i]; ++j) {
+                    int primIndex = firstPrimitive + child[i] + j;
+                    PrimitiveGeometry prim = loadPrimitive(instanceIndex, primIndex);
+					if(!includeGlass && materials[prim.material].materialType == TRANSMISSIVE){continue;}
 
-                    float t = (prim.ID == 0) ? triangleIntersectionTest(ray, prim) : sphereIntersectionTest(ray, prim);
+                    float tHit = (prim.ID == 0) ? triangleIntersectionTest(ray, prim) : sphereIntersectionTest(ray, prim);
 
-                    if (t > 0.0f && (t < closestT)) {
-                        closestT = t;
-                        closestPrimIdx = primIndex;
+                    if (tHit > 0.0f && (tHit < closest.t)) {
+                        closest = HitResult(tHit, primIndex, instanceIndex);
                     }
                 }
-                nodeIndex = node.escapeIndex; //Go to next node
             } else {
-                nodeIndex = node.leftChild; //Go to left child
+                int j = hitCount++;
+                while (j > 0 && hitT[j - 1] < t) {
+                    hitChild[j] = hitChild[j - 1];
+                    hitT[j] = hitT[j - 1];
+                    --j;
+                }
+                hitChild[j] = child[i];
+                hitT[j] = t;
+            }
+        }
+        for (int i = 0; i < hitCount; ++i) {
+            stack[stackSize] = hitChild[i];
+            stackT[stackSize] = hitT[i];
+            ++stackSize;
+        }
+    }
+}
+
+HitResult traverseBVHTree(Ray ray, vec3 rayDirInv, bool includeGlass) {
+    int nodeIndex = 0;
+    HitResult closest = HitResult(1e30, -1, -1);
+
+    while (nodeIndex < topLevelNodes.length()) {
+        BVHNode node = topLevelNodes[nodeIndex];
+
+        if (intersectAABB(ray.startPoint, rayDirInv, node.bBoxMin, node.bBoxMax) < closest.t) {
+            if (node.triangleCount > 0) {
+                for (int i = node.startTriangle; i < node.startTriangle + node.triangleCount; ++i) {
+                    // The direction is not normalized again, so t means the same in both spaces
+                    mat4 worldToObject = instances[i].worldToObject;
+                    Ray localRay = Ray(mat3(worldToObject) * ray.direction, (worldToObject * vec4(ray.startPoint, 1.0)).xyz, vec3(0.0));
+                    traverseMesh(localRay, 1.0 / localRay.direction, i, includeGlass, closest);
+                }
+                nodeIndex = node.escapeIndex;
+            } else {
+                nodeIndex = node.leftChild;
             }
         } else {
-            nodeIndex = node.escapeIndex; //Skip subtree
+            nodeIndex = node.escapeIndex;
         }
     }
 
-    return HitResult(closestT,closestPrimIdx);
+    return closest;
+}
+
+// Gathers the hit primitive and its material, with the parts that shading uses moved into world space
+Surface loadSurface(HitResult hit) {
+	PrimitiveGeometry prim = loadPrimitive(hit.instance, hit.index);
+	Material material = materials[prim.material];
+	Surface surface;
+	surface.vertex1 = (instances[hit.instance].objectToWorld * vec4(prim.vertex1, 1.0)).xyz;
+	surface.ID = prim.ID;
+	surface.normal = normalize(transpose(mat3(instances[hit.instance].worldToObject)) * unpackNormal(prim.normal));
+	surface.materialType = material.materialType;
+	surface.color = material.color;
+	surface.smoothness = material.smoothness;
+	surface.ior = material.ior;
+	surface.bounceOdds = material.bounceOdds;
+	return surface;
 }
 
 
@@ -303,7 +530,7 @@ vec3 calculateDirectIllumination(vec3 dir, vec3 hitPoint, vec3 normal, vec3 surf
 }
 
 
-Ray diffuseReflection(Ray r, Primitive hitSurface, float randAz, float randInc) {
+Ray diffuseReflection(Ray r, Surface hitSurface, float randAz, float randInc) {
 	float x = cos(randAz) * sin(randInc);
 	float y = sin(randAz) * sin(randInc);
 	float z = cos(randInc);
@@ -351,7 +578,7 @@ vec3 raytrace(Ray ray) {
 			break;
 		}
 
-		Primitive hitSurface = primitives[hit.index];
+		Surface hitSurface = loadSurface(hit);
 
 		ray.endPoint = ray.startPoint + hit.t * ray.direction;
 
@@ -1,11 +1,11 @@
 #include "Application.h"
 
-Application::Application(int width, int height, const std::string& title) : bvhTree(Scene{0}.primitives) {
+Application::Application(int width, int height, const std::string& title) : currentScene(0) {
 	screenWidth = width;
 	screenHeight = height;
 	window = createWindow(title);
     mainCamera = Camera(vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, 0.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f), 80.0f, screenWidth, screenHeight);
-	currentScene = Scene{0};
+	sceneBVH.setCacheDirectory("bvhcache"); // Next to the executable's working directory, safe to delete
 	Init();
 }
 
@@ -54,16 +54,12 @@ void Application::Init() {
     // Shader initialization ----------------------------------------------------------------
     
     //Shader FragmentShader = Shader("..\\shaders\\PathtraceShaderNoBVH.frag", GL_FRAGMENT_SHADER);
-    Shader PathtraceFragment = Shader("..\\shaders\\PathtraceShader.frag", GL_FRAGMENT_SHADER);
     Shader DisplayFragment = Shader("..\\shaders\\DisplayShader.frag", GL_FRAGMENT_SHADER);
     Shader DisplayVertex = Shader("..\\shaders\\DisplayShader.vert", GL_VERTEX_SHADER);
     Shader RasterVertex = Shader("..\\shaders\\RasterShader.vert", GL_VERTEX_SHADER);
     Shader RasterFragment = Shader("..\\shaders\\RasterShader.frag", GL_FRAGMENT_SHADER);
 
-    PathtraceShader = glCreateProgram();
-    glAttachShader(PathtraceShader, DisplayVertex.shaderID);
-    glAttachShader(PathtraceShader, PathtraceFragment.shaderID);
-    glLinkProgram(PathtraceShader);
+    CompilePathtraceShader(GPU_BVH_STACK_SIZE);
 
     DisplayShader = glCreateProgram();
     glAttachShader(DisplayShader, DisplayVertex.shaderID);
@@ -78,13 +74,6 @@ void Application::Init() {
     // Check for linking errors
     int success;
     char infoLog[512];
-    glGetProgramiv(PathtraceShader, GL_LINK_STATUS, &success);
-    if (!success)
-    {
-        glGetProgramInfoLog(PathtraceShader, 512, NULL, infoLog);
-        std::cerr << "ERROR::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-    }
-
     glGetProgramiv(DisplayShader, GL_LINK_STATUS, &success);
     if (!success)
     {
@@ -101,7 +90,6 @@ void Application::Init() {
 
     // Delete the shaders as it is no longer needed
     glDeleteShader(DisplayVertex.shaderID);
-    glDeleteShader(PathtraceFragment.shaderID);
     glDeleteShader(DisplayFragment.shaderID);
     glDeleteShader(RasterFragment.shaderID);
     glDeleteShader(RasterVertex.shaderID);
@@ -140,6 +128,7 @@ void Application::Run() {
     while (!glfwWindowShouldClose(window))
     {
         processInput(window);
+        UpdateModelLoading();
 
         float currentTime = glfwGetTime();
         deltaTime = currentTime - previousTime;
@@ -189,7 +178,7 @@ void Application::RenderRasterized()
 
     glUseProgram(RasterShader);
 
-    for (auto& obj : currentScene.objects) {
+    for (auto& obj : objects) {
         uploadMat4ToShader(RasterShader, "model", obj.modelMatrix);
         obj.RenderObject();
     }
@@ -214,6 +203,7 @@ void Application::RenderPathtraced()
 
     uploadUniformIntToShader(PathtraceShader, "numberOfSamples", numberOfSamples);
     uploadUniformIntToShader(PathtraceShader, "maxBounces", maxBounces);
+    uploadUniformIntToShader(PathtraceShader, "bvhNodeFormat", static_cast<int>(sceneBVH.getBuiltNodeFormat()));
 
     uploadUniformIntToShader(PathtraceShader, "NUM_OF_POINT_LIGHTS", currentScene.pointLights.size());
     uploadUniformIntToShader(PathtraceShader, "NUM_OF_AREA_LIGHTS", currentScene.areaLights.size());
@@ -302,6 +292,87 @@ void Application::RenderGui(GLFWwindow* window)
         app->frameCount = 0;
         clearAccumulationBuffer(window);
     }
+
+    // Used by the next BVH rebuild, lets us measure how the build scales with cores
+    if (ImGui::SliderInt("BVH build threads", &bvhBuildThreads, 1, ThreadPool::hardwareThreads()))
+    {
+        sceneBVH.setThreadCount(bvhBuildThreads);
+    }
+    ImGui::Text("BVH build: %.1f ms, %d of %d meshes from cache", sceneBVH.getBuildTimeMs(), sceneBVH.getCachedMeshCount(), sceneBVH.getMeshCount());
+    ImGui::Text("Top-level BVH: %.2f ms for %d instances", sceneBVH.getTopLevelBuildTimeMs(), sceneBVH.getInstanceCount());
+    // Moving objects refits the top-level tree until its cost has grown past the ratio
+    ImGui::Text("Top-level SAH cost: %.2f, %.2f after the last build", sceneBVH.getTopLevelSAHCost(), sceneBVH.getTopLevelBuildSAHCost());
+
+    // SBVH gives tighter nodes around long, thin triangles such as the walls, at the cost of a slower build.
+    // LBVH is the other way around, it builds large meshes almost instantly but traces somewhat slower.
+    BVHBuildSettings bvhSettings = sceneBVH.getBuildSettings();
+    const char* bvhBuilders[] = { "Binned SAH", "SBVH (spatial splits)", "LBVH (Morton codes)" };
+    int builderIndex = static_cast<int>(bvhSettings.builder);
+    bool bvhSettingsChanged = ImGui::Combo("BVH builder", &builderIndex, bvhBuilders, IM_ARRAYSIZE(bvhBuilders));
+    bvhSettings.builder = static_cast<BVHBuilder>(builderIndex);
+    if (bvhSettings.builder == BVHBuilder::SpatialSplits)
+    {
+        bvhSettingsChanged |= ImGui::DragFloat("Split overlap threshold", &bvhSettings.splitAlpha, 1e-6f, 0.0f, 1.0f, "%.6f");
+        bvhSettingsChanged |= ImGui::SliderFloat("Max duplication", &bvhSettings.maxDuplication, 0.0f, 2.0f);
+    }
+    if (bvhSettings.builder == BVHBuilder::Linear)
+    {
+        bvhSettingsChanged |= ImGui::Checkbox("63-bit Morton codes", &bvhSettings.mortonCodes64);
+        bvhSettingsChanged |= ImGui::Checkbox("Treelet optimization", &bvhSettings.optimizeTreelets);
+    }
+    // Time the reinsertion pass may spend on every mesh, only worth it for scenes that stay static for long renders
+    bvhSettingsChanged |= ImGui::SliderFloat("Optimization budget (ms)", &bvhSettings.optimizationBudgetMs, 0.0f, 10000.0f, "%.0f");
+    if (bvhSettingsChanged)
+    {
+        sceneBVH.setBuildSettings(bvhSettings);
+    }
+
+    // Quantized nodes need a bit more than half the memory, at the cost of decoding them in the shader
+    const char* nodeFormats[] = { "Full precision", "Quantized (8-bit)" };
+    int nodeFormatIndex = static_cast<int>(sceneBVH.getNodeFormat());
+    if (ImGui::Combo("BVH node format", &nodeFormatIndex, nodeFormats, IM_ARRAYSIZE(nodeFormats)))
+    {
+        sceneBVH.setNodeFormat(static_cast<BVHNodeFormat>(nodeFormatIndex));
+    }
+    ImGui::Text("%d-wide nodes: %d, %.2f MB (%s), frame %.2f ms", GPU_BVH_WIDTH, sceneBVH.getNodeCount(),
+        sceneBVH.getNodeCount() * sceneBVH.getNodeSize() / (1024.0f * 1024.0f), nodeFormats[static_cast<int>(sceneBVH.getBuiltNodeFormat())], deltaTime * 1000.0f);
+    ImGui::Text("Geometry: %.2f MB primitives, %.2f MB indexed (%d triangles, %d vertices)", sceneBVH.getGeometryCount() * sizeof(PrimitiveGeometry) / (1024.0f * 1024.0f),
+        (sceneBVH.getTriangleCount() * sizeof(IndexedTriangle) + sceneBVH.getVertexCount() * sizeof(MeshVertex)) / (1024.0f * 1024.0f), sceneBVH.getTriangleCount(), sceneBVH.getVertexCount());
+
+    // Statistics of the trees from the last switch to path tracing
+    if (ImGui::CollapsingHeader("BVH statistics") && !meshBVHStats.empty())
+    {
+        statsMesh = std::clamp(statsMesh, 0, int(meshBVHStats.size()) - 1);
+        ImGui::SliderInt("Mesh", &statsMesh, 0, int(meshBVHStats.size()) - 1);
+        const BVHStats& stats = meshBVHStats[statsMesh];
+        const BVHBuildTimings& timings = stats.buildTimings;
+        ImGui::Text("SAH cost: %.2f", stats.sahCost);
+        ImGui::Text("%d nodes, %d leaves, %d references for %d primitives", stats.nodeCount, stats.leafCount, stats.referenceCount, stats.primitiveCount);
+        ImGui::Text("Leaf depth: %d to %d, average %.1f", stats.minLeafDepth, stats.maxLeafDepth, stats.averageLeafDepth);
+        ImGui::Text("Average sibling overlap: %.5f", stats.averageSiblingOverlap);
+        ImGui::Text("Memory: %.2f MB nodes, %.2f MB indices, build peak %.2f MB", stats.nodeBytes / (1024.0f * 1024.0f), stats.indexBytes / (1024.0f * 1024.0f),
+            stats.buildPeakBytes / (1024.0f * 1024.0f));
+        ImGui::Text("Build: %.1f ms%s", timings.totalMs, stats.loadedFromCache ? " (from cache)" : "");
+        ImGui::Text("  cache %.1f, references %.1f, hierarchy %.1f, optimize %.1f, flatten %.1f", timings.cacheMs, timings.referencesMs, timings.hierarchyMs, timings.optimizeMs, timings.flattenMs);
+        if (stats.optimization.passes > 0)
+        {
+            ImGui::Text("Reinsertion: SAH cost %.2f -> %.2f, %d moves in %d passes%s", stats.optimization.sahBefore, stats.optimization.sahAfter,
+                stats.optimization.reinsertions, stats.optimization.passes, stats.optimization.budgetExhausted ? " (budget used up)" : "");
+        }
+
+        auto histogramValue = [](void* data, int index) {
+            return float((*static_cast<const std::vector<int>*>(data))[index]);
+        };
+        ImGui::PlotHistogram("Leaf sizes", histogramValue, (void*)&stats.leafSizeHistogram, stats.leafSizeHistogram.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+        ImGui::PlotHistogram("Leaf depths", histogramValue, (void*)&stats.leafDepthHistogram, stats.leafDepthHistogram.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+
+        BVHStats topLevel = sceneBVH.getTopLevelStats();
+        ImGui::Text("Top level: %d nodes, SAH cost %.2f, depth %d", topLevel.nodeCount, topLevel.sahCost, topLevel.maxLeafDepth);
+        if (ImGui::Button("Save BVH statistics"))
+        {
+            sceneBVH.writeStatsJson("bvh_stats.json");
+        }
+    }
     
     // TODO:
     // Create rastered rendering mode
@@ -314,11 +385,11 @@ void Application::RenderGui(GLFWwindow* window)
 	// Object management ------------------------------------------------------------
     ImGui::BeginChild("Scene Objects", ImVec2(0, 200), true);
 
-    if (currentScene.objects.empty()) {
+    if (objects.empty()) {
         ImGui::TextDisabled("No objects in the scene.");
     }
     else {
-        for (int i = 0; i < currentScene.objects.size(); i++) {
+        for (int i = 0; i < objects.size(); i++) {
             std::string label = "Object " + std::to_string(i); // Or use object names
             if (ImGui::Selectable(label.c_str(), selectedIndex == i)) {
                 selectedIndex = i;
@@ -330,8 +401,8 @@ void Application::RenderGui(GLFWwindow* window)
     
     if (ImGui::Button("Add Object")) {
         Object newObj;
-        currentScene.objects.push_back(newObj);
-        selectedIndex = currentScene.objects.size() - 1;
+        objects.push_back(newObj);
+        selectedIndex = objects.size() - 1;
     }
 
     // Load preset scenes ------------------------------------------------
@@ -354,18 +425,38 @@ void Application::RenderGui(GLFWwindow* window)
 
 
 	// If an object is selected, show its properties
-    if (selectedIndex >= 0 && selectedIndex < currentScene.objects.size()) 
+    if (selectedIndex >= 0 && selectedIndex < objects.size()) 
     {
-        Object& obj = currentScene.objects[selectedIndex];
+        Object& obj = objects[selectedIndex];
         
         ImGui::Separator();
         ImGui::Text("Selected Object %d", selectedIndex);
 
         // Load model from disk ------------------------------------------------------------------------
-        if (ImGui::Button("Load .OBJ file")) {
+        // One model at a time, parsed on a worker thread while the window keeps running
+        bool loading = loadingObject >= 0;
+        ImGui::BeginDisabled(loading);
+        if (ImGui::Button("Load model file")) {
             IGFD::FileDialogConfig config;
             config.path = ".";
-            ImGuiFileDialog::Instance()->OpenDialog("ChooseFileDlgKey", "Choose File", ".obj", config);
+            ImGuiFileDialog::Instance()->OpenDialog("ChooseFileDlgKey", "Choose File", ".obj,.mesh", config);
+        }
+        ImGui::EndDisabled();
+        if (loading) {
+            ImGui::Text("Loading %s into object %d", loadingName.c_str(), loadingObject);
+            if (uploadingMesh) {
+                ImGui::ProgressBar(uploadingMesh->GetUploadProgress(), ImVec2(-1.0f, 0.0f), "Uploading");
+            }
+            else {
+                ImGui::ProgressBar(modelLoader.GetProgress(), ImVec2(-1.0f, 0.0f), "Parsing");
+            }
+            if (ImGui::Button("Cancel")) {
+                modelLoader.Cancel();
+                uploadingMesh.reset();
+                if (!modelLoader.IsLoading()) {
+                    loadingObject = -1;
+                }
+            }
         }
         // display
         if (ImGuiFileDialog::Instance()->Display("ChooseFileDlgKey")) {
@@ -373,31 +464,35 @@ void Application::RenderGui(GLFWwindow* window)
                 std::string filePathName = ImGuiFileDialog::Instance()->GetFilePathName();
                 std::string fileName = ImGuiFileDialog::Instance()->GetCurrentFileName();
 
-                obj.CreateObjectFromModel(filePathName);
-				obj.SetName(fileName);
-
-				obj.BindBuffers();
+                // A model some object already uses is shared right away, anything else goes to the worker
+                std::shared_ptr<Mesh> loaded = Mesh::Find(filePathName);
+                if (loaded && loaded->IsUploaded()) {
+                    SetObjectMesh(selectedIndex, loaded, fileName);
+                }
+                else {
+                    modelLoader.Start(filePathName);
+                    loadingObject = selectedIndex;
+                    loadingName = fileName;
+                }
             }
 
             // close
             ImGuiFileDialog::Instance()->Close();
         }
 		// --------------------------------------------------------------------------------------------
-        ImGui::BeginDisabled(!isRastered);
         ImGui::Text("Transform");
-        if (ImGui::DragFloat3("Position", &obj.position.x, 0.01f))
-        {
-			obj.UpdateModelMatrix();
-        }
-        if (ImGui::DragFloat3("Rotation", &obj.rotation.x, 0.5f))
-        {
-            obj.UpdateModelMatrix();
-        }
-        if (ImGui::DragFloat3("Scale", &obj.scale.x, 0.01f))
+        bool transformChanged = false;
+        transformChanged |= ImGui::DragFloat3("Position", &obj.position.x, 0.01f);
+        transformChanged |= ImGui::DragFloat3("Rotation", &obj.rotation.x, 0.5f);
+        transformChanged |= ImGui::DragFloat3("Scale", &obj.scale.x, 0.01f);
+        if (transformChanged)
         {
             obj.UpdateModelMatrix();
+            if (!isRastered)
+            {
+                UpdateObjectPathtraced(selectedIndex);
+            }
         }
-        ImGui::EndDisabled();
 
     }
 	// ----------------------------------------------------------------------------
@@ -405,19 +500,115 @@ void Application::RenderGui(GLFWwindow* window)
     ImGui::End();
 }
 
+void Application::UpdateModelLoading()
+{
+    if (modelLoader.IsFinished())
+    {
+        IndexedMesh geometry;
+        if (modelLoader.TakeResult(geometry) && loadingObject >= 0)
+        {
+            uploadingMesh = Mesh::Create(modelLoader.GetPath(), std::move(geometry));
+            uploadingMesh->BeginUpload();
+        }
+        else
+        {
+            loadingObject = -1; // Failed or cancelled, the object keeps its old model
+        }
+    }
+
+    // A few MB per frame keeps the frame time even while a large model goes to the GPU
+    if (uploadingMesh && uploadingMesh->ContinueUpload(8 << 20))
+    {
+        std::shared_ptr<Mesh> mesh = std::move(uploadingMesh);
+        int objectIndex = loadingObject;
+        loadingObject = -1;
+        SetObjectMesh(objectIndex, mesh, loadingName);
+    }
+}
+
+void Application::SetObjectMesh(int objectIndex, const std::shared_ptr<Mesh>& mesh, const std::string& name)
+{
+    Object& obj = objects[objectIndex];
+    obj.SetName(name);
+    if (isRastered)
+    {
+        obj.mesh = mesh;
+        return;
+    }
+
+    // Kept alive until the scene no longer refers to its geometry
+    std::shared_ptr<Mesh> previous = std::move(obj.mesh);
+    obj.mesh = mesh;
+    BindBuffersPathtraced();
+    frameCount = 0;
+    clearAccumulationBuffer(window);
+}
+
+void Application::UpdateObjectPathtraced(int objectIndex)
+{
+    // Objects added after entering path tracing are not part of the scene yet
+    if (objectIndex >= int(objectInstances.size()) || objectInstances[objectIndex] < 0)
+    {
+        return;
+    }
+    SceneRefitResult refit = sceneBVH.refitInstance(objectInstances[objectIndex], objects[objectIndex].modelMatrix);
+
+    // The mesh trees are in object space, so only the instances and the top-level tree change.
+    // A refit changes one instance and a range of nodes, only a rebuild uploads them all again.
+    const std::vector<BVHInstance>& instances = sceneBVH.getInstances();
+    const std::vector<BVHNode>& topLevelNodes = sceneBVH.getTopLevelNodes();
+    if (refit.rebuilt)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Instances);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, instances.size() * sizeof(BVHInstance), instances.data(), GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_TopLevelNodes);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, topLevelNodes.size() * sizeof(BVHNode), topLevelNodes.data(), GL_DYNAMIC_DRAW);
+    }
+    else
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Instances);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, refit.instanceSlot * sizeof(BVHInstance), sizeof(BVHInstance), &instances[refit.instanceSlot]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_TopLevelNodes);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, refit.firstNode * sizeof(BVHNode), refit.nodeCount * sizeof(BVHNode), &topLevelNodes[refit.firstNode]);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    frameCount = 0;
+    clearAccumulationBuffer(window);
+}
+
 void Application::BindBuffersPathtraced()
 {   
-    // Uncomment to be able to load object through UI
-    
-    // currentScene.primitives.clear();
+    // The preset scene is one mesh that is not moved. Every object is an instance of its mesh,
+    // so objects loading the same model share one bottom-level tree.
+    sceneBVH.clear();
+    if (!currentScene.primitives.empty())
+    {
+        sceneBVH.addInstance(sceneBVH.addMesh(currentScene.primitives), IdentityMatrix());
+    }
+    for (const IndexedMesh& model : currentScene.models)
+    {
+        sceneBVH.addInstance(sceneBVH.addMesh(model), IdentityMatrix());
+    }
 
-	for (auto& obj : currentScene.objects) {
-		// Add all primitives from the object to the scene
-		currentScene.primitives.insert(currentScene.primitives.end(), obj.primitives.begin(), obj.primitives.end());
+    objectInstances.clear();
+	for (auto& obj : objects) {
+        objectInstances.push_back(obj.mesh ? sceneBVH.addInstance(sceneBVH.addMesh(obj.mesh->geometry), obj.modelMatrix) : -1);
 	}
 
     // Rebuild the bvh tree
-    bvhTree.rebuild(currentScene.primitives);
+    sceneBVH.build();
+    // A deep tree would overflow the stack of the shader and lose the geometry under the dropped nodes.
+    // The program only ever grows, in steps of 16 entries, so switching scenes rarely recompiles it.
+    if (sceneBVH.getMaxStackSize() > pathtraceStackSize)
+    {
+        CompilePathtraceShader((sceneBVH.getMaxStackSize() + 15) / 16 * 16);
+    }
+    meshBVHStats.clear();
+    for (int i = 0; i < sceneBVH.getMeshCount(); i++)
+    {
+        meshBVHStats.push_back(sceneBVH.getMeshStats(i));
+    }
 
     float verts[] = {
         //bottom left Triangle
@@ -448,44 +639,68 @@ void Application::BindBuffersPathtraced()
     //ubos instead of SSBO since were at an earlier version of opengl // JONATANS EXTRA FINA TESTKOD
     GLuint SSBO_Primitives;
     GLuint SSBO_BVH;
-    GLuint SSBO_Indices;
+    GLuint SSBO_Materials;
     GLuint SSBO_PointLights;
     GLuint SSBO_AreaLights;
 
-    std::vector<BVHNode> gpuNodes;
-    gpuNodes.reserve(bvhTree.getNodes().size());
-    for (const BVHNode& node : bvhTree.getNodes()) {
-        gpuNodes.push_back({
-            node.bBoxMin,
-            node.leftChild,
-            node.bBoxMax,
-            node.rightChild,
-            node.startTriangle,
-            node.triangleCount,
-            node.escapeIndex,0
-            });
-    }
-
     // Allocate SSBO for spheres
 
-    std::cout << "Size: " << sizeof(Primitive) << " Bytes \n";
+    std::cout << "Size: " << sizeof(PrimitiveGeometry) << " Bytes per primitive, " << sizeof(IndexedTriangle) << " per indexed triangle, "
+        << sizeof(MeshVertex) << " per vertex, " << sizeof(Material) << " per material\n";
 
+    // Every mesh is copied into the buffers at its offset, the nodes straight from its tree and the primitive geometry in leaf order.
+    // The leaves address the geometry directly, the material of the closest hit is looked up in the shared table at binding 2.
     glGenBuffers(1, &SSBO_Primitives);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Primitives);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, currentScene.primitives.size() * sizeof(Primitive), currentScene.primitives.data(), GL_DYNAMIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(sceneBVH.getGeometryCount(), 1) * sizeof(PrimitiveGeometry), nullptr, GL_DYNAMIC_DRAW);
+    for (int i = 0; i < sceneBVH.getMeshCount(); i++) {
+        SceneMeshBuffers mesh = sceneBVH.getMesh(i);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, mesh.firstPrimitive * sizeof(PrimitiveGeometry), mesh.geometry.size() * sizeof(PrimitiveGeometry), mesh.geometry.data());
+    }
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, SSBO_Primitives);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
+    // Loaded models keep their shared vertices, their leaves hold three vertex numbers and a material per triangle.
+    // Neither buffer may be empty when bound, so there is always room for one element.
+    glGenBuffers(1, &SSBO_Triangles);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Triangles);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(sceneBVH.getTriangleCount(), 1) * sizeof(IndexedTriangle), nullptr, GL_DYNAMIC_DRAW);
+    for (int i = 0; i < sceneBVH.getMeshCount(); i++) {
+        SceneMeshBuffers mesh = sceneBVH.getMesh(i);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, mesh.firstPrimitive * sizeof(IndexedTriangle), mesh.triangles.size() * sizeof(IndexedTriangle), mesh.triangles.data());
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, SSBO_Triangles);
+
+    glGenBuffers(1, &SSBO_Vertices);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Vertices);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(sceneBVH.getVertexCount(), 1) * sizeof(MeshVertex), nullptr, GL_DYNAMIC_DRAW);
+    for (int i = 0; i < sceneBVH.getMeshCount(); i++) {
+        SceneMeshBuffers mesh = sceneBVH.getMesh(i);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, mesh.firstVertex * sizeof(MeshVertex), mesh.vertices.size() * sizeof(MeshVertex), mesh.vertices.data());
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, SSBO_Vertices);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glGenBuffers(1, &SSBO_Materials);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Materials);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sceneBVH.getMaterials().size() * sizeof(Material), sceneBVH.getMaterials().data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, SSBO_Materials);
+
     glGenBuffers(1, &SSBO_BVH);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_BVH);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, gpuNodes.size() * sizeof(BVHNode), gpuNodes.data(), GL_DYNAMIC_DRAW);
+    size_t nodeSize = sceneBVH.getNodeSize();
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sceneBVH.getNodeCount() * nodeSize, nullptr, GL_DYNAMIC_DRAW);
+    for (int i = 0; i < sceneBVH.getMeshCount(); i++) {
+        SceneMeshBuffers mesh = sceneBVH.getMesh(i);
+        if (sceneBVH.getBuiltNodeFormat() == BVHNodeFormat::Quantized) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, mesh.firstNode * nodeSize, mesh.quantizedNodes.size() * nodeSize, mesh.quantizedNodes.data());
+        }
+        else {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, mesh.firstNode * nodeSize, mesh.nodes.size() * nodeSize, mesh.nodes.data());
+        }
+    }
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, SSBO_BVH);
 
-    glGenBuffers(1, &SSBO_Indices);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Indices);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, bvhTree.getIndices().size() * sizeof(int), bvhTree.getIndices().data(), GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, SSBO_Indices);
-
     glGenBuffers(1, &SSBO_PointLights);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_PointLights);
     glBufferData(GL_SHADER_STORAGE_BUFFER, currentScene.pointLights.size() * sizeof(PointLight), currentScene.pointLights.data(), GL_DYNAMIC_DRAW);
@@ -496,6 +711,16 @@ void Application::BindBuffersPathtraced()
     glBufferData(GL_SHADER_STORAGE_BUFFER, currentScene.areaLights.size() * sizeof(AreaLight), currentScene.areaLights.data(), GL_DYNAMIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, SSBO_AreaLights);
 
+    glGenBuffers(1, &SSBO_Instances);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_Instances);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sceneBVH.getInstances().size() * sizeof(BVHInstance), sceneBVH.getInstances().data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, SSBO_Instances);
+
+    glGenBuffers(1, &SSBO_TopLevelNodes);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO_TopLevelNodes);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sceneBVH.getTopLevelNodes().size() * sizeof(BVHNode), sceneBVH.getTopLevelNodes().data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, SSBO_TopLevelNodes);
+
     glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
 
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
@@ -504,9 +729,37 @@ void Application::BindBuffersPathtraced()
     glBindVertexArray(0);
 }
 
+void Application::CompilePathtraceShader(int stackSize)
+{
+    Shader vertex = Shader("..\\shaders\\DisplayShader.vert", GL_VERTEX_SHADER);
+    Shader fragment = Shader("..\\shaders\\PathtraceShader.frag", GL_FRAGMENT_SHADER, "#define BVH_STACK_SIZE " + std::to_string(stackSize) + "\n");
+
+    if (PathtraceShader != 0)
+    {
+        glDeleteProgram(PathtraceShader);
+    }
+    PathtraceShader = glCreateProgram();
+    glAttachShader(PathtraceShader, vertex.shaderID);
+    glAttachShader(PathtraceShader, fragment.shaderID);
+    glLinkProgram(PathtraceShader);
+
+    int success;
+    char infoLog[512];
+    glGetProgramiv(PathtraceShader, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(PathtraceShader, 512, NULL, infoLog);
+        std::cerr << "ERROR::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    }
+    glDeleteShader(vertex.shaderID);
+    glDeleteShader(fragment.shaderID);
+    pathtraceStackSize = stackSize;
+    std::cout << "Path tracing shader compiled with a BVH stack of " << stackSize << " entries\n";
+}
+
 void Application::BindBuffersRasterized()
 {
-	for (auto& obj : currentScene.objects) {
+	for (auto& obj : objects) {
 		obj.BindBuffers();
 	}
 }
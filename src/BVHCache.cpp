@@ -0,0 +1,200 @@
+#include "BVHCache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace {
+	const char CACHE_MAGIC[8] = { 'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E' };
+
+	// Finalizer from MurmurHash3, spreads every input bit over the whole word
+	uint64_t mix(uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+}
+
+uint64_t BVHCache::hashBytes(const void* data, size_t size, uint64_t seed)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t hash = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		std::memcpy(&word, bytes + i, 8);
+		hash = mix(hash ^ word) + 0x9E3779B97F4A7C15ULL;
+	}
+	uint64_t tail = 0;
+	std::memcpy(&tail, bytes + i, size - i);
+	return mix(hash ^ tail);
+}
+
+uint64_t BVHCache::hashPayload(ArrayView<const BVHNode> nodes, ArrayView<const int> indices)
+{
+	uint64_t hash = hashBytes(nodes.data(), nodes.size() * sizeof(BVHNode), 0);
+	return hashBytes(indices.data(), indices.size() * sizeof(int), hash);
+}
+
+namespace {
+	// Only what the builder reads goes into the key, so editing a material does not invalidate the cache.
+	// The struct also has padding bytes with undefined contents, which must stay out of the hash.
+	struct Geometry {
+		vec3 vertex1, vertex2, vertex3;
+		int ID;
+	};
+}
+
+// Hashed in blocks, so only a small part of the geometry is copied at a time
+template<typename GeometryOf>
+uint64_t BVHCache::hashGeometry(size_t count, GeometryOf geometryOf)
+{
+	const size_t blockSize = 4096;
+	std::vector<Geometry> block;
+	block.reserve(blockSize);
+
+	uint64_t hash = hashBytes(&BVH_CACHE_VERSION, sizeof(BVH_CACHE_VERSION), count);
+	for (size_t start = 0; start < count; start += blockSize) {
+		block.clear();
+		for (size_t i = start; i < std::min(count, start + blockSize); i++) {
+			block.push_back(geometryOf(i));
+		}
+		hash = hashBytes(block.data(), block.size() * sizeof(Geometry), hash);
+	}
+	return hash;
+}
+
+uint64_t BVHCache::hashSettings(const BVHBuildSettings& settings, int maxPrimitives, uint64_t hash)
+{
+	// The thread count does not change the result, so it is left out
+	int builder = static_cast<int>(settings.builder);
+	hash = hashBytes(&builder, sizeof(builder), hash);
+	hash = hashBytes(&maxPrimitives, sizeof(maxPrimitives), hash);
+	if (settings.builder == BVHBuilder::SpatialSplits) {
+		hash = hashBytes(&settings.splitAlpha, sizeof(settings.splitAlpha), hash);
+		hash = hashBytes(&settings.maxDuplication, sizeof(settings.maxDuplication), hash);
+	}
+	if (settings.builder == BVHBuilder::Linear) {
+		int linearOptions = (settings.mortonCodes64 ? 1 : 0) | (settings.optimizeTreelets ? 2 : 0);
+		hash = hashBytes(&linearOptions, sizeof(linearOptions), hash);
+	}
+	// How far the pass gets depends on the machine, the cached tree is whatever the first build reached
+	if (settings.optimizationBudgetMs > 0.0f) {
+		hash = hashBytes(&settings.optimizationBudgetMs, sizeof(settings.optimizationBudgetMs), hash);
+	}
+	return hash;
+}
+
+uint64_t BVHCache::computeKey(ArrayView<const Primitive> primitives, const BVHBuildSettings& settings, int maxPrimitives)
+{
+	uint64_t hash = hashGeometry(primitives.size(), [&](size_t i) {
+		const Primitive& p = primitives[i];
+		return Geometry{ p.vertex1, p.vertex2, p.vertex3, p.ID };
+	});
+	return hashSettings(settings, maxPrimitives, hash);
+}
+
+uint64_t BVHCache::computeKey(ArrayView<const vec3> positions, ArrayView<const uint32_t> indices, const BVHBuildSettings& settings, int maxPrimitives)
+{
+	uint64_t hash = hashGeometry(indices.size() / 3, [&](size_t i) {
+		return Geometry{ positions[indices[3 * i]], positions[indices[3 * i + 1]], positions[indices[3 * i + 2]], 0 };
+	});
+	return hashSettings(settings, maxPrimitives, hash);
+}
+
+std::string BVHCache::pathFor(const std::string& directory, uint64_t key)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+	return (std::filesystem::path(directory) / name).string();
+}
+
+bool BVHCache::load(const std::string& path, uint64_t key, MappedFile& file,
+	ArrayView<const BVHNode>& nodes, ArrayView<const int>& indices)
+{
+	if (!file.open(path)) {
+		return false; // Not cached yet
+	}
+
+	Header header;
+	bool valid = file.getSize() >= sizeof(Header);
+	if (valid) {
+		std::memcpy(&header, file.getData(), sizeof(Header));
+		valid = std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+			&& header.version == BVH_CACHE_VERSION
+			&& header.nodeSize == sizeof(BVHNode)
+			&& header.key == key
+			// An empty tree is never saved, and each count alone has to fit in the file, so that a damaged
+			// count cannot wrap the sum below around
+			&& header.nodeCount > 0
+			&& header.nodeCount <= file.getSize() / sizeof(BVHNode)
+			&& header.indexCount <= file.getSize() / sizeof(int)
+			&& file.getSize() == sizeof(Header) + header.nodeCount * sizeof(BVHNode) + header.indexCount * sizeof(int);
+	}
+	if (valid) {
+		const char* payload = file.getData() + sizeof(Header);
+		nodes = ArrayView<const BVHNode>(reinterpret_cast<const BVHNode*>(payload), header.nodeCount);
+		indices = ArrayView<const int>(reinterpret_cast<const int*>(payload + header.nodeCount * sizeof(BVHNode)), header.indexCount);
+		valid = hashPayload(nodes, indices) == header.payloadHash;
+	}
+
+	if (!valid) {
+		std::cerr << "Ignoring stale or damaged BVH cache file: " << path << std::endl;
+		file.close();
+		nodes = {};
+		indices = {};
+	}
+	return valid;
+}
+
+bool BVHCache::save(const std::string& path, uint64_t key,
+	ArrayView<const BVHNode> nodes, ArrayView<const int> indices)
+{
+	std::error_code error;
+	std::filesystem::path target(path);
+	if (target.has_parent_path()) {
+		std::filesystem::create_directories(target.parent_path(), error);
+	}
+
+	Header header;
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = BVH_CACHE_VERSION;
+	header.nodeSize = sizeof(BVHNode);
+	header.key = key;
+	header.nodeCount = nodes.size();
+	header.indexCount = indices.size();
+	header.payloadHash = hashPayload(nodes, indices);
+
+	// Written next to the target and renamed, so a crash never leaves a half written cache file behind
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			std::cerr << "Failed to write BVH cache file: " << tempPath << std::endl;
+			return false;
+		}
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(BVHNode));
+		out.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(int));
+		if (!out.good()) {
+			std::cerr << "Failed to write BVH cache file: " << tempPath << std::endl;
+			out.close();
+			std::filesystem::remove(tempPath, error);
+			return false;
+		}
+	}
+
+	std::filesystem::remove(target, error);
+	std::filesystem::rename(tempPath, target, error);
+	if (error) {
+		std::cerr << "Failed to write BVH cache file: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
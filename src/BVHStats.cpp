@@ -0,0 +1,131 @@
+#include "BVHStats.h"
+#include "BVHTree.h"
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <utility>
+
+namespace {
+	void writeArray(std::ostream& out, const std::vector<int>& values) {
+		out << "[";
+		for (size_t i = 0; i < values.size(); i++) {
+			out << (i > 0 ? ", " : "") << values[i];
+		}
+		out << "]";
+	}
+}
+
+BVHStats BVHStats::compute(ArrayView<const BVHNode> nodes, ArrayView<const int> indices, int primitiveCount)
+{
+	BVHStats stats;
+	stats.nodeCount = nodes.size();
+	stats.primitiveCount = primitiveCount;
+	stats.referenceCount = indices.size();
+	stats.nodeBytes = nodes.size() * sizeof(BVHNode);
+	stats.indexBytes = indices.size() * sizeof(int);
+	if (nodes.empty()) {
+		return stats;
+	}
+
+	float rootArea = surfaceArea({ nodes[0].bBoxMin, nodes[0].bBoxMax });
+	float Ct = 0.5f;
+	float Ci = 1.0f;
+	double cost = 0.0;
+	double overlap = 0.0;
+	long long depthSum = 0;
+	stats.minLeafDepth = INT_MAX;
+
+	// The depth is not stored in the nodes, so the tree is walked with a stack of (node, depth)
+	std::vector<std::pair<int, int>> stack;
+	stack.push_back({ 0, 0 });
+	while (!stack.empty()) {
+		auto [nodeIndex, depth] = stack.back();
+		stack.pop_back();
+		const BVHNode& node = nodes[nodeIndex];
+		float area = surfaceArea({ node.bBoxMin, node.bBoxMax });
+
+		if (node.leftChild == -1) {
+			cost += Ci * node.triangleCount * area;
+			stats.leafCount++;
+			depthSum += depth;
+			stats.minLeafDepth = std::min(stats.minLeafDepth, depth);
+			stats.maxLeafDepth = std::max(stats.maxLeafDepth, depth);
+			if (int(stats.leafSizeHistogram.size()) <= node.triangleCount) {
+				stats.leafSizeHistogram.resize(node.triangleCount + 1);
+			}
+			stats.leafSizeHistogram[node.triangleCount]++;
+			if (int(stats.leafDepthHistogram.size()) <= depth) {
+				stats.leafDepthHistogram.resize(depth + 1);
+			}
+			stats.leafDepthHistogram[depth]++;
+			continue;
+		}
+
+		cost += Ct * area;
+		const BVHNode& left = nodes[node.leftChild];
+		const BVHNode& right = nodes[node.rightChild];
+		AABB shared = intersectionAABB({ left.bBoxMin, left.bBoxMax }, { right.bBoxMin, right.bBoxMax });
+		if (!isEmptyAABB(shared)) {
+			overlap += surfaceArea(shared);
+		}
+		stack.push_back({ node.rightChild, depth + 1 });
+		stack.push_back({ node.leftChild, depth + 1 });
+	}
+
+	int innerCount = stats.nodeCount - stats.leafCount;
+	if (rootArea > 0.0f) {
+		stats.sahCost = float(cost / rootArea);
+		stats.averageSiblingOverlap = innerCount > 0 ? float(overlap / innerCount / rootArea) : 0.0f;
+	}
+	stats.averageLeafDepth = float(double(depthSum) / stats.leafCount);
+	return stats;
+}
+
+std::string BVHStats::toJson(int indent) const
+{
+	std::string pad(indent, ' ');
+	std::ostringstream out;
+	out << "{\n";
+	out << pad << "  \"sahCost\": " << sahCost << ",\n";
+	out << pad << "  \"nodeCount\": " << nodeCount << ",\n";
+	out << pad << "  \"leafCount\": " << leafCount << ",\n";
+	out << pad << "  \"primitiveCount\": " << primitiveCount << ",\n";
+	out << pad << "  \"referenceCount\": " << referenceCount << ",\n";
+	out << pad << "  \"leafDepth\": { \"min\": " << minLeafDepth << ", \"max\": " << maxLeafDepth
+		<< ", \"average\": " << averageLeafDepth << " },\n";
+	out << pad << "  \"leafSizeHistogram\": ";
+	writeArray(out, leafSizeHistogram);
+	out << ",\n";
+	out << pad << "  \"leafDepthHistogram\": ";
+	writeArray(out, leafDepthHistogram);
+	out << ",\n";
+	out << pad << "  \"averageSiblingOverlap\": " << averageSiblingOverlap << ",\n";
+	out << pad << "  \"memory\": { \"nodeBytes\": " << nodeBytes << ", \"indexBytes\": " << indexBytes
+		<< ", \"buildPeakBytes\": " << buildPeakBytes << " },\n";
+	out << pad << "  \"loadedFromCache\": " << (loadedFromCache ? "true" : "false") << ",\n";
+	out << pad << "  \"buildTimeMs\": { \"cache\": " << buildTimings.cacheMs
+		<< ", \"references\": " << buildTimings.referencesMs
+		<< ", \"hierarchy\": " << buildTimings.hierarchyMs
+		<< ", \"optimize\": " << buildTimings.optimizeMs
+		<< ", \"flatten\": " << buildTimings.flattenMs
+		<< ", \"total\": " << buildTimings.totalMs << " },\n";
+	out << pad << "  \"optimization\": { \"sahBefore\": " << optimization.sahBefore
+		<< ", \"sahAfter\": " << optimization.sahAfter
+		<< ", \"passes\": " << optimization.passes
+		<< ", \"reinsertions\": " << optimization.reinsertions
+		<< ", \"budgetExhausted\": " << (optimization.budgetExhausted ? "true" : "false") << " }\n";
+	out << pad << "}";
+	return out.str();
+}
+
+bool BVHStats::writeJson(const std::string& path) const
+{
+	std::ofstream out(path, std::ios::trunc);
+	if (!out.is_open()) {
+		std::cerr << "Failed to write BVH statistics: " << path << std::endl;
+		return false;
+	}
+	out << toJson() << "\n";
+	return out.good();
+}
@@ -1,128 +1,392 @@
 #include "BVHTree.h"
 #include "BoundingHelper.h"
+#include "BVHCache.h"
 #include "iostream"
+#include <algorithm>
+#include <array>
+#include <chrono>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
+namespace {
+    constexpr int NUM_BINS = 16;
+    constexpr int NUM_SPATIAL_BINS = 16;
 
-BVHTree::BVHTree(std::vector<Primitive>& primitives) : primitives(primitives){
-        // Initialize index buffer [0, 1, ..., N-1]
-        triangleIndices.resize(primitives.size());
-        std::iota(triangleIndices.begin(), triangleIndices.end(), 0); //Skapar en lista med vrden frn 0 till triangleIndices.size().
-        largestDepth = 0;
-        smallestDepth = 1000;
-        if (primitives.size() < 50) {
-            maxPrimitives = 12;
+    // Below these sizes the work stays on the current thread, a task would cost more than it saves.
+    constexpr int PARALLEL_BINNING_THRESHOLD = 1 << 14;
+    constexpr int PARALLEL_TASK_THRESHOLD = 256;
+
+    struct Bin {
+        AABB bounds;
+        int count = 0;
+    };
+
+    // Merges boundsOf(i) for every i in [start, start + count), split over the pool for large ranges.
+    template<typename Func>
+    AABB reduceBounds(ThreadPool& pool, int start, int count, Func boundsOf) {
+        AABB bounds;
+        if (count < PARALLEL_BINNING_THRESHOLD) {
+            for (int i = start; i < start + count; i++) {
+                expandAABB(bounds, boundsOf(i));
+            }
+            return bounds;
         }
-        else {
-            maxPrimitives = 2;
+
+        std::vector<AABB> partial(pool.getThreadCount());
+        pool.parallelChunks(start, start + count, partial.size(), [&](int chunk, int chunkBegin, int chunkEnd) {
+            AABB local;
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                expandAABB(local, boundsOf(i));
+            }
+            partial[chunk] = local;
+        });
+        for (const AABB& local : partial) {
+            expandAABB(bounds, local);
+        }
+        return bounds;
+    }
+
+    // Spreads the low 21 bits of v out to every third bit, so that three of them interleave into a Morton code.
+    uint64_t expandBits(uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffULL;
+        v = (v | v << 16) & 0x1f0000ff0000ffULL;
+        v = (v | v << 8) & 0x100f00f00f00f00fULL;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+        v = (v | v << 2) & 0x1249249249249249ULL;
+        return v;
+    }
+
+    int countLeadingZeros(uint64_t x) {
+#ifdef _MSC_VER
+        unsigned long index;
+        return _BitScanReverse64(&index, x) ? 63 - int(index) : 64;
+#else
+        return x == 0 ? 64 : __builtin_clzll(x);
+#endif
+    }
+
+    // Stable LSD radix sort on the low keyBits bits of the keys, the values are moved along with them.
+    // Every pass counts the digits of each chunk in parallel, then every chunk scatters to its own offsets.
+    void radixSort(ThreadPool& pool, std::vector<uint64_t>& keys, std::vector<int>& values, int keyBits) {
+        constexpr int RADIX_BITS = 8;
+        constexpr int RADIX = 1 << RADIX_BITS;
+
+        int count = keys.size();
+        int chunkCount = count < PARALLEL_BINNING_THRESHOLD ? 1 : pool.getThreadCount();
+        std::vector<std::array<int, RADIX>> offsets(chunkCount);
+        std::vector<uint64_t> sortedKeys(count);
+        std::vector<int> sortedValues(count);
+
+        for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+            pool.parallelChunks(0, count, chunkCount, [&](int chunk, int chunkBegin, int chunkEnd) {
+                std::array<int, RADIX>& histogram = offsets[chunk];
+                histogram.fill(0);
+                for (int i = chunkBegin; i < chunkEnd; i++) {
+                    histogram[(keys[i] >> shift) & (RADIX - 1)]++;
+                }
+            });
+
+            // Digit by digit, and chunk by chunk within a digit, which keeps the sort stable
+            int offset = 0;
+            for (int digit = 0; digit < RADIX; digit++) {
+                for (std::array<int, RADIX>& histogram : offsets) {
+                    int digitCount = histogram[digit];
+                    histogram[digit] = offset;
+                    offset += digitCount;
+                }
+            }
+
+            pool.parallelChunks(0, count, chunkCount, [&](int chunk, int chunkBegin, int chunkEnd) {
+                std::array<int, RADIX>& next = offsets[chunk];
+                for (int i = chunkBegin; i < chunkEnd; i++) {
+                    int position = next[(keys[i] >> shift) & (RADIX - 1)]++;
+                    sortedKeys[position] = keys[i];
+                    sortedValues[position] = values[i];
+                }
+            });
+            keys.swap(sortedKeys);
+            values.swap(sortedValues);
         }
-        buildRecursive(0, primitives.size(), 0); //startar byggandet av trdet.
+    }
+}
+
+// Karras' binary radix tree over the sorted Morton codes. Inner nodes are [0, n - 1) and leaf k is
+// n - 1 + k, so the root is node 0 in both cases. Every node covers the sorted primitives [first, last].
+struct BVHTree::LinearHierarchy {
+    std::vector<int> left, right, parent;
+    std::vector<int> first, last;
+    std::vector<AABB> bounds;
+    std::vector<float> costs; // Per build node, only filled for the treelet optimization
+};
+
+BVHTree::BVHTree(ArrayView<const Primitive> primitives) : primitives(primitives){
+        chooseLeafSize();
+        build(); //startar byggandet av trdet.
         //std::cout << this->nodes.size(); //Bara fr debugging
 		//traverseTree(); //Traversera trdet fr att se att det r korrekt byggt.
 }
 
-//Berknar AABB fr trianglarna frn och med start till start + count.
-AABB BVHTree::computeBounds(int start, int count) {
-    AABB bounds = computeAABB(primitives[triangleIndices[start]]);
-    for (int i = start + 1; i < start + count; i++) {
-        expandAABB(bounds, computeAABB(primitives[triangleIndices[i]]));
+void BVHTree::chooseLeafSize() {
+    if (getPrimitiveCount() < 50) {
+        maxPrimitives = 12;
+    }
+    else {
+        maxPrimitives = 2;
     }
-    return bounds;
 }
 
-void BVHTree::rebuild(const std::vector<Primitive>& newPrims)
+//Berknar AABB fr trianglarna frn och med start till start + count.
+AABB BVHTree::computeBounds(ThreadPool& pool, const int* ids, int count) {
+    return reduceBounds(pool, 0, count, [&](int i) {
+        return refs.bounds(ids[i]);
+    });
+}
+
+AABB BVHTree::computeCentroidBounds(ThreadPool& pool, const int* ids, int count) {
+    return reduceBounds(pool, 0, count, [&](int i) {
+        vec3 centroid = refs.centroid(ids[i]);
+        AABB pointBounds;
+        pointBounds.min = centroid;
+        pointBounds.max = centroid;
+        return pointBounds;
+    });
+}
+
+void BVHTree::rebuild(ArrayView<const Primitive> newPrims)
 {
     primitives = newPrims;
+    meshPositions = {};
+    meshIndices = {};
+    rebuildInput();
+}
+
+void BVHTree::rebuild(const IndexedMesh& mesh)
+{
+    primitives = {};
+    meshPositions = mesh.positions;
+    meshIndices = mesh.indices;
+    rebuildInput();
+}
+
+void BVHTree::rebuildInput()
+{
+    auto rebuildStart = std::chrono::high_resolution_clock::now();
+    auto msSince = [](std::chrono::high_resolution_clock::time_point start) {
+        return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    };
+    chooseLeafSize();
+
+    uint64_t cacheKey = 0;
+    std::string cachePath;
+    float cacheMs = 0.0f;
+    if (!cacheDirectory.empty()) {
+        auto startTime = std::chrono::high_resolution_clock::now();
+        cacheKey = meshIndices.empty() ? BVHCache::computeKey(primitives, settings, maxPrimitives)
+            : BVHCache::computeKey(meshPositions, meshIndices, settings, maxPrimitives);
+        cachePath = BVHCache::pathFor(cacheDirectory, cacheKey);
+
+        // The built arrays are released first, on a hit the views point into the mapping instead
+        nodes.clear();
+        nodes.shrink_to_fit();
+        triangleIndices.clear();
+        triangleIndices.shrink_to_fit();
+        loadedFromCache = BVHCache::load(cachePath, cacheKey, cacheFile, nodeView, indexView);
+        if (loadedFromCache) {
+            rootArea = surfaceArea({ nodeView[0].bBoxMin, nodeView[0].bBoxMax });
+            sahCost = computeSAHCost();
+            buildTimeMs = msSince(startTime);
+            buildTimings = BVHBuildTimings();
+            optimizationReport = BVHOptimizationReport();
+            buildPeakBytes = 0; // Nothing was built, the mapping is not counted
+            buildTimings.cacheMs = buildTimings.totalMs = buildTimeMs;
+            std::cout << "BVH loaded from cache in " << buildTimeMs << " ms: " << cachePath << "\n\n";
+            return;
+        }
+        cacheMs = msSince(startTime);
+    }
+
+    build();
+    std::cout << "Largest depth: " << largestDepth << "    Smallest depth: " << smallestDepth << "\n";
+    std::cout << "BVH build: " << buildTimeMs << " ms on " << (settings.threadCount > 0 ? settings.threadCount : ThreadPool::hardwareThreads()) << " threads, "
+        << triangleIndices.size() << " references for " << getPrimitiveCount() << " primitives, peak "
+        << buildPeakBytes / (1024.0f * 1024.0f) << " MB\n\n";
+
+    // An empty mesh builds instantly and would only leave a file without nodes behind
+    if (!cachePath.empty() && !nodeView.empty()) {
+        auto saveStart = std::chrono::high_resolution_clock::now();
+        BVHCache::save(cachePath, cacheKey, nodeView, indexView);
+        cacheMs += msSince(saveStart);
+    }
+    buildTimings.cacheMs = cacheMs;
+    buildTimings.totalMs = msSince(rebuildStart);
+}
+
+void BVHTree::build()
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+    auto phaseStart = startTime;
+    // Time since the end of the previous phase
+    auto lap = [&phaseStart]() {
+        auto now = std::chrono::high_resolution_clock::now();
+        float ms = std::chrono::duration<float, std::milli>(now - phaseStart).count();
+        phaseStart = now;
+        return ms;
+    };
+    buildTimings = BVHBuildTimings();
+    optimizationReport = BVHOptimizationReport();
+    buildPeakBytes = 0;
 
+    cacheFile.close();
+    loadedFromCache = false;
     nodes.clear();
-	triangleIndices.clear();
+    triangleIndices.clear();
     largestDepth = 0;
     smallestDepth = 1000;
-    triangleIndices.resize(primitives.size());
-    std::iota(triangleIndices.begin(), triangleIndices.end(), 0);
 
-    buildRecursive(0, primitives.size(), 0);
-    std::cout << "Largest depth: " << largestDepth << "    Smallest depth: " << smallestDepth << "\n\n";
-}
+    if (getPrimitiveCount() > 0) {
+        ThreadPool pool(settings.threadCount);
+        int primitiveCount = getPrimitiveCount();
+        bool spatialSplits = settings.builder == BVHBuilder::SpatialSplits;
 
-//Funktionen bygger trdet uppifrn, dvs den startar med roten och slutar med lven.
-int BVHTree::buildRecursive(int start, int count, int depth) {
-    
-    //Hmta boundsen fr de relevanta trianglarna (om vi r i roten r det alla, i lven r det den enstaka triangeln).
-    AABB bounds = computeBounds(start, count);
-    //Skapa noden och allocata den till nodes.
-    BVHNode node;
-    node.bBoxMin = bounds.min;
-    node.bBoxMax = bounds.max;
+        // Spatial splits append new references, all of them have to fit in the arrays up front
+        maxReferences = primitiveCount;
+        if (spatialSplits) {
+            maxReferences += int(primitiveCount * std::max(0.0f, settings.maxDuplication));
+        }
 
-    int nodeIndex = nodes.size();
-    nodes.push_back(node);
+        // Bounds and centroids are computed once here, every later pass reads them from refs
+        refs.resize(maxReferences);
+        pool.parallelFor(0, primitiveCount, 4096, [&](int rangeBegin, int rangeEnd) {
+            for (int i = rangeBegin; i < rangeEnd; i++) {
+                if (meshIndices.empty()) {
+                    const Primitive& p = primitives[i];
+                    refs.set(i, computeAABB(p), (p.vertex1 + p.vertex2 + p.vertex3) / 3.0f);
+                }
+                else {
+                    const vec3& v1 = meshPositions[meshIndices[3 * i]];
+                    const vec3& v2 = meshPositions[meshIndices[3 * i + 1]];
+                    const vec3& v3 = meshPositions[meshIndices[3 * i + 2]];
+                    refs.set(i, computeAABB(v1, v2, v3), (v1 + v2 + v3) / 3.0f);
+                }
+                refs.primitive[i] = i;
+            }
+        });
+        buildTimings.referencesMs = lap();
 
-    //Om det r en lvnod s skapar vi en korrekt lvnod (inga children s vi stter dem till -1).
-    if (count <= maxPrimitives) {
-        nodes[nodeIndex].startTriangle = start;
-        nodes[nodeIndex].triangleCount = count;
-        nodes[nodeIndex].leftChild = -1;
-        nodes[nodeIndex].rightChild = -1;
-        nodes[nodeIndex].escapeIndex = nodeIndex + 1; // next node in pre-order
-        if (depth < smallestDepth) {
-            smallestDepth = depth;
+        // Every split has two non-empty children, so there are never more than 2N - 1 nodes.
+        buildNodes.resize(2 * maxReferences);
+        buildNodeCount = 1;
+
+        // Initialize index buffer [0, 1, ..., N-1]
+        std::vector<int> rootIds(primitiveCount);
+        std::iota(rootIds.begin(), rootIds.end(), 0); //Skapar en lista med vrden frn 0 till triangleIndices.size().
+
+        TaskGroup group;
+        if (spatialSplits) {
+            rootArea = surfaceArea(computeBounds(pool, rootIds.data(), primitiveCount));
+            referenceCount = primitiveCount;
+            leafReferenceCount = 0;
+            triangleIndices.resize(maxReferences);
+            buildSpatialRecursive(pool, group, 0, std::move(rootIds));
         }
-        if (depth > largestDepth) {
-            largestDepth = depth;
+        else if (settings.builder == BVHBuilder::Linear) {
+            buildLinear(pool);
         }
-        return nodeIndex;
-        
-    }
+        else {
+            triangleIndices = std::move(rootIds);
+            buildRecursive(pool, group, 0, 0, primitiveCount);
+        }
+        pool.wait(group);
+        notePeakMemory();
+        buildTimings.hierarchyMs = lap();
 
-    //Denhr biten r ett stt att bryta upp trdet p. Det finns bttre  denna bit av koden r verdrivet jobbig
-    //pga att jag frgade chatten om en lsning  dens lsning  innehll glm::vec3 och glm::max osv, vilket jag behvde jobba
-    //runt d den frskta anvnda vec3[0] fr att hmta x elementet, vilket Ingemars vektorer inte har som en funktion.
-    //TODO: Anvnd en bttre heuristic.
-    AABB centroidBounds;
-    for (int i = start; i < start + count; ++i) {
-        const Primitive& p = primitives[triangleIndices[i]];
-        vec3 centroid = (p.vertex1 + p.vertex2 + p.vertex3) / 3.0f;
-        AABB pointBounds;
-        pointBounds.min = centroid;
-        pointBounds.max = centroid;
-        expandAABB(centroidBounds, pointBounds);
+        if (settings.optimizationBudgetMs > 0.0f && buildNodeCount > 2) {
+            optimizeByReinsertion();
+            buildTimings.optimizeMs = lap();
+            std::cout << "BVH reinsertion: SAH cost " << optimizationReport.sahBefore << " -> " << optimizationReport.sahAfter
+                << " in " << optimizationReport.reinsertions << " moves in " << optimizationReport.passes << " passes, " << buildTimings.optimizeMs << " ms\n";
+        }
+
+        nodes.reserve(buildNodeCount);
+        std::vector<int> packedIndices;
+        packedIndices.reserve(triangleIndices.size());
+        flattenRecursive(0, 0, packedIndices);
+        notePeakMemory(packedIndices.capacity() * sizeof(int));
+        triangleIndices.swap(packedIndices);
+        buildTimings.flattenMs = lap();
     }
-    int splitAxis = longestAxis(centroidBounds);
+    refs.clear();
+    buildNodes.clear();
+    buildNodes.shrink_to_fit();
+    nodeView = nodes;
+    indexView = triangleIndices;
 
-    constexpr int NUM_BINS = 16;
-    struct Bin {
-        AABB bounds;
-        int count = 0;
-    };
+    // The SAH cost is relative to the root area
+    rootArea = nodes.empty() ? 0.0f : surfaceArea({ nodes[0].bBoxMin, nodes[0].bBoxMax });
+    sahCost = computeSAHCost();
 
-    Bin bins[NUM_BINS];
+    buildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+    buildTimings.totalMs = buildTimeMs;
+}
+
+// Keeps the largest sum of the build arrays seen so far, extraBytes are temporaries the caller holds.
+// Only called from the thread that runs build(), between the parallel phases.
+void BVHTree::notePeakMemory(size_t extraBytes) {
+    size_t bytes = extraBytes + refs.bytes() + buildNodes.capacity() * sizeof(BVHNode)
+        + triangleIndices.capacity() * sizeof(int) + nodes.capacity() * sizeof(BVHNode);
+    buildPeakBytes = std::max(buildPeakBytes, bytes);
+}
+
+//Denhr biten r ett stt att bryta upp trdet p. Det finns bttre  denna bit av koden r verdrivet jobbig
+//pga att jag frgade chatten om en lsning  dens lsning  innehll glm::vec3 och glm::max osv, vilket jag behvde jobba
+//runt d den frskta anvnda vec3[0] fr att hmta x elementet, vilket Ingemars vektorer inte har som en funktion.
+//TODO: Anvnd en bttre heuristic.
+BVHTree::ObjectSplit BVHTree::findObjectSplit(ThreadPool& pool, const int* ids, int count, const AABB& bounds) {
+    ObjectSplit split;
+
+    AABB centroidBounds = computeCentroidBounds(pool, ids, count);
+    int splitAxis = longestAxis(centroidBounds);
+    split.axis = splitAxis;
 
     float minCentroid = centroidBounds.min[splitAxis];
     float maxCentroid = centroidBounds.max[splitAxis];
     if (maxCentroid - minCentroid < 1e-3f) {
-        nodes[nodeIndex].startTriangle = start;
-        nodes[nodeIndex].triangleCount = count;
-        nodes[nodeIndex].leftChild = -1;
-        nodes[nodeIndex].rightChild = -1;
-        nodes[nodeIndex].escapeIndex = nodeIndex + 1; // next node in pre-order
-        if (depth < smallestDepth) {
-            smallestDepth = depth;
-        }
-        if (depth > largestDepth) {
-            largestDepth = depth;
-        }
-        return nodeIndex;
+        split.degenerate = true;
+        return split;
     }
     float scale = NUM_BINS / (maxCentroid - minCentroid + 1e-5f); // Undvik div-by-zero
     
+    const float* axisCentroids = refs.centroids(splitAxis);
 
-    for (int i = start; i < start + count; ++i) {
-        const Primitive& p = primitives[triangleIndices[i]];
-        vec3 centroid = (p.vertex1 + p.vertex2 + p.vertex3) / 3.0f;
-        int binIdx = std::min(NUM_BINS - 1, int((centroid[splitAxis] - minCentroid) * scale));
-        bins[binIdx].bounds = mergeAABB(bins[binIdx].bounds, computeAABB(primitives[triangleIndices[i]]));
-        bins[binIdx].count++;
+    auto binRange = [&](int rangeBegin, int rangeEnd, Bin* bins) {
+        for (int i = rangeBegin; i < rangeEnd; ++i) {
+            int ref = ids[i];
+            int binIdx = std::min(NUM_BINS - 1, int((axisCentroids[ref] - minCentroid) * scale));
+            bins[binIdx].bounds = mergeAABB(bins[binIdx].bounds, refs.bounds(ref));
+            bins[binIdx].count++;
+        }
+    };
+
+    Bin bins[NUM_BINS];
+
+    if (count < PARALLEL_BINNING_THRESHOLD) {
+        binRange(0, count, bins);
+    }
+    else {
+        // The root levels hold most of the primitives, so their binning pass is split over the pool
+        std::vector<std::array<Bin, NUM_BINS>> partialBins(pool.getThreadCount());
+        pool.parallelChunks(0, count, partialBins.size(), [&](int chunk, int chunkBegin, int chunkEnd) {
+            binRange(chunkBegin, chunkEnd, partialBins[chunk].data());
+        });
+        for (const auto& partial : partialBins) {
+            for (int i = 0; i < NUM_BINS; ++i) {
+                bins[i].bounds = mergeAABB(bins[i].bounds, partial[i].bounds);
+                bins[i].count += partial[i].count;
+            }
+        }
     }
 
     AABB leftBounds[NUM_BINS - 1];
@@ -150,7 +414,6 @@ int BVHTree::buildRecursive(int start, int count, int depth) {
         rightCounts[i - 1] = curCount;
     }
 
-    float bestCost = std::numeric_limits<float>::max();
     int bestSplit = -1;
     float parentArea = surfaceArea(bounds);
     //float parentVolume = volume(bounds);
@@ -165,14 +428,54 @@ int BVHTree::buildRecursive(int start, int count, int depth) {
             )) / parentArea;
         float imbalance = std::abs(leftCounts[i] - rightCounts[i]) / float(leftCounts[i] + rightCounts[i]);
 
-        if (cost < bestCost && imbalance < 0.9f) {
-            bestCost = cost;
+        if (cost < split.cost && imbalance < 0.9f) {
+            split.cost = cost;
             bestSplit = i;
         }
     }
-    int mid;
-    if (bestCost > 1.0f) {
-        // Fallback: median split
+
+    if (bestSplit >= 0) {
+        float binWidth = (maxCentroid - minCentroid) / float(NUM_BINS);
+        split.position = minCentroid + binWidth * (bestSplit + 1);
+        split.leftBounds = leftBounds[bestSplit];
+        split.rightBounds = rightBounds[bestSplit];
+    }
+    return split;
+}
+
+//Funktionen bygger trdet uppifrn, dvs den startar med roten och slutar med lven.
+//Noden skrivs till buildNodes[nodeIndex], barnen byggs som egna tasks i poolen.
+void BVHTree::buildRecursive(ThreadPool& pool, TaskGroup& group, int nodeIndex, int start, int count) {
+    
+    //Hmta boundsen fr de relevanta trianglarna (om vi r i roten r det alla, i lven r det den enstaka triangeln).
+    AABB bounds = computeBounds(pool, &triangleIndices[start], count);
+    //Noden har redan en plats i buildNodes, som inte vxer under bygget.
+    BVHNode& node = buildNodes[nodeIndex];
+    node.bBoxMin = bounds.min;
+    node.bBoxMax = bounds.max;
+    node.escapeIndex = -1; // Set when the tree is flattened
+    node.pad1 = 0;
+
+    //Om det r en lvnod s skapar vi en korrekt lvnod (inga children s vi stter dem till -1).
+    auto makeLeaf = [&]() {
+        node.startTriangle = start;
+        node.triangleCount = count;
+        node.leftChild = -1;
+        node.rightChild = -1;
+    };
+    if (count <= maxPrimitives) {
+        makeLeaf();
+        return;
+    }
+
+    ObjectSplit split = findObjectSplit(pool, &triangleIndices[start], count, bounds);
+    if (split.degenerate) {
+        makeLeaf();
+        return;
+    }
+    const float* axisCentroids = refs.centroids(split.axis);
+
+    auto medianSplit = [&]() {
         int midIndex = start + count / 2;
 
         std::nth_element(
@@ -180,40 +483,828 @@ int BVHTree::buildRecursive(int start, int count, int depth) {
             triangleIndices.begin() + midIndex,
             triangleIndices.begin() + start + count,
             [&](int a, int b) {
-                vec3 centroidA = (primitives[a].vertex1 + primitives[a].vertex2 + primitives[a].vertex3) / 3.0f;
-                vec3 centroidB = (primitives[b].vertex1 + primitives[b].vertex2 + primitives[b].vertex3) / 3.0f;
-                return centroidA[splitAxis] < centroidB[splitAxis];
+                return axisCentroids[a] < axisCentroids[b];
             }
         );
 
-        mid = midIndex;
+        return midIndex;
+    };
+
+    int mid;
+    if (split.cost > 1.0f) {
+        // Fallback: median split
+        mid = medianSplit();
     }
     else {
-        float binWidth = (maxCentroid - minCentroid) / float(NUM_BINS);
-        float splitPos = minCentroid + binWidth * (bestSplit + 1);
-
         auto midIter = std::partition(
             triangleIndices.begin() + start,
             triangleIndices.begin() + start + count,
             [&](int idx) {
-                const Primitive& p = primitives[idx];
-                vec3 centroid = (p.vertex1 + p.vertex2 + p.vertex3) / 3.0f;
-                return centroid[splitAxis] < splitPos;
+                return axisCentroids[idx] < split.position;
             }
         );
         mid = midIter - triangleIndices.begin();
-    }
 
-    //Gr recursion med children
-    int leftChild = buildRecursive(start, mid - start, depth + 1);
-    int rightChild = buildRecursive(mid, start + count - mid, depth + 1);
+        // The bins round slightly differently than splitPos, never leave one side empty
+        if (mid == start || mid == start + count) {
+            mid = medianSplit();
+        }
+    }
 
     //Initialisera noden. Om vi inte slapar ett lv s har det inte en specifik triangel,
     //s trianglecount r 0 och starttriangle finns ej s vi stter den till -1
+    int leftChild = buildNodeCount.fetch_add(2);
+    int rightChild = leftChild + 1;
+    node.leftChild = leftChild;
+    node.rightChild = rightChild;
+    node.startTriangle = -1;
+    node.triangleCount = 0;
+
+    //Gr recursion med children. Stora subtrd blir egna tasks som andra trdar kan stjla.
+    int leftCount = mid - start;
+    int rightCount = start + count - mid;
+    if (leftCount > PARALLEL_TASK_THRESHOLD) {
+        pool.submit(group, [this, &pool, &group, leftChild, start, leftCount]() {
+            buildRecursive(pool, group, leftChild, start, leftCount);
+        });
+    }
+    else {
+        buildRecursive(pool, group, leftChild, start, leftCount);
+    }
+    buildRecursive(pool, group, rightChild, mid, rightCount);
+}
+
+// Clips the part of a reference that lies in refBounds against the plane axis = position.
+// Triangles are clipped edge by edge so long, thin triangles get tight boxes on both sides,
+// spheres simply have their box cut in two.
+void BVHTree::splitReference(int ref, const AABB& refBounds, int axis, float position, AABB& left, AABB& right) {
+    int primitive = refs.primitive[ref];
+    left = AABB();
+    right = AABB();
+
+    if (!meshIndices.empty() || primitives[primitive].ID == 0) {
+        vec3 vertices[3];
+        if (meshIndices.empty()) {
+            vertices[0] = primitives[primitive].vertex1;
+            vertices[1] = primitives[primitive].vertex2;
+            vertices[2] = primitives[primitive].vertex3;
+        }
+        else {
+            for (int i = 0; i < 3; i++) {
+                vertices[i] = meshPositions[meshIndices[3 * primitive + i]];
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            const vec3& v0 = vertices[i];
+            const vec3& v1 = vertices[(i + 1) % 3];
+            float p0 = v0[axis];
+            float p1 = v1[axis];
+
+            if (p0 <= position) {
+                expandAABB(left, { v0, v0 });
+            }
+            if (p0 >= position) {
+                expandAABB(right, { v0, v0 });
+            }
+            // The edge crosses the plane, both sides get the crossing point
+            if ((p0 < position && p1 > position) || (p0 > position && p1 < position)) {
+                vec3 crossing = v0 + (v1 - v0) * ((position - p0) / (p1 - p0));
+                crossing[axis] = position;
+                expandAABB(left, { crossing, crossing });
+                expandAABB(right, { crossing, crossing });
+            }
+        }
+    }
+    else {
+        left = refBounds;
+        right = refBounds;
+    }
+    left.max[axis] = position;
+    right.min[axis] = position;
+    left = intersectionAABB(left, refBounds);
+    right = intersectionAABB(right, refBounds);
+
+    // Same padding as computeAABB, a flat box is hard to hit with the slab test
+    const float eps = 1e-4f;
+    for (AABB* box : { &left, &right }) {
+        if (isEmptyAABB(*box)) {
+            continue;
+        }
+        for (int i = 0; i < 3; i++) {
+            if (box->max[i] == box->min[i]) {
+                box->max[i] += eps;
+                box->min[i] -= eps;
+            }
+        }
+    }
+}
+
+// Bins the references into equally sized slices of the node along every axis. A reference that
+// covers several slices is clipped into each of them, so the resulting bounds stay tight.
+BVHTree::SpatialSplit BVHTree::findSpatialSplit(const int* ids, int count, const AABB& bounds) {
+    struct SpatialBin {
+        AABB bounds;
+        int entries = 0;
+        int exits = 0;
+    };
+
+    SpatialSplit best;
+    float parentArea = surfaceArea(bounds);
+
+    for (int axis = 0; axis < 3; axis++) {
+        float origin = bounds.min[axis];
+        float extent = bounds.max[axis] - origin;
+        if (extent < 1e-3f) {
+            continue;
+        }
+        float binWidth = extent / NUM_SPATIAL_BINS;
+        auto binOf = [&](float coordinate) {
+            return std::clamp(int((coordinate - origin) / binWidth), 0, NUM_SPATIAL_BINS - 1);
+        };
+
+        SpatialBin bins[NUM_SPATIAL_BINS];
+        for (int i = 0; i < count; i++) {
+            int ref = ids[i];
+            AABB remaining = refs.bounds(ref);
+            int firstBin = binOf(remaining.min[axis]);
+            int lastBin = std::max(firstBin, binOf(remaining.max[axis]));
+
+            for (int bin = firstBin; bin < lastBin; bin++) {
+                AABB leftPart, rightPart;
+                splitReference(ref, remaining, axis, origin + binWidth * (bin + 1), leftPart, rightPart);
+                if (!isEmptyAABB(leftPart)) {
+                    expandAABB(bins[bin].bounds, leftPart);
+                }
+                remaining = rightPart;
+            }
+            if (!isEmptyAABB(remaining)) {
+                expandAABB(bins[lastBin].bounds, remaining);
+            }
+            bins[firstBin].entries++;
+            bins[lastBin].exits++;
+        }
+
+        AABB rightBounds[NUM_SPATIAL_BINS];
+        int rightCounts[NUM_SPATIAL_BINS];
+        AABB curBounds;
+        int curCount = 0;
+        for (int i = NUM_SPATIAL_BINS - 1; i > 0; i--) {
+            expandAABB(curBounds, bins[i].bounds);
+            curCount += bins[i].exits;
+            rightBounds[i] = curBounds;
+            rightCounts[i] = curCount;
+        }
+
+        curBounds = {};
+        curCount = 0;
+        for (int i = 1; i < NUM_SPATIAL_BINS; i++) {
+            expandAABB(curBounds, bins[i - 1].bounds);
+            curCount += bins[i - 1].entries;
+            if (curCount == 0 || rightCounts[i] == 0) {
+                continue;
+            }
+
+            // Same cost model as the object split so the two can be compared directly
+            float Ct = 0.5f;
+            float Ci = 1.0f;
+            float cost = Ct + (Ci * (
+                curCount * surfaceArea(curBounds) +
+                rightCounts[i] * surfaceArea(rightBounds[i])
+                )) / parentArea;
+
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.position = origin + binWidth * i;
+            }
+        }
+    }
+    return best;
+}
+
+// SBVH-versionen av buildRecursive. Varje nod ger sin egen lista med referenser eftersom
+// en spatial split kan lgga samma triangel i bda barnen.
+void BVHTree::buildSpatialRecursive(ThreadPool& pool, TaskGroup& group, int nodeIndex, std::vector<int> ids) {
+    int count = ids.size();
+    AABB bounds = computeBounds(pool, ids.data(), count);
+
+    BVHNode& node = buildNodes[nodeIndex];
+    node.bBoxMin = bounds.min;
+    node.bBoxMax = bounds.max;
+    node.escapeIndex = -1; // Set when the tree is flattened
+    node.pad1 = 0;
+
+    // Leaves reserve a range in triangleIndices, flattenRecursive packs them in pre-order later
+    auto makeLeaf = [&]() {
+        int start = leafReferenceCount.fetch_add(count);
+        std::copy(ids.begin(), ids.end(), triangleIndices.begin() + start);
+        node.startTriangle = start;
+        node.triangleCount = count;
+        node.leftChild = -1;
+        node.rightChild = -1;
+    };
+    if (count <= maxPrimitives) {
+        makeLeaf();
+        return;
+    }
+
+    ObjectSplit objectSplit = findObjectSplit(pool, ids.data(), count, bounds);
+    if (objectSplit.degenerate) {
+        makeLeaf();
+        return;
+    }
+
+    // Only look for a spatial split when the object split children overlap noticeably
+    SpatialSplit spatialSplit;
+    float overlap = FLT_MAX;
+    if (objectSplit.cost < FLT_MAX) {
+        AABB overlapBounds = intersectionAABB(objectSplit.leftBounds, objectSplit.rightBounds);
+        overlap = isEmptyAABB(overlapBounds) ? 0.0f : surfaceArea(overlapBounds);
+    }
+    if (overlap > settings.splitAlpha * rootArea && referenceCount < maxReferences) {
+        spatialSplit = findSpatialSplit(ids.data(), count, bounds);
+    }
+
+    std::vector<int> leftIds;
+    std::vector<int> rightIds;
+
+    // Unlike buildRecursive the SAH cost decides here, the median split is only used when no bin boundary is usable
+    if (spatialSplit.cost < objectSplit.cost) {
+        int axis = spatialSplit.axis;
+        float position = spatialSplit.position;
+
+        std::vector<int> straddling;
+        for (int ref : ids) {
+            if (refs.maxOf(ref, axis) <= position) {
+                leftIds.push_back(ref);
+            }
+            else if (refs.minOf(ref, axis) >= position) {
+                rightIds.push_back(ref);
+            }
+            else {
+                straddling.push_back(ref);
+            }
+        }
+
+        // Reserve one new reference per straddling reference, unless that would go over the duplication budget
+        int firstNew = referenceCount;
+        int needed = straddling.size();
+        bool reserved = false;
+        while (firstNew + needed <= maxReferences) {
+            if (referenceCount.compare_exchange_weak(firstNew, firstNew + needed)) {
+                reserved = true;
+                break;
+            }
+        }
+
+        if (reserved) {
+            for (int i = 0; i < needed; i++) {
+                int ref = straddling[i];
+                AABB leftPart, rightPart;
+                splitReference(ref, refs.bounds(ref), axis, position, leftPart, rightPart);
+
+                if (isEmptyAABB(leftPart)) {
+                    rightIds.push_back(ref);
+                }
+                else if (isEmptyAABB(rightPart)) {
+                    leftIds.push_back(ref);
+                }
+                else {
+                    int newRef = firstNew + i;
+                    refs.set(ref, leftPart, centerOfAABB(leftPart));
+                    refs.set(newRef, rightPart, centerOfAABB(rightPart));
+                    refs.primitive[newRef] = refs.primitive[ref];
+                    leftIds.push_back(ref);
+                    rightIds.push_back(newRef);
+                }
+            }
+        }
+        else {
+            // Out of budget, the object split below is used instead
+            leftIds.clear();
+            rightIds.clear();
+        }
+    }
+
+    if (leftIds.empty() || rightIds.empty()) {
+        const float* axisCentroids = refs.centroids(objectSplit.axis);
+        auto midIter = ids.begin() + count / 2;
+        if (objectSplit.cost == FLT_MAX) {
+            // Fallback: median split
+            std::nth_element(ids.begin(), midIter, ids.end(), [&](int a, int b) {
+                return axisCentroids[a] < axisCentroids[b];
+            });
+        }
+        else {
+            midIter = std::partition(ids.begin(), ids.end(), [&](int ref) {
+                return axisCentroids[ref] < objectSplit.position;
+            });
+            if (midIter == ids.begin() || midIter == ids.end()) {
+                midIter = ids.begin() + count / 2;
+                std::nth_element(ids.begin(), midIter, ids.end(), [&](int a, int b) {
+                    return axisCentroids[a] < axisCentroids[b];
+                });
+            }
+        }
+        leftIds.assign(ids.begin(), midIter);
+        rightIds.assign(midIter, ids.end());
+    }
+    ids.clear();
+    ids.shrink_to_fit();
+
+    int leftChild = buildNodeCount.fetch_add(2);
+    int rightChild = leftChild + 1;
+    node.leftChild = leftChild;
+    node.rightChild = rightChild;
+    node.startTriangle = -1;
+    node.triangleCount = 0;
+
+    if (leftIds.size() > PARALLEL_TASK_THRESHOLD) {
+        pool.submit(group, [this, &pool, &group, leftChild, leftIds = std::move(leftIds)]() {
+            buildSpatialRecursive(pool, group, leftChild, std::move(leftIds));
+        });
+    }
+    else {
+        buildSpatialRecursive(pool, group, leftChild, std::move(leftIds));
+    }
+    buildSpatialRecursive(pool, group, rightChild, std::move(rightIds));
+}
+
+// LBVH: the centroids are quantized to a grid and sorted along the Morton curve through it, and the
+// hierarchy follows from the sorted codes alone. Every inner node is found independently of the others,
+// so apart from the sort the whole build is a handful of parallel O(n) loops.
+void BVHTree::buildLinear(ThreadPool& pool) {
+    int count = getPrimitiveCount();
+    int bitsPerAxis = settings.mortonCodes64 ? 21 : 10;
+
+    std::vector<int> ids(count);
+    std::iota(ids.begin(), ids.end(), 0);
+    AABB centroidBounds = computeCentroidBounds(pool, ids.data(), count);
+    float cells = float((1 << bitsPerAxis) - 1);
+    vec3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        scale[axis] = extent > 0.0f ? cells / extent : 0.0f;
+    }
+
+    std::vector<uint64_t> codes(count);
+    pool.parallelFor(0, count, 4096, [&](int rangeBegin, int rangeEnd) {
+        for (int i = rangeBegin; i < rangeEnd; i++) {
+            vec3 offset = refs.centroid(i) - centroidBounds.min;
+            uint64_t code = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                uint64_t cell = uint64_t(std::clamp(offset[axis] * scale[axis], 0.0f, cells));
+                code |= expandBits(cell) << (2 - axis);
+            }
+            codes[i] = code;
+        }
+    });
+    radixSort(pool, codes, ids, 3 * bitsPerAxis);
+
+    // Length of the common prefix of two sorted codes, equal codes are told apart by their position
+    auto delta = [&](int i, int j) {
+        if (j < 0 || j >= count) {
+            return -1;
+        }
+        if (codes[i] == codes[j]) {
+            return 64 + countLeadingZeros(uint64_t(i ^ j));
+        }
+        return countLeadingZeros(codes[i] ^ codes[j]);
+    };
+
+    LinearHierarchy hierarchy;
+    int nodeCount = 2 * count - 1;
+    hierarchy.left.resize(count - 1);
+    hierarchy.right.resize(count - 1);
+    hierarchy.parent.assign(nodeCount, -1);
+    hierarchy.first.resize(nodeCount);
+    hierarchy.last.resize(nodeCount);
+    hierarchy.bounds.resize(nodeCount);
+
+    // Inner node i starts or ends at primitive i. Its other end is found by searching for the furthest
+    // primitive that still shares a longer prefix than the neighbour on the other side, and it is split
+    // where the prefix it shares with i gets shorter (Karras 2012).
+    pool.parallelFor(0, count - 1, 4096, [&](int rangeBegin, int rangeEnd) {
+        for (int i = rangeBegin; i < rangeEnd; i++) {
+            int direction = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int minDelta = delta(i, i - direction);
+
+            int maxLength = 2;
+            while (delta(i, i + maxLength * direction) > minDelta) {
+                maxLength *= 2;
+            }
+            int length = 0;
+            for (int step = maxLength / 2; step >= 1; step /= 2) {
+                if (delta(i, i + (length + step) * direction) > minDelta) {
+                    length += step;
+                }
+            }
+            int j = i + length * direction;
+
+            int nodeDelta = delta(i, j);
+            int split = 0;
+            int step = length;
+            do {
+                step = (step + 1) / 2;
+                if (delta(i, i + (split + step) * direction) > nodeDelta) {
+                    split += step;
+                }
+            } while (step > 1);
+            int gamma = i + split * direction + std::min(direction, 0);
+
+            int first = std::min(i, j);
+            int last = std::max(i, j);
+            int left = first == gamma ? count - 1 + gamma : gamma;
+            int right = last == gamma + 1 ? count - 1 + gamma + 1 : gamma + 1;
+            hierarchy.left[i] = left;
+            hierarchy.right[i] = right;
+            hierarchy.parent[left] = i;
+            hierarchy.parent[right] = i;
+            hierarchy.first[i] = first;
+            hierarchy.last[i] = last;
+        }
+    });
+
+    // Bounds bottom-up, one walk per leaf. The second walk to reach a node merges its children and
+    // goes on, the first one stops there, so every node is written once after both of its children.
+    std::vector<std::atomic<int>> visits(count - 1);
+    for (std::atomic<int>& visit : visits) {
+        visit.store(0, std::memory_order_relaxed);
+    }
+    pool.parallelFor(0, count, 4096, [&](int rangeBegin, int rangeEnd) {
+        for (int k = rangeBegin; k < rangeEnd; k++) {
+            int leaf = count - 1 + k;
+            hierarchy.first[leaf] = k;
+            hierarchy.last[leaf] = k;
+            hierarchy.bounds[leaf] = refs.bounds(ids[k]);
+
+            int node = hierarchy.parent[leaf];
+            while (node != -1 && visits[node].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                hierarchy.bounds[node] = mergeAABB(hierarchy.bounds[hierarchy.left[node]], hierarchy.bounds[hierarchy.right[node]]);
+                node = hierarchy.parent[node];
+            }
+        }
+    });
+    notePeakMemory(codes.capacity() * sizeof(uint64_t) + ids.capacity() * sizeof(int) + visits.capacity() * sizeof(std::atomic<int>)
+        + count * 2 * (5 * sizeof(int) + sizeof(AABB)));
+    codes.clear();
+    codes.shrink_to_fit();
+
+    triangleIndices = std::move(ids);
+    if (settings.optimizeTreelets) {
+        hierarchy.costs.resize(buildNodes.size());
+    }
+    emitLinearRecursive(pool, hierarchy, 0, 0);
+}
+
+// Writes linear node linearNode to buildNodes[nodeIndex] like buildRecursive would, so the flattening is shared.
+// Ranges of up to maxPrimitives become a single leaf. The treelet optimization runs once both subtrees are
+// finished, which makes it go bottom-up.
+void BVHTree::emitLinearRecursive(ThreadPool& pool, LinearHierarchy& hierarchy, int nodeIndex, int linearNode) {
+    int start = hierarchy.first[linearNode];
+    int count = hierarchy.last[linearNode] - start + 1;
+    const AABB& bounds = hierarchy.bounds[linearNode];
+
+    BVHNode& node = buildNodes[nodeIndex];
+    node.bBoxMin = bounds.min;
+    node.bBoxMax = bounds.max;
+    node.escapeIndex = -1; // Set when the tree is flattened
+    node.pad1 = 0;
+
+    if (count <= maxPrimitives) {
+        node.startTriangle = start;
+        node.triangleCount = count;
+        node.leftChild = -1;
+        node.rightChild = -1;
+        if (settings.optimizeTreelets) {
+            hierarchy.costs[nodeIndex] = count * surfaceArea(bounds);
+        }
+        return;
+    }
+
+    int leftChild = buildNodeCount.fetch_add(2);
+    int rightChild = leftChild + 1;
+    node.leftChild = leftChild;
+    node.rightChild = rightChild;
+    node.startTriangle = -1;
+    node.triangleCount = 0;
+
+    int linearLeft = hierarchy.left[linearNode];
+    int linearRight = hierarchy.right[linearNode];
+    int leftCount = hierarchy.last[linearLeft] - hierarchy.first[linearLeft] + 1;
+    if (leftCount > PARALLEL_TASK_THRESHOLD) {
+        TaskGroup children;
+        pool.submit(children, [this, &pool, &hierarchy, leftChild, linearLeft]() {
+            emitLinearRecursive(pool, hierarchy, leftChild, linearLeft);
+        });
+        emitLinearRecursive(pool, hierarchy, rightChild, linearRight);
+        pool.wait(children);
+    }
+    else {
+        emitLinearRecursive(pool, hierarchy, leftChild, linearLeft);
+        emitLinearRecursive(pool, hierarchy, rightChild, linearRight);
+    }
+
+    if (settings.optimizeTreelets) {
+        optimizeTreelet(nodeIndex, hierarchy.costs);
+    }
+}
+
+// Treelet restructuring (Karras and Aila 2013). The node is grown into a treelet of up to 7 subtrees by
+// opening the largest one again and again, then every way to pair those subtrees up is tried by dynamic
+// programming over their subsets. The subtrees and the opened nodes are reused as they are, only the
+// arrangement changes, and only when it lowers the SAH cost. costs holds the cost of every finished node.
+void BVHTree::optimizeTreelet(int nodeIndex, std::vector<float>& costs) {
+    constexpr int MAX_TREELET_LEAVES = 7;
+    constexpr int SUBSET_COUNT = 1 << MAX_TREELET_LEAVES;
+    float Ct = 0.5f;
+
+    BVHNode& root = buildNodes[nodeIndex];
+    float currentCost = Ct * surfaceArea({ root.bBoxMin, root.bBoxMax }) + costs[root.leftChild] + costs[root.rightChild];
+    costs[nodeIndex] = currentCost;
+
+    int leaves[MAX_TREELET_LEAVES] = { root.leftChild, root.rightChild };
+    int leafCount = 2;
+    int openedNodes[MAX_TREELET_LEAVES - 2];
+    int openedCount = 0;
+    while (leafCount < MAX_TREELET_LEAVES) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < leafCount; i++) {
+            const BVHNode& candidate = buildNodes[leaves[i]];
+            float area = surfaceArea({ candidate.bBoxMin, candidate.bBoxMax });
+            if (candidate.triangleCount == 0 && area > largestArea) {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        const BVHNode& opened = buildNodes[leaves[largest]];
+        openedNodes[openedCount++] = leaves[largest];
+        leaves[largest] = opened.leftChild;
+        leaves[leafCount++] = opened.rightChild;
+    }
+    if (leafCount < 3) {
+        return; // Two subtrees can only be paired one way
+    }
+
+    AABB subsetBounds[SUBSET_COUNT];
+    float subsetCost[SUBSET_COUNT];
+    int bestLeft[SUBSET_COUNT];
+    for (int i = 0; i < leafCount; i++) {
+        const BVHNode& leaf = buildNodes[leaves[i]];
+        subsetBounds[1 << i] = { leaf.bBoxMin, leaf.bBoxMax };
+        subsetCost[1 << i] = costs[leaves[i]];
+    }
+
+    // Every proper subset of a set is a smaller number, so counting up always finds the parts solved
+    int fullSet = (1 << leafCount) - 1;
+    for (int subset = 1; subset <= fullSet; subset++) {
+        int lowest = subset & -subset;
+        if (subset == lowest) {
+            continue;
+        }
+        subsetBounds[subset] = mergeAABB(subsetBounds[lowest], subsetBounds[subset ^ lowest]);
+
+        // Each pairing is only tried once, with the lowest subtree on the left
+        float best = FLT_MAX;
+        for (int part = (subset - 1) & subset; part != 0; part = (part - 1) & subset) {
+            if ((part & lowest) == 0) {
+                continue;
+            }
+            float cost = subsetCost[part] + subsetCost[subset ^ part];
+            if (cost < best) {
+                best = cost;
+                bestLeft[subset] = part;
+            }
+        }
+        subsetCost[subset] = Ct * surfaceArea(subsetBounds[subset]) + best;
+    }
+
+    // A tiny gain is not worth rewriting the nodes, it is mostly rounding
+    if (subsetCost[fullSet] >= currentCost * 0.999f) {
+        return;
+    }
+
+    // The root keeps its index and the opened nodes become the new inner nodes
+    int nextOpened = 0;
+    auto treeletNode = [&](int subset) {
+        if ((subset & (subset - 1)) == 0) {
+            int leaf = 0;
+            while ((1 << leaf) != subset) {
+                leaf++;
+            }
+            return leaves[leaf];
+        }
+        return openedNodes[nextOpened++];
+    };
+
+    struct Pending {
+        int subset;
+        int node;
+    };
+    Pending pending[MAX_TREELET_LEAVES];
+    int pendingCount = 0;
+    pending[pendingCount++] = { fullSet, nodeIndex };
+    while (pendingCount > 0) {
+        Pending current = pending[--pendingCount];
+        int leftSubset = bestLeft[current.subset];
+        int rightSubset = current.subset ^ leftSubset;
+
+        BVHNode& node = buildNodes[current.node];
+        node.leftChild = treeletNode(leftSubset);
+        node.rightChild = treeletNode(rightSubset);
+        node.bBoxMin = subsetBounds[current.subset].min;
+        node.bBoxMax = subsetBounds[current.subset].max;
+        costs[current.node] = subsetCost[current.subset];
+
+        if ((leftSubset & (leftSubset - 1)) != 0) {
+            pending[pendingCount++] = { leftSubset, node.leftChild };
+        }
+        if ((rightSubset & (rightSubset - 1)) != 0) {
+            pending[pendingCount++] = { rightSubset, node.rightChild };
+        }
+    }
+}
+
+// Insertion-based optimization (Bittner et al. 2013). Each node in turn, largest first, is taken out of
+// the tree together with its parent, the sibling moves up into the parent's place, and the node is put
+// back next to the node where the new parent adds the least surface area to the tree. Leaves keep their
+// boxes, so only the inner areas change the SAH cost. The old place is one of the candidates, so the cost
+// never rises. Sweeps are repeated until one gains less than 0.1% or the time budget is used up.
+void BVHTree::optimizeByReinsertion() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    // Whole clock ticks, a float time point would round the clock to minutes
+    auto deadline = startTime + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+        std::chrono::duration<float, std::milli>(settings.optimizationBudgetMs));
+    int nodeCount = buildNodeCount;
+    float Ct = 0.5f;
+    float Ci = 1.0f;
+
+    auto isLeaf = [&](int i) { return buildNodes[i].triangleCount > 0; };
+    auto boundsOf = [&](int i) { return AABB{ buildNodes[i].bBoxMin, buildNodes[i].bBoxMax }; };
+    auto areaOf = [&](int i) { return surfaceArea(boundsOf(i)); };
+    auto treeCost = [&]() {
+        double cost = 0.0;
+        for (int i = 0; i < nodeCount; i++) {
+            cost += isLeaf(i) ? Ci * buildNodes[i].triangleCount * areaOf(i) : Ct * areaOf(i);
+        }
+        return float(cost / areaOf(0));
+    };
+
+    std::vector<int> parents(nodeCount, -1);
+    for (int i = 0; i < nodeCount; i++) {
+        if (!isLeaf(i)) {
+            parents[buildNodes[i].leftChild] = i;
+            parents[buildNodes[i].rightChild] = i;
+        }
+    }
+    auto refitUpwards = [&](int i) {
+        for (; i != -1; i = parents[i]) {
+            AABB bounds = mergeAABB(boundsOf(buildNodes[i].leftChild), boundsOf(buildNodes[i].rightChild));
+            buildNodes[i].bBoxMin = bounds.min;
+            buildNodes[i].bBoxMax = bounds.max;
+        }
+    };
+    auto replaceChild = [&](int parent, int oldChild, int newChild) {
+        if (buildNodes[parent].leftChild == oldChild) {
+            buildNodes[parent].leftChild = newChild;
+        }
+        else {
+            buildNodes[parent].rightChild = newChild;
+        }
+        parents[newChild] = parent;
+    };
+
+    // Branch and bound search, lowest induced cost first. The induced cost of a candidate is how much
+    // its ancestors grow when they also have to hold the node.
+    struct Candidate {
+        float inducedCost;
+        int node;
+        bool operator<(const Candidate& other) const { return inducedCost > other.inducedCost; }
+    };
+    std::vector<Candidate> heap;
+
+    auto reinsert = [&](int node) {
+        int parent = parents[node];
+        int grandparent = parent == -1 ? -1 : parents[parent];
+        if (grandparent == -1) {
+            return false; // The root and its children have nowhere better to go
+        }
+        int sibling = buildNodes[parent].leftChild == node ? buildNodes[parent].rightChild : buildNodes[parent].leftChild;
+        replaceChild(grandparent, parent, sibling);
+        refitUpwards(grandparent);
+
+        AABB nodeBounds = boundsOf(node);
+        float nodeArea = surfaceArea(nodeBounds);
+        int best = sibling;
+        float bestCost = FLT_MAX;
+        heap.clear();
+        heap.push_back({ 0.0f, 0 });
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end());
+            Candidate candidate = heap.back();
+            heap.pop_back();
+            // Any new parent below here is at least as large as the node itself
+            if (candidate.inducedCost + nodeArea >= bestCost) {
+                break;
+            }
+            float directCost = surfaceArea(mergeAABB(boundsOf(candidate.node), nodeBounds));
+            float cost = candidate.inducedCost + directCost;
+            if (cost < bestCost) {
+                bestCost = cost;
+                best = candidate.node;
+            }
+            float childInducedCost = cost - areaOf(candidate.node);
+            if (!isLeaf(candidate.node) && childInducedCost + nodeArea < bestCost) {
+                heap.push_back({ childInducedCost, buildNodes[candidate.node].leftChild });
+                std::push_heap(heap.begin(), heap.end());
+                heap.push_back({ childInducedCost, buildNodes[candidate.node].rightChild });
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        // The old parent node becomes the new parent. The root has to stay at index 0, so when the
+        // node goes next to it the old root moves into the free node instead.
+        if (best == 0) {
+            buildNodes[parent] = buildNodes[0];
+            parents[buildNodes[parent].leftChild] = parent;
+            parents[buildNodes[parent].rightChild] = parent;
+            buildNodes[0].leftChild = parent;
+            buildNodes[0].rightChild = node;
+            parents[parent] = 0;
+            parents[node] = 0;
+            refitUpwards(0);
+        }
+        else {
+            replaceChild(parents[best], best, parent);
+            buildNodes[parent].leftChild = best;
+            buildNodes[parent].rightChild = node;
+            parents[best] = parent;
+            parents[node] = parent;
+            refitUpwards(parent);
+        }
+        return best != sibling;
+    };
+
+    optimizationReport = BVHOptimizationReport();
+    float cost = optimizationReport.sahBefore = treeCost();
+    std::vector<int> order(nodeCount);
+    std::iota(order.begin(), order.end(), 0);
+    while (!optimizationReport.budgetExhausted) {
+        // Large nodes are the ones most rays enter, moving them gains the most
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return areaOf(a) > areaOf(b); });
+        for (int node : order) {
+            if (std::chrono::high_resolution_clock::now() >= deadline) {
+                optimizationReport.budgetExhausted = true;
+                break;
+            }
+            if (reinsert(node)) {
+                optimizationReport.reinsertions++;
+            }
+        }
+        optimizationReport.passes++;
+
+        float passCost = treeCost();
+        bool converged = passCost > cost * 0.999f;
+        cost = passCost;
+        if (converged) {
+            break;
+        }
+    }
+    optimizationReport.sahAfter = cost;
+}
+
+//Lgger ut trdet i pre-order i nodes och stter escapeIndex, som shadern anvnder fr att traversera utan stack.
+//Lvens referenser packas samtidigt i samma ordning till packedIndices, som primitivindex.
+int BVHTree::flattenRecursive(int buildIndex, int depth, std::vector<int>& packedIndices) {
+    const BVHNode& buildNode = buildNodes[buildIndex];
+
+    int nodeIndex = nodes.size();
+    nodes.push_back(buildNode);
+
+    if (buildNode.triangleCount > 0) {
+        nodes[nodeIndex].startTriangle = packedIndices.size();
+        for (int i = buildNode.startTriangle; i < buildNode.startTriangle + buildNode.triangleCount; i++) {
+            packedIndices.push_back(refs.primitive[triangleIndices[i]]);
+        }
+        nodes[nodeIndex].escapeIndex = nodeIndex + 1; // next node in pre-order
+        if (depth < smallestDepth) {
+            smallestDepth = depth;
+        }
+        if (depth > largestDepth) {
+            largestDepth = depth;
+        }
+        return nodeIndex;
+    }
+
+    int leftChild = flattenRecursive(buildNode.leftChild, depth + 1, packedIndices);
+    int rightChild = flattenRecursive(buildNode.rightChild, depth + 1, packedIndices);
+
     nodes[nodeIndex].leftChild = leftChild;
     nodes[nodeIndex].rightChild = rightChild;
-    nodes[nodeIndex].startTriangle = -1;
-    nodes[nodeIndex].triangleCount = 0;
 
     // Vnster nods escapenod r den hgra noden i subtrdet.
     nodes[leftChild].escapeIndex = rightChild;
@@ -226,18 +1317,46 @@ int BVHTree::buildRecursive(int start, int count, int depth) {
     
     return nodeIndex;
 }
+BVHStats BVHTree::computeStats() const
+{
+    BVHStats stats = BVHStats::compute(nodeView, indexView, getPrimitiveCount());
+    stats.sahCost = sahCost; // Relative to the root of the last build, like getSAHCost()
+    stats.loadedFromCache = loadedFromCache;
+    stats.buildTimings = buildTimings;
+    stats.optimization = optimizationReport;
+    stats.buildPeakBytes = buildPeakBytes;
+    return stats;
+}
+
+// Expected cost of tracing a ray through the tree, with the same weights as findObjectSplit.
+float BVHTree::computeSAHCost() const
+{
+    if (nodeView.empty() || rootArea <= 0.0f) {
+        return 0.0f;
+    }
+
+    float Ct = 0.5f;
+    float Ci = 1.0f;
+    double cost = 0.0;
+    for (const BVHNode& node : nodeView) {
+        float area = surfaceArea({ node.bBoxMin, node.bBoxMax });
+        cost += node.leftChild == -1 ? Ci * node.triangleCount * area : Ct * area;
+    }
+    return float(cost / rootArea);
+}
+
 //Crude test so that we can see that the tree is built correctly.
 void BVHTree::traverseTree() {
 	// Traverse the BVH tree and perform operations on each node
 
-	for (const auto& node : nodes) {
+	for (const auto& node : nodeView) {
 		// Perform operations on the node
 		std::cout << "Node AABB: " << node.bBoxMin.x << ", " << node.bBoxMin.y << ", " << node.bBoxMin.z << " to "
 			<< node.bBoxMax.x << ", " << node.bBoxMax.y << ", " << node.bBoxMax.z << std::endl;
         if (node.rightChild == -1 && node.leftChild == -1) {
             for (int i = node.startTriangle; i < node.startTriangle + node.triangleCount; i++) {
-				const Primitive& temp = primitives[triangleIndices[i]];
-                std::cout << "Triangle " << triangleIndices[i] << " with vertex1:" << temp.vertex1.x << ", " << temp.vertex1.y << ", " << temp.vertex1.z << ", vertex2: "
+				const Primitive& temp = primitives[indexView[i]];
+                std::cout << "Triangle " << indexView[i] << " with vertex1:" << temp.vertex1.x << ", " << temp.vertex1.y << ", " << temp.vertex1.z << ", vertex2: "
                     <<temp.vertex2.x << ", " << temp.vertex2.y << ", " << temp.vertex2.z << ", vertex3: " 
                    <<temp.vertex3.x << ", " << temp.vertex3.y << ", " << temp.vertex3.z << std::endl;
         } }
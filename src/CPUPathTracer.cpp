@@ -0,0 +1,342 @@
+#include "CPUPathTracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace {
+	// Material types, as the defines of the same names in PathtraceShader.frag
+	const int GLOSSY = 0;
+	const int MIRROR = 1;
+	const int TRANSMISSIVE = 2;
+	const int LIGHT = 3;
+
+	// The shader lets a path bounce between mirrors and through glass without counting it, which ends
+	// only when the path leaves. Two facing mirrors would keep a CPU thread forever, so this caps it.
+	const int MAX_UNCOUNTED_BOUNCES = 64;
+
+	// PCG hash, the same sequence as PCGHash() in the shader
+	uint32_t pcgHash(uint32_t& seed) {
+		seed = seed * 747796405u + 2891336453u;
+		uint32_t state = seed;
+		uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		return (word >> 22u) ^ word;
+	}
+
+	float randomFloat(uint32_t& seed) {
+		return float(pcgHash(seed)) / float(0xFFFFFFFFu);
+	}
+
+	// vec3 * vec3 is the dot product in VectorUtils4
+	vec3 multiply(const vec3& a, const vec3& b) {
+		return vec3(a.x * b.x, a.y * b.y, a.z * b.z);
+	}
+
+	// GLSL reflect() and refract(), refract gives the zero vector on total internal reflection
+	vec3 reflect(const vec3& direction, const vec3& normal) {
+		return direction - normal * (2.0f * (normal * direction));
+	}
+
+	vec3 refract(const vec3& direction, const vec3& normal, float eta) {
+		float cosine = normal * direction;
+		float k = 1.0f - eta * eta * (1.0f - cosine * cosine);
+		if (k < 0.0f) {
+			return vec3(0.0f);
+		}
+		return direction * eta - normal * (eta * cosine + std::sqrt(k));
+	}
+
+	float fresnelSchlick(float cosTheta, float ior) {
+		float r0 = std::pow((1.0f - ior) / (1.0f + ior), 2.0f);
+		return r0 + (1.0f - r0) * std::pow(1.0f - cosTheta, 5.0f);
+	}
+}
+
+CPUPathTracer::CPUPathTracer(const SceneBVH& scene, ArrayView<const AreaLight> areaLights, ArrayView<const PointLight> pointLights)
+	: scene(scene), areaLights(areaLights), pointLights(pointLights)
+{
+	setSettings(settings);
+}
+
+void CPUPathTracer::setSettings(const CPURenderSettings& newSettings)
+{
+	if (!pool || newSettings.threadCount != settings.threadCount) {
+		pool = std::make_unique<ThreadPool>(newSettings.threadCount);
+	}
+	settings = newSettings;
+	settings.tileSize = std::max(1, settings.tileSize);
+	reset();
+}
+
+void CPUPathTracer::reset()
+{
+	image.assign(size_t(settings.width) * settings.height, vec3(0.0f));
+	frameCount = 0;
+	renderSeconds = 0.0;
+	renderedSamples = 0;
+}
+
+double CPUPathTracer::getSamplesPerSecond() const
+{
+	return renderSeconds > 0.0 ? renderedSamples / renderSeconds : 0.0;
+}
+
+void CPUPathTracer::renderFrame(Camera camera)
+{
+	auto start = std::chrono::steady_clock::now();
+	CameraFrame frame = { camera.position, camera.GetForward(), camera.GetRight(), camera.GetUp(),
+		camera.GetImagePlaneWidth(), camera.GetImagePlaneHeight() };
+
+	// A task per tile rather than per thread, so threads that finish cheap tiles steal the expensive ones
+	int tilesX = (settings.width + settings.tileSize - 1) / settings.tileSize;
+	int tilesY = (settings.height + settings.tileSize - 1) / settings.tileSize;
+	int tileCount = tilesX * tilesY;
+	pool->parallelChunks(0, tileCount, tileCount, [&](int, int begin, int end) {
+		for (int tile = begin; tile < end; tile++) {
+			renderTile(frame, tile % tilesX, tile / tilesX);
+		}
+	});
+	frameCount++;
+
+	std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+	lastFrameMs = float(seconds.count() * 1000.0);
+	renderSeconds += seconds.count();
+	renderedSamples += (long long)settings.width * settings.height * settings.samplesPerPixel;
+}
+
+void CPUPathTracer::renderTile(const CameraFrame& camera, int tileX, int tileY)
+{
+	// Pixels of a row go through the scene together, one packet of first hits and one of shadow rays
+	// per area light. The rest of each path is too scattered for packets and is traced ray by ray.
+	int packetWidth = simdLevelWidth(scene.getPacketLevel());
+	int lightCount = int(areaLights.size());
+	std::vector<uint32_t> seeds(packetWidth);
+	std::vector<vec3> colors(packetWidth);
+	std::vector<Ray> rays(packetWidth);
+	std::vector<vec3> origins(packetWidth);
+	std::vector<vec3> directions(packetWidth);
+	std::vector<SceneHit> hits(packetWidth);
+	std::vector<SceneHit> shadowHits(packetWidth);
+	std::vector<vec3> shadowOrigins(size_t(packetWidth) * lightCount);
+	std::vector<vec3> shadowTargets(size_t(packetWidth) * lightCount);
+	std::vector<char> glossy(packetWidth);
+	std::vector<int> glossyLanes(packetWidth);
+	std::vector<char> shadowed(size_t(packetWidth) * lightCount);
+
+	int endX = std::min(settings.width, (tileX + 1) * settings.tileSize);
+	int endY = std::min(settings.height, (tileY + 1) * settings.tileSize);
+	for (int y = tileY * settings.tileSize; y < endY; y++) {
+		for (int firstX = tileX * settings.tileSize; firstX < endX; firstX += packetWidth) {
+			int count = std::min(packetWidth, endX - firstX);
+			for (int lane = 0; lane < count; lane++) {
+				// y counts from the bottom like gl_FragCoord, so pixels get the seeds the shader gives them
+				seeds[lane] = uint32_t(y * settings.width + firstX + lane) ^ (uint32_t(frameCount) * 1664525u);
+				colors[lane] = vec3(0.0f);
+			}
+
+			for (int sample = 0; sample < settings.samplesPerPixel; sample++) {
+				for (int lane = 0; lane < count; lane++) {
+					float jitterX = randomFloat(seeds[lane]) - 0.5f;
+					float jitterY = randomFloat(seeds[lane]) - 0.5f;
+					float u = (firstX + lane + jitterX) / float(settings.width) * camera.imagePlaneWidth - camera.imagePlaneWidth / 2.0f;
+					float v = ((y + jitterY) / float(settings.height) - 1.0f) * camera.imagePlaneHeight + camera.imagePlaneHeight / 2.0f;
+					rays[lane] = { normalize(camera.forward + camera.right * u + camera.up * v), camera.position, vec3(0.0f) };
+					origins[lane] = rays[lane].startPoint;
+					directions[lane] = rays[lane].direction;
+				}
+				scene.intersectPacket(origins.data(), directions.data(), count, hits.data());
+
+				// directIllumination() draws the light samples first thing at a glossy hit, so drawing them
+				// here from a copy of the seed gives the same points without changing the sequence
+				int glossyCount = 0;
+				for (int lane = 0; lane < count; lane++) {
+					glossy[lane] = 0;
+					if (hits[lane].primitive == -1 || settings.maxBounces < 1) {
+						continue;
+					}
+					SceneSurface surface = scene.getSurface(hits[lane]);
+					if (surface.material.materialType != GLOSSY) {
+						continue;
+					}
+					glossy[lane] = 1;
+					glossyLanes[glossyCount] = lane;
+					vec3 hitPoint = rays[lane].startPoint + rays[lane].direction * hits[lane].t;
+					vec3 normal = surface.ID == 1 ? normalize(hitPoint - surface.vertex1) : surface.normal;
+					uint32_t seed = seeds[lane];
+					for (int light = 0; light < lightCount; light++) {
+						size_t index = size_t(light) * packetWidth + glossyCount;
+						shadowOrigins[index] = hitPoint + normal * 0.0001f;
+						shadowTargets[index] = lightSample(areaLights[light], seed);
+					}
+					glossyCount++;
+				}
+				for (int light = 0; light < lightCount && glossyCount > 0; light++) {
+					const vec3* lightOrigins = &shadowOrigins[size_t(light) * packetWidth];
+					const vec3* lightTargets = &shadowTargets[size_t(light) * packetWidth];
+					for (int i = 0; i < glossyCount; i++) {
+						directions[i] = normalize(lightTargets[i] - lightOrigins[i]);
+					}
+					scene.intersectPacket(lightOrigins, directions.data(), glossyCount, shadowHits.data(), false);
+					for (int i = 0; i < glossyCount; i++) {
+						float distance = Norm(lightTargets[i] - lightOrigins[i]);
+						shadowed[size_t(glossyLanes[i]) * lightCount + light] = shadowHits[i].primitive != -1 && shadowHits[i].t < distance;
+					}
+				}
+
+				for (int lane = 0; lane < count; lane++) {
+					colors[lane] += raytrace(rays[lane], seeds[lane], &hits[lane], glossy[lane] ? &shadowed[size_t(lane) * lightCount] : nullptr);
+				}
+			}
+
+			for (int lane = 0; lane < count; lane++) {
+				vec3 color = colors[lane] / float(settings.samplesPerPixel);
+				vec3& pixel = image[size_t(settings.height - 1 - y) * settings.width + firstX + lane];
+				pixel = (pixel * float(frameCount) + color) / float(frameCount + 1);
+			}
+		}
+	}
+}
+
+vec3 CPUPathTracer::raytrace(Ray ray, uint32_t& seed, const SceneHit* firstHit, const char* firstShadows) const
+{
+	int transmissiveBounces = 0;
+	int uncountedBounces = 0;
+	vec3 accumulatedColor(0.0f);
+	vec3 importance(1.0f);
+
+	for (int i = 0; i < settings.maxBounces; i++) {
+		if (importance.x < 0.01f && importance.y < 0.01f && importance.z < 0.01f) {
+			break;
+		}
+		SceneHit hit = firstHit ? *firstHit : scene.intersect(ray.startPoint, ray.direction);
+		const char* shadows = firstShadows;
+		firstHit = nullptr;
+		firstShadows = nullptr;
+		if (hit.primitive == -1) {
+			accumulatedColor += importance * 0.2f; // Background
+			break;
+		}
+
+		SceneSurface surface = scene.getSurface(hit);
+		const Material& material = surface.material;
+		ray.endPoint = ray.startPoint + ray.direction * hit.t;
+		vec3 normal = surface.ID == 1 ? normalize(ray.endPoint - surface.vertex1) : surface.normal;
+
+		if (material.materialType == MIRROR) {
+			ray.direction = normalize(reflect(ray.direction, normal));
+			ray.startPoint = surface.ID == 1 ? ray.endPoint + normal * 1e-4f : ray.endPoint;
+			if (++uncountedBounces > MAX_UNCOUNTED_BOUNCES) {
+				break;
+			}
+			i--;
+			continue;
+		}
+
+		if (material.materialType == GLOSSY) {
+			accumulatedColor += multiply(importance, directIllumination(ray.endPoint, normal, material.color, seed, shadows));
+			importance = multiply(importance, material.color);
+
+			if (randomFloat(seed) < material.smoothness) {
+				ray.direction = normalize(reflect(ray.direction, normal));
+				ray.startPoint = ray.endPoint;
+				continue;
+			}
+
+			// Diffuse, cosine-weighted around the normal. Russian roulette on the azimuth with bounceOdds.
+			float randomAzimuth = 2.0f * float(M_PI) * randomFloat(seed);
+			if (!(randomAzimuth / material.bounceOdds <= 2.0f * float(M_PI) && i != settings.maxBounces - 1)) {
+				break;
+			}
+			float randomInclination = std::acos(std::sqrt(1.0f - randomFloat(seed)));
+			float localX = std::cos(randomAzimuth) * std::sin(randomInclination);
+			float localY = std::sin(randomAzimuth) * std::sin(randomInclination);
+			float localZ = std::cos(randomInclination);
+			vec3 tangent = normalize(ray.direction * -1.0f + surface.normal * (surface.normal * ray.direction));
+			vec3 bitangent = normalize(cross(surface.normal, tangent));
+			ray.direction = normalize(surface.normal * localZ + tangent * localX + bitangent * localY);
+			ray.startPoint = ray.endPoint;
+			continue;
+		}
+
+		if (material.materialType == TRANSMISSIVE) {
+			transmissiveBounces++;
+			vec3 facing = surface.ID == 1 ? normalize(ray.endPoint - surface.vertex1) : surface.normal;
+			float eta = 1.0f / material.ior;
+			if (ray.direction * facing >= 0.0f) {
+				facing = facing * -1.0f; // Leaving the glass
+				eta = material.ior;
+			}
+
+			float cosTheta = std::clamp(-(ray.direction * facing), 0.0f, 1.0f);
+			if (randomFloat(seed) < fresnelSchlick(cosTheta, material.ior)) {
+				ray.direction = reflect(ray.direction, facing);
+			}
+			else {
+				vec3 refracted = refract(ray.direction, facing, eta);
+				ray.direction = Norm(refracted) == 0.0f ? reflect(ray.direction, facing) : refracted;
+			}
+
+			ray.startPoint = ray.endPoint + ray.direction * 0.001f;
+			importance = multiply(importance, material.color);
+			if (transmissiveBounces > 10 || ++uncountedBounces > MAX_UNCOUNTED_BOUNCES) {
+				break;
+			}
+			i--;
+			continue;
+		}
+
+		if (material.materialType == LIGHT) {
+			accumulatedColor += multiply(importance, material.color);
+			break;
+		}
+		if (transmissiveBounces > 10) {
+			break;
+		}
+	}
+	return accumulatedColor;
+}
+
+vec3 CPUPathTracer::directIllumination(const vec3& hitPoint, const vec3& normal, const vec3& surfaceColor, uint32_t& seed, const char* shadows) const
+{
+	vec3 radiance(0.0f);
+
+	// One sample on each area light, the point is chosen before the shadow test like in the shader
+	for (size_t i = 0; i < areaLights.size(); i++) {
+		const AreaLight& light = areaLights[i];
+		vec3 e1 = light.vertex2 - light.vertex1;
+		vec3 e2 = light.vertex4 - light.vertex1;
+		vec3 y = lightSample(light, seed);
+
+		if (shadows ? !shadows[i] : !isInShadow(hitPoint + normal * 0.0001f, y)) {
+			vec3 toLight = y - hitPoint;
+			vec3 direction = normalize(toLight);
+			float cosX = std::max(0.0f, normal * direction);
+			float cosY = std::max(0.0f, (light.normal * -1.0f) * direction);
+			float distance = Norm(toLight);
+			float area = Norm(e1) * Norm(e2);
+			float scalarRadiance = cosX * cosY / (distance * distance);
+			radiance += multiply(light.radiance * (scalarRadiance * area / float(M_PI)), surfaceColor);
+		}
+	}
+	for (const PointLight& light : pointLights) {
+		if (!isInShadow(hitPoint, light.position)) {
+			radiance += light.radiance;
+		}
+	}
+	return radiance;
+}
+
+vec3 CPUPathTracer::lightSample(const AreaLight& light, uint32_t& seed)
+{
+	float s = randomFloat(seed);
+	float t = randomFloat(seed);
+	return light.vertex1 + (light.vertex2 - light.vertex1) * s + (light.vertex4 - light.vertex1) * t;
+}
+
+bool CPUPathTracer::isInShadow(const vec3& startPoint, const vec3& target) const
+{
+	vec3 toTarget = target - startPoint;
+	float distance = Norm(toTarget);
+	// Glass does not cast shadows
+	SceneHit hit = scene.intersect(startPoint, normalize(toTarget), false);
+	return hit.primitive != -1 && hit.t < distance;
+}
@@ -0,0 +1,120 @@
+#include "ImageFile.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace {
+	std::string lowerExtension(const std::string& path) {
+		std::string extension = std::filesystem::path(path).extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+		return extension;
+	}
+
+	bool finish(std::ofstream& out, const std::string& path) {
+		if (!out.good()) {
+			std::cerr << "Failed to write image: " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+}
+
+bool ImageFile::writePFM(const std::string& path, const std::vector<vec3>& pixels, int width, int height)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		std::cerr << "Failed to write image: " << path << std::endl;
+		return false;
+	}
+
+	// A negative scale means little-endian floats, and the rows go from the bottom up
+	uint16_t one = 1;
+	bool littleEndian = reinterpret_cast<const uint8_t&>(one) == 1;
+	out << "PF\n" << width << " " << height << "\n" << (littleEndian ? "-1.0" : "1.0") << "\n";
+	for (int y = height - 1; y >= 0; y--) {
+		out.write(reinterpret_cast<const char*>(&pixels[size_t(y) * width]), size_t(width) * sizeof(vec3));
+	}
+	return finish(out, path);
+}
+
+bool ImageFile::writePPM(const std::string& path, const std::vector<vec3>& pixels, int width, int height)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		std::cerr << "Failed to write image: " << path << std::endl;
+		return false;
+	}
+
+	out << "P6\n" << width << " " << height << "\n255\n";
+	std::vector<unsigned char> row(size_t(width) * 3);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const vec3& pixel = pixels[size_t(y) * width + x];
+			for (int channel = 0; channel < 3; channel++) {
+				float value = std::pow(std::clamp(pixel[channel], 0.0f, 1.0f), 1.0f / 2.2f);
+				row[size_t(x) * 3 + channel] = static_cast<unsigned char>(value * 255.0f + 0.5f);
+			}
+		}
+		out.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+	return finish(out, path);
+}
+
+bool ImageFile::write(const std::string& path, const std::vector<vec3>& pixels, int width, int height)
+{
+	std::string extension = lowerExtension(path);
+	if (extension == ".pfm") {
+		return writePFM(path, pixels, width, height);
+	}
+	if (extension == ".ppm") {
+		return writePPM(path, pixels, width, height);
+	}
+	std::cerr << "Unknown image format, expected .pfm or .ppm: " << path << std::endl;
+	return false;
+}
+
+bool ImageFile::readPFM(const std::string& path, std::vector<vec3>& pixels, int& width, int& height)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in.is_open()) {
+		std::cerr << "Failed to open image: " << path << std::endl;
+		return false;
+	}
+
+	std::string magic;
+	float scale = 0.0f;
+	in >> magic >> width >> height >> scale;
+	// Exactly one whitespace character separates the header from the floats
+	in.get();
+	if (!in.good() || magic != "PF" || width <= 0 || height <= 0 || scale == 0.0f) {
+		std::cerr << "Not a color PFM image: " << path << std::endl;
+		return false;
+	}
+
+	pixels.resize(size_t(width) * height);
+	for (int y = height - 1; y >= 0; y--) {
+		in.read(reinterpret_cast<char*>(&pixels[size_t(y) * width]), size_t(width) * sizeof(vec3));
+	}
+	if (!in.good()) {
+		std::cerr << "Image is truncated: " << path << std::endl;
+		return false;
+	}
+
+	uint16_t one = 1;
+	bool littleEndian = reinterpret_cast<const uint8_t&>(one) == 1;
+	if ((scale < 0.0f) != littleEndian) {
+		for (vec3& pixel : pixels) {
+			for (int channel = 0; channel < 3; channel++) {
+				uint8_t* bytes = reinterpret_cast<uint8_t*>(&pixel[channel]);
+				std::swap(bytes[0], bytes[3]);
+				std::swap(bytes[1], bytes[2]);
+			}
+		}
+	}
+	return true;
+}
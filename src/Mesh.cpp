@@ -0,0 +1,131 @@
+#include "Mesh.h"
+#include <algorithm>
+#include <map>
+#include "MeshFile.h"
+
+namespace
+{
+	// Weak references, a mesh is freed as soon as the last object using it is gone
+	std::map<std::string, std::weak_ptr<Mesh>>& loadedMeshes()
+	{
+		static std::map<std::string, std::weak_ptr<Mesh>> meshes;
+		return meshes;
+	}
+}
+
+std::shared_ptr<Mesh> Mesh::Load(const std::string& path)
+{
+	std::shared_ptr<Mesh> mesh = Find(path);
+	if (mesh)
+	{
+		return mesh;
+	}
+
+	IndexedMesh geometry;
+	MeshFile::loadModel(path, geometry);
+	return Create(path, std::move(geometry));
+}
+
+std::shared_ptr<Mesh> Mesh::Find(const std::string& path)
+{
+	auto found = loadedMeshes().find(path);
+	return found != loadedMeshes().end() ? found->second.lock() : nullptr;
+}
+
+std::shared_ptr<Mesh> Mesh::Create(const std::string& path, IndexedMesh geometry)
+{
+	std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+	mesh->path = path;
+	mesh->geometry = std::move(geometry);
+
+	loadedMeshes()[path] = mesh;
+	return mesh;
+}
+
+void Mesh::BindBuffers()
+{
+	BeginUpload();
+	ContinueUpload(SIZE_MAX);
+}
+
+void Mesh::BeginUpload()
+{
+	if (VAO != 0)
+	{
+		return; // Already uploaded by another object using this mesh
+	}
+
+	glGenVertexArrays(1, &VAO);
+	glBindVertexArray(VAO);
+
+	// Vertex positions
+	glGenBuffers(1, &VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	glBufferData(GL_ARRAY_BUFFER, geometry.positions.size() * sizeof(vec3), nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glEnableVertexAttribArray(0);
+
+	// Normals
+	glGenBuffers(1, &NBO); // NBO = Normal Buffer Object
+	glBindBuffer(GL_ARRAY_BUFFER, NBO);
+	glBufferData(GL_ARRAY_BUFFER, geometry.normals.size() * sizeof(vec3), nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glEnableVertexAttribArray(1);
+
+	// Indices, part of the VAO state
+	glGenBuffers(1, &EBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, geometry.indices.size() * sizeof(uint32_t), nullptr, GL_STATIC_DRAW);
+
+	glBindVertexArray(0);
+	uploadedBytes = 0;
+}
+
+bool Mesh::ContinueUpload(size_t maxBytes)
+{
+	if (IsUploaded())
+	{
+		return true;
+	}
+
+	// The three buffers are filled one after the other, uploadedBytes counts through all of them
+	struct Buffer { GLenum target; unsigned int id; const void* data; size_t bytes; };
+	Buffer buffers[] = {
+		{ GL_ARRAY_BUFFER, VBO, geometry.positions.data(), geometry.positions.size() * sizeof(vec3) },
+		{ GL_ARRAY_BUFFER, NBO, geometry.normals.data(), geometry.normals.size() * sizeof(vec3) },
+		{ GL_ARRAY_BUFFER, EBO, geometry.indices.data(), geometry.indices.size() * sizeof(uint32_t) },
+	};
+	size_t bufferStart = 0;
+	for (const Buffer& buffer : buffers)
+	{
+		size_t offset = uploadedBytes - std::min(uploadedBytes, bufferStart);
+		if (offset < buffer.bytes && maxBytes > 0)
+		{
+			// The element buffer is bound as an array buffer here, so the bound VAO is left alone
+			size_t bytes = std::min(buffer.bytes - offset, maxBytes);
+			glBindBuffer(buffer.target, buffer.id);
+			glBufferSubData(buffer.target, offset, bytes, static_cast<const char*>(buffer.data) + offset);
+			uploadedBytes += bytes;
+			maxBytes -= bytes;
+		}
+		bufferStart += buffer.bytes;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return IsUploaded();
+}
+
+bool Mesh::IsUploaded() const
+{
+	return VAO != 0 && uploadedBytes == UploadBytes();
+}
+
+float Mesh::GetUploadProgress() const
+{
+	size_t totalBytes = UploadBytes();
+	return totalBytes > 0 ? float(double(uploadedBytes) / totalBytes) : 1.0f;
+}
+
+size_t Mesh::UploadBytes() const
+{
+	return (geometry.positions.size() + geometry.normals.size()) * sizeof(vec3) + geometry.indices.size() * sizeof(uint32_t);
+}
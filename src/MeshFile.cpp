@@ -0,0 +1,156 @@
+#include "MeshFile.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include "MappedFile.h"
+#include "OBJLoader.h"
+
+namespace {
+	const char MESH_MAGIC[8] = { 'P', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+
+	std::string lowerExtension(const std::string& path) {
+		std::string extension = std::filesystem::path(path).extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+		return extension;
+	}
+}
+
+bool MeshFile::load(const std::string& path, IndexedMesh& mesh, AABB* bounds)
+{
+	MappedFile file;
+	if (!file.open(path)) {
+		std::cerr << "Failed to open file: " << path << std::endl;
+		return false;
+	}
+
+	Header header;
+	bool valid = file.getSize() >= sizeof(Header);
+	if (valid) {
+		std::memcpy(&header, file.getData(), sizeof(Header));
+		valid = std::memcmp(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC)) == 0
+			&& header.version == MESH_FILE_VERSION
+			&& header.rangeSize == sizeof(MaterialRange)
+			// Each count alone has to fit in the file, so that a damaged count cannot wrap the sum below around
+			&& header.rangeCount <= file.getSize() / sizeof(MaterialRange)
+			&& header.vertexCount <= file.getSize() / (2 * sizeof(vec3))
+			&& header.triangleCount <= file.getSize() / (3 * sizeof(uint32_t))
+			&& file.getSize() == sizeof(Header) + header.rangeCount * sizeof(MaterialRange)
+				+ header.vertexCount * 2 * sizeof(vec3) + header.triangleCount * 3 * sizeof(uint32_t);
+	}
+	if (!valid) {
+		std::cerr << "Not a mesh file of version " << MESH_FILE_VERSION << ": " << path << std::endl;
+		return false;
+	}
+
+	const char* payload = file.getData() + sizeof(Header);
+	std::vector<MaterialRange> ranges(header.rangeCount);
+	std::memcpy(ranges.data(), payload, ranges.size() * sizeof(MaterialRange));
+	payload += ranges.size() * sizeof(MaterialRange);
+	// IndexedMesh has one material, the ranges are there for files converted from models with several
+	if (ranges.size() != 1 || ranges[0].firstTriangle != 0 || ranges[0].triangleCount != header.triangleCount) {
+		std::cerr << "Only one material per mesh is supported: " << path << std::endl;
+		return false;
+	}
+
+	mesh.material = ranges[0].material;
+	mesh.positions.resize(header.vertexCount);
+	mesh.normals.resize(header.vertexCount);
+	mesh.indices.resize(header.triangleCount * 3);
+	std::memcpy(mesh.positions.data(), payload, mesh.positions.size() * sizeof(vec3));
+	payload += mesh.positions.size() * sizeof(vec3);
+	std::memcpy(mesh.normals.data(), payload, mesh.normals.size() * sizeof(vec3));
+	payload += mesh.normals.size() * sizeof(vec3);
+	std::memcpy(mesh.indices.data(), payload, mesh.indices.size() * sizeof(uint32_t));
+
+	// A bad index would read past the vertex buffers on the GPU, so it is worth the one pass
+	uint32_t largestIndex = 0;
+	for (uint32_t index : mesh.indices) {
+		largestIndex = std::max(largestIndex, index);
+	}
+	if (!mesh.indices.empty() && largestIndex >= header.vertexCount) {
+		std::cerr << "A triangle refers to a vertex that is not in " << path << std::endl;
+		mesh = IndexedMesh();
+		return false;
+	}
+
+	if (bounds) {
+		*bounds = { header.boundsMin, header.boundsMax };
+	}
+	return true;
+}
+
+bool MeshFile::save(const std::string& path, const IndexedMesh& mesh)
+{
+	Header header;
+	std::memcpy(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC));
+	header.version = MESH_FILE_VERSION;
+	header.rangeSize = sizeof(MaterialRange);
+	header.vertexCount = mesh.positions.size();
+	header.triangleCount = mesh.triangleCount();
+	header.rangeCount = 1;
+	AABB bounds;
+	for (const vec3& position : mesh.positions) {
+		for (int axis = 0; axis < 3; axis++) {
+			bounds.min[axis] = std::min(bounds.min[axis], position[axis]);
+			bounds.max[axis] = std::max(bounds.max[axis], position[axis]);
+		}
+	}
+	header.boundsMin = bounds.min;
+	header.boundsMax = bounds.max;
+	MaterialRange range = { 0, uint32_t(mesh.triangleCount()), mesh.material };
+
+	// Written next to the target and renamed, so a crash never leaves a half written mesh file behind
+	std::error_code error;
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			std::cerr << "Failed to write mesh file: " << tempPath << std::endl;
+			return false;
+		}
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(&range), sizeof(range));
+		out.write(reinterpret_cast<const char*>(mesh.positions.data()), mesh.positions.size() * sizeof(vec3));
+		out.write(reinterpret_cast<const char*>(mesh.normals.data()), mesh.normals.size() * sizeof(vec3));
+		out.write(reinterpret_cast<const char*>(mesh.indices.data()), mesh.indices.size() * sizeof(uint32_t));
+		if (!out.good()) {
+			std::cerr << "Failed to write mesh file: " << tempPath << std::endl;
+			out.close();
+			std::filesystem::remove(tempPath, error);
+			return false;
+		}
+	}
+
+	std::filesystem::remove(path, error);
+	std::filesystem::rename(tempPath, path, error);
+	if (error) {
+		std::cerr << "Failed to write mesh file: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool MeshFile::loadModel(const std::string& path, IndexedMesh& mesh, LoadProgress* progress)
+{
+	if (isMeshFile(path)) {
+		return load(path, mesh);
+	}
+
+	std::filesystem::path converted = std::filesystem::path(path).replace_extension(".mesh");
+	std::error_code convertedError, sourceError;
+	auto convertedTime = std::filesystem::last_write_time(converted, convertedError);
+	auto sourceTime = std::filesystem::last_write_time(path, sourceError);
+	bool upToDate = !convertedError && !sourceError && convertedTime >= sourceTime;
+	if (upToDate && load(converted.string(), mesh)) {
+		return true;
+	}
+	return OBJLoader::loadOBJ(path, mesh, 0, progress);
+}
+
+bool MeshFile::isMeshFile(const std::string& path)
+{
+	return lowerExtension(path) == ".mesh";
+}
@@ -0,0 +1,51 @@
+#include "ModelLoader.h"
+#include "MeshFile.h"
+
+ModelLoader::~ModelLoader()
+{
+	Cancel();
+	if (worker.joinable())
+	{
+		worker.join();
+	}
+}
+
+void ModelLoader::Start(const std::string& path)
+{
+	if (worker.joinable())
+	{
+		return;
+	}
+
+	this->path = path;
+	progress.fraction = 0.0f;
+	progress.cancelled = false;
+	finished = false;
+	result = IndexedMesh();
+	worker = std::thread([this]() {
+		succeeded = MeshFile::loadModel(this->path, result, &progress);
+		finished = true;
+	});
+}
+
+void ModelLoader::Cancel()
+{
+	progress.cancelled = true;
+}
+
+bool ModelLoader::TakeResult(IndexedMesh& mesh)
+{
+	if (!IsFinished())
+	{
+		return false;
+	}
+	worker.join();
+
+	bool loaded = succeeded && !progress.cancelled;
+	if (loaded)
+	{
+		mesh = std::move(result);
+	}
+	result = IndexedMesh();
+	return loaded;
+}
@@ -1,66 +1,368 @@
-
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <memory>
 #include "OBJLoader.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
 
-bool OBJLoader::loadOBJ(const std::string& path, std::vector<vec3>& out_vertices, std::vector<vec2>& out_uvs, std::vector<vec3>& out_normals)
-{
-    std::vector<unsigned int> vertexIndices, uvIndices, normalIndices;
-    std::vector<vec3> temp_vertices;
-    std::vector<vec2> temp_uvs;
-    std::vector<vec3> temp_normals;
+namespace {
+    const uint32_t NONE = UINT32_MAX;
+
+    // Reads the fields of one line. Never looks past the end of the line, which is not terminated.
+    struct LineScanner {
+        const char* p;
+        const char* end;
+
+        void skipSpaces() {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                p++;
+            }
+        }
+
+        bool atEnd() {
+            skipSpaces();
+            return p == end;
+        }
+
+        // The keyword at the start of the line, "v", "vn", "f", ...
+        bool keywordIs(const char* keyword) {
+            size_t length = std::strlen(keyword);
+            if (size_t(end - p) < length || std::memcmp(p, keyword, length) != 0) {
+                return false;
+            }
+            if (p + length < end && p[length] != ' ' && p[length] != '\t' && p[length] != '\r') {
+                return false; // Only the start of a longer keyword
+            }
+            p += length;
+            return true;
+        }
+
+        bool readFloat(float& value) {
+            skipSpaces();
+            if (p < end && *p == '+') {
+                p++; // from_chars does not take a plus sign
+            }
+            auto [next, error] = std::from_chars(p, end, value);
+            if (error == std::errc::result_out_of_range) {
+                value = 0.0f; // Only denormals come up in practice
+            }
+            else if (error != std::errc()) {
+                return false;
+            }
+            p = next;
+            return true;
+        }
+
+        // An index of a face corner, 1-based or counting back from the last element read so far when negative
+        bool readIndex(long long& value) {
+            auto [next, error] = std::from_chars(p, end, value);
+            if (error != std::errc() || value == 0) {
+                return false;
+            }
+            p = next;
+            return true;
+        }
+
+        // v, v/vt, v//vn or v/vt/vn. The texture coordinate is not used and only skipped. normal is 0 if missing.
+        bool readCorner(long long& position, long long& normal) {
+            skipSpaces();
+            normal = 0;
+            if (!readIndex(position)) {
+                return false;
+            }
+            if (p == end || *p != '/') {
+                return true;
+            }
+            p++;
+            while (p < end && *p != '/' && *p != ' ' && *p != '\t' && *p != '\r') {
+                p++;
+            }
+            if (p == end || *p != '/') {
+                return true;
+            }
+            p++;
+            return readIndex(normal);
+        }
+    };
+
+    const char* lineEnd(const char* p, const char* end) {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        return newline ? newline : end;
+    }
+
+    const char* nextLine(const char* p, const char* end) {
+        const char* newline = lineEnd(p, end);
+        return newline < end ? newline + 1 : end;
+    }
+
+    struct Corner {
+        uint32_t position;
+        uint32_t normal; // NONE if the face gave none
+    };
+
+    // The lines of one chunk of the file. A negative index is only known relative to the chunk, so the
+    // corner keeps the signed offset from the chunk's first element and is listed for the fix-up.
+    struct Chunk {
+        const char* begin;
+        const char* end;
+        std::vector<vec3> positions;
+        std::vector<vec3> normals;
+        std::vector<Corner> corners; // Three per triangle
+        std::vector<uint32_t> relativePositions;
+        std::vector<uint32_t> relativeNormals;
+        int lineCount = 0;
+        int errorLine = -1; // Counted from the start of the chunk
+        std::string errorText;
+    };
+
+    // Bytes parsed by all chunks together, for the progress of the whole file
+    struct ParseProgress {
+        LoadProgress* progress;
+        std::atomic<size_t> parsedBytes{ 0 };
+        size_t totalBytes;
+    };
+
+    // Parsing is most of the load, the merge after it gets the last tenth of the progress
+    const float PARSE_PROGRESS = 0.9f;
+
+    void parseChunk(Chunk& chunk, ParseProgress& parse) {
+        // A quick pass over the line starts, so that no array has to grow while parsing
+        size_t positionLines = 0, normalLines = 0, faceLines = 0;
+        for (const char* p = chunk.begin; p < chunk.end; p = nextLine(p, chunk.end)) {
+            if (p[0] == 'v' && p + 1 < chunk.end) {
+                positionLines += p[1] == ' ' || p[1] == '\t';
+                normalLines += p[1] == 'n';
+            }
+            faceLines += p[0] == 'f';
+        }
+        chunk.positions.reserve(positionLines);
+        chunk.normals.reserve(normalLines);
+        chunk.corners.reserve(3 * faceLines);
+
+        std::vector<Corner> face;
+        std::vector<char> faceRelative; // Bit 0 position, bit 1 normal
+        const char* reported = chunk.begin;
+        for (const char* p = chunk.begin; p < chunk.end; ) {
+            if (parse.progress && (chunk.lineCount & 0xFFFF) == 0) {
+                size_t parsed = parse.parsedBytes += p - reported;
+                reported = p;
+                parse.progress->fraction = PARSE_PROGRESS * float(double(parsed) / parse.totalBytes);
+                if (parse.progress->cancelled) {
+                    return;
+                }
+            }
+            const char* lineStart = p;
+            const char* next = lineEnd(p, chunk.end);
+            LineScanner line{ p, next };
+            p = nextLine(p, chunk.end);
+            chunk.lineCount++;
+            line.skipSpaces();
+
+            bool valid = true;
+            if (line.keywordIs("v")) {
+                vec3 position;
+                valid = line.readFloat(position.x) && line.readFloat(position.y) && line.readFloat(position.z);
+                chunk.positions.push_back(position);
+            }
+            else if (line.keywordIs("vn")) {
+                vec3 normal;
+                valid = line.readFloat(normal.x) && line.readFloat(normal.y) && line.readFloat(normal.z);
+                chunk.normals.push_back(normal);
+            }
+            else if (line.keywordIs("f")) {
+                face.clear();
+                faceRelative.clear();
+                while (!line.atEnd()) {
+                    long long position, normal;
+                    if (!line.readCorner(position, normal)) {
+                        valid = false;
+                        break;
+                    }
+                    // Out of range indices are only found after the merge, the counts are not known yet
+                    bool positionRelative = position < 0;
+                    bool normalRelative = normal < 0;
+                    position = positionRelative ? (long long)chunk.positions.size() + position : position - 1;
+                    normal = normalRelative ? (long long)chunk.normals.size() + normal : normal - 1;
+                    face.push_back({ uint32_t(int32_t(position)), normal == -1 && !normalRelative ? NONE : uint32_t(int32_t(normal)) });
+                    faceRelative.push_back(char((positionRelative ? 1 : 0) | (normalRelative ? 2 : 0)));
+                }
+                valid = valid && face.size() >= 3;
+                // Polygons are split into a fan of triangles around the first corner
+                for (size_t i = 2; valid && i < face.size(); i++) {
+                    for (size_t corner : { size_t(0), i - 1, i }) {
+                        if (faceRelative[corner] & 1) {
+                            chunk.relativePositions.push_back(chunk.corners.size());
+                        }
+                        if (faceRelative[corner] & 2) {
+                            chunk.relativeNormals.push_back(chunk.corners.size());
+                        }
+                        chunk.corners.push_back(face[corner]);
+                    }
+                }
+            }
+            // Texture coordinates, groups, materials and comments are not used
+
+            if (!valid) {
+                chunk.errorLine = chunk.lineCount;
+                chunk.errorText = std::string(lineStart, next);
+                return;
+            }
+        }
+    }
+}
 
-    std::ifstream file(path);
-    if (!file.is_open()) {
+bool OBJLoader::loadOBJ(const std::string& path, IndexedMesh& mesh, int threadCount, LoadProgress* progress)
+{
+    MappedFile file;
+    if (!file.open(path)) {
         std::cerr << "Failed to open file: " << path << std::endl;
         return false;
     }
+    const char* data = file.getData();
+    const char* end = data + file.getSize();
 
-    std::string line;
-    while (std::getline(file, line))
-    {
-        std::istringstream ss(line);
-        std::string type;
-        ss >> type;
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.indices.clear();
+    mesh.material = { vec3(255, 100, 100) / 255.0f, 0.0f, 0, 1.0f, 0.8f }; // Arbitrary color
 
-        if (type == "v") {
-            vec3 vertex;
-            ss >> vertex.x >> vertex.y >> vertex.z;
-            temp_vertices.push_back(vertex);
+    // Chunks of at least a few MB, cut after the next line break, so small files stay on this thread
+    const size_t minChunkBytes = 4 << 20;
+    int threads = threadCount > 0 ? threadCount : ThreadPool::hardwareThreads();
+    int chunkCount = threads > 1 ? int(std::clamp<size_t>(file.getSize() / minChunkBytes, 1, size_t(threads) * 4)) : 1;
+    std::vector<Chunk> chunks(chunkCount);
+    const char* chunkBegin = data;
+    for (int i = 0; i < chunkCount; i++) {
+        const char* chunkEnd = i + 1 == chunkCount ? end : std::max(chunkBegin, data + file.getSize() * (i + 1) / chunkCount);
+        chunks[i].begin = chunkBegin;
+        chunks[i].end = chunkEnd < end ? nextLine(chunkEnd, end) : end;
+        chunkBegin = chunks[i].end;
+    }
+
+    std::unique_ptr<ThreadPool> pool;
+    if (chunkCount > 1) {
+        pool = std::make_unique<ThreadPool>(std::min(threads, chunkCount));
+    }
+    auto forEachChunk = [&](auto body) {
+        if (pool) {
+            pool->parallelChunks(0, chunkCount, chunkCount, [&](int, int chunk, int) { body(chunks[chunk]); });
         }
-        else if (type == "vt") {
-            vec2 uv;
-            ss >> uv.x >> uv.y;
-            temp_uvs.push_back(uv);
+        else {
+            body(chunks[0]);
         }
-        else if (type == "vn") {
-            vec3 normal;
-            ss >> normal.x >> normal.y >> normal.z;
-            temp_normals.push_back(normal);
+    };
+    ParseProgress parse{ progress, {}, file.getSize() };
+    forEachChunk([&](Chunk& chunk) { parseChunk(chunk, parse); });
+    if (progress && progress->cancelled) {
+        return false;
+    }
+
+    // Where every chunk's elements go in the whole file
+    std::vector<size_t> positionOffset(chunkCount + 1, 0);
+    std::vector<size_t> normalOffset(chunkCount + 1, 0);
+    int lineOffset = 0;
+    for (int i = 0; i < chunkCount; i++) {
+        if (chunks[i].errorLine >= 0) {
+            std::cerr << "Malformed line " << lineOffset + chunks[i].errorLine << " in " << path << ": " << chunks[i].errorText << std::endl;
+            return false;
         }
-        else if (type == "f") {
-            unsigned int vi[3], uvi[3], ni[3];
-            char slash;
+        lineOffset += chunks[i].lineCount;
+        positionOffset[i + 1] = positionOffset[i] + chunks[i].positions.size();
+        normalOffset[i + 1] = normalOffset[i] + chunks[i].normals.size();
+    }
+    size_t positionCount = positionOffset[chunkCount];
+    size_t normalCount = normalOffset[chunkCount];
 
-			// TODO: Loader only works if there is vertex, uv, and normal data. Need to be handled differntly if no UV data is present.
-            for (int i = 0; i < 3; ++i) {
-                ss >> vi[i] >> slash >> uvi[i] >> slash >> ni[i];
-                vertexIndices.push_back(vi[i]);
-                uvIndices.push_back(uvi[i]);
-                normalIndices.push_back(ni[i]);
+    // Copied to their offsets, negative indices fixed up and every index checked against the whole file
+    std::vector<vec3> filePositions(positionCount);
+    std::vector<vec3> fileNormals(normalCount);
+    std::atomic<bool> outOfRange{ false };
+    forEachChunk([&](Chunk& chunk) {
+        int i = &chunk - chunks.data();
+        std::copy(chunk.positions.begin(), chunk.positions.end(), filePositions.begin() + positionOffset[i]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), fileNormals.begin() + normalOffset[i]);
+        for (uint32_t corner : chunk.relativePositions) {
+            chunk.corners[corner].position = uint32_t(positionOffset[i] + int32_t(chunk.corners[corner].position));
+        }
+        for (uint32_t corner : chunk.relativeNormals) {
+            chunk.corners[corner].normal = uint32_t(normalOffset[i] + int32_t(chunk.corners[corner].normal));
+        }
+        for (const Corner& corner : chunk.corners) {
+            if (corner.position >= positionCount || (corner.normal != NONE && corner.normal >= normalCount)) {
+                outOfRange = true;
             }
         }
+        chunk.positions = std::vector<vec3>();
+        chunk.normals = std::vector<vec3>();
+    });
+    if (outOfRange) {
+        std::cerr << "A face refers to a vertex or normal that is not in " << path << std::endl;
+        return false;
     }
 
-	// Use the indices to correctly construct the final vertex, uv, and normal vectors
-    for (size_t i = 0; i < vertexIndices.size(); i++) {
-        out_vertices.push_back(temp_vertices[vertexIndices[i] - 1]);
-		//out_uvs.push_back(temp_uvs[uvIndices[i] - 1]); // Commented out to avoid UVs
-        out_normals.push_back(temp_normals[normalIndices[i] - 1]);
+    // The mesh vertices made from each file position, as a list through nextVertex, and the file
+    // normal each of them uses. A position is almost always used with one normal, so the lists are short.
+    // Done in file order on one thread, so the vertex numbers do not depend on the chunks.
+    size_t cornerCount = 0;
+    for (const Chunk& chunk : chunks) {
+        cornerCount += chunk.corners.size();
+    }
+    std::vector<uint32_t> firstVertex(positionCount, NONE);
+    std::vector<uint32_t> nextVertex;
+    std::vector<uint32_t> vertexNormal;
+    nextVertex.reserve(positionCount);
+    vertexNormal.reserve(positionCount);
+    mesh.positions.reserve(positionCount);
+    mesh.normals.reserve(positionCount);
+    mesh.indices.reserve(cornerCount);
+    bool missingNormals = false;
+    for (Chunk& chunk : chunks) {
+        for (const Corner& corner : chunk.corners) {
+            uint32_t vertex = firstVertex[corner.position];
+            while (vertex != NONE && vertexNormal[vertex] != corner.normal) {
+                vertex = nextVertex[vertex];
+            }
+            if (vertex == NONE) {
+                vertex = mesh.positions.size();
+                mesh.positions.push_back(filePositions[corner.position]);
+                mesh.normals.push_back(corner.normal == NONE ? vec3(0.0f, 0.0f, 0.0f) : fileNormals[corner.normal]);
+                missingNormals |= corner.normal == NONE;
+                vertexNormal.push_back(corner.normal);
+                nextVertex.push_back(firstVertex[corner.position]);
+                firstVertex[corner.position] = vertex;
+            }
+            mesh.indices.push_back(vertex);
+        }
+        chunk.corners = std::vector<Corner>();
+    }
+
+    // Corners without a normal get the area-weighted average of the faces around their position
+    if (missingNormals) {
+        for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+            uint32_t a = mesh.indices[i], b = mesh.indices[i + 1], c = mesh.indices[i + 2];
+            vec3 faceNormal = cross(mesh.positions[b] - mesh.positions[a], mesh.positions[c] - mesh.positions[a]);
+            for (uint32_t vertex : { a, b, c }) {
+                if (vertexNormal[vertex] == NONE) {
+                    mesh.normals[vertex] += faceNormal;
+                }
+            }
+        }
+        for (size_t vertex = 0; vertex < mesh.normals.size(); vertex++) {
+            if (vertexNormal[vertex] == NONE) {
+                float length = Norm(mesh.normals[vertex]);
+                mesh.normals[vertex] = length > 0.0f ? mesh.normals[vertex] / length : vec3(0.0f, 1.0f, 0.0f);
+            }
+        }
     }
 
-    file.close();
+    mesh.positions.shrink_to_fit();
+    mesh.normals.shrink_to_fit();
+    if (progress) {
+        progress->fraction = 1.0f;
+    }
     return true;
 }
 
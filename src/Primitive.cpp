@@ -0,0 +1,73 @@
+#include "Primitive.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    float signNotZero(float value) {
+        return value >= 0.0f ? 1.0f : -1.0f;
+    }
+
+    // Same rounding as packSnorm2x16
+    uint32_t packSnorm16(float value) {
+        return uint32_t(uint16_t(int16_t(std::round(std::clamp(value, -1.0f, 1.0f) * 32767.0f))));
+    }
+
+    float unpackSnorm16(uint32_t bits) {
+        return std::clamp(float(int16_t(uint16_t(bits))) / 32767.0f, -1.0f, 1.0f);
+    }
+}
+
+PrimitiveGeometry geometryOf(const Primitive& primitive, int material)
+{
+    PrimitiveGeometry geometry;
+    geometry.vertex1 = primitive.vertex1;
+    geometry.ID = primitive.ID;
+    geometry.edge1 = primitive.ID == 1 ? vec3(primitive.vertex2.x, 0.0f, 0.0f) : primitive.edge1;
+    geometry.material = material;
+    geometry.edge2 = primitive.ID == 1 ? vec3(0.0f) : primitive.edge2;
+    geometry.normal = packNormal(primitive.normal);
+    return geometry;
+}
+
+Material materialOf(const Primitive& primitive)
+{
+    Material material;
+    material.color = primitive.color;
+    material.smoothness = primitive.smoothness;
+    material.materialType = primitive.materialType;
+    material.ior = primitive.ior;
+    material.bounceOdds = primitive.bounceOdds;
+    return material;
+}
+
+uint32_t packNormal(const vec3& normal)
+{
+    float length = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+    if (length == 0.0f) {
+        return 0;
+    }
+    float x = normal.x / length;
+    float y = normal.y / length;
+    if (normal.z < 0.0f) {
+        // The lower half is folded over the diagonals onto the outer triangles of the square
+        float foldedX = (1.0f - std::abs(y)) * signNotZero(x);
+        float foldedY = (1.0f - std::abs(x)) * signNotZero(y);
+        x = foldedX;
+        y = foldedY;
+    }
+    return packSnorm16(x) | (packSnorm16(y) << 16);
+}
+
+vec3 unpackNormal(uint32_t packed)
+{
+    float x = unpackSnorm16(packed);
+    float y = unpackSnorm16(packed >> 16);
+    float z = 1.0f - std::abs(x) - std::abs(y);
+    if (z < 0.0f) {
+        float unfoldedX = (1.0f - std::abs(y)) * signNotZero(x);
+        float unfoldedY = (1.0f - std::abs(x)) * signNotZero(y);
+        x = unfoldedX;
+        y = unfoldedY;
+    }
+    return normalize(vec3(x, y, z));
+}
@@ -0,0 +1,76 @@
+#include "SIMDLevel.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#endif
+
+namespace {
+	SIMDLevel detect() {
+#if defined(SIMD_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		int highestLeaf = info[0];
+		__cpuid(info, 1);
+		bool sse2 = (info[3] & (1 << 26)) != 0;
+		// The OS has to save the wider registers on a context switch, which XGETBV reports
+		bool osAVX = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+		bool osAVX512 = osAVX && (_xgetbv(0) & 0xE6) == 0xE6;
+		bool avx2 = false;
+		bool avx512 = false;
+		if (highestLeaf >= 7) {
+			__cpuidex(info, 7, 0);
+			avx2 = osAVX && (info[1] & (1 << 5)) != 0;
+			avx512 = osAVX512 && (info[1] & (1 << 16)) != 0;
+		}
+		if (avx512) {
+			return SIMDLevel::AVX512;
+		}
+		if (avx2) {
+			return SIMDLevel::AVX2;
+		}
+		return sse2 ? SIMDLevel::SSE2 : SIMDLevel::Scalar;
+#elif defined(SIMD_X86)
+		// Also checks that the OS saves the registers
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f")) {
+			return SIMDLevel::AVX512;
+		}
+		if (__builtin_cpu_supports("avx2")) {
+			return SIMDLevel::AVX2;
+		}
+		return __builtin_cpu_supports("sse2") ? SIMDLevel::SSE2 : SIMDLevel::Scalar;
+#else
+		return SIMDLevel::Scalar;
+#endif
+	}
+}
+
+SIMDLevel detectSIMDLevel()
+{
+	static const SIMDLevel level = detect();
+	return level;
+}
+
+const char* simdLevelName(SIMDLevel level)
+{
+	switch (level) {
+	case SIMDLevel::SSE2: return "SSE2";
+	case SIMDLevel::AVX2: return "AVX2";
+	case SIMDLevel::AVX512: return "AVX-512";
+	default: return "scalar";
+	}
+}
+
+int simdLevelWidth(SIMDLevel level)
+{
+	switch (level) {
+	case SIMDLevel::SSE2: return 4;
+	case SIMDLevel::AVX2: return 8;
+	case SIMDLevel::AVX512: return 16;
+	default: return 1;
+	}
+}
@@ -9,10 +9,10 @@ Scene::Scene(int presetID) {
         getSpheres();
         break;
     case 2:
-		CreateSceneFromModel("..\\models\\StanfordBunny348.obj", 0);
+		CreateSceneFromModel("../models/StanfordBunny348.obj");
         break;
     case 3:
-        CreateSceneFromModel("..\\models\\Bunny70K.obj", 0);
+        CreateSceneFromModel("../models/Bunny70K.obj");
         break;
     case 4:
         getCrazyScene();
@@ -25,39 +25,22 @@ Scene::Scene(int presetID) {
 //Riktigt tuff fr datorn att hantera p min sida.
 void Scene::getCrazyScene() {
     getRoom();
-    CreateSceneFromModel("..\\models\\Bunny70K_Translated.obj", primitives.size()-1);
+    CreateSceneFromModel("../models/Bunny70K_Translated.obj");
 }
 
-void Scene::CreateSceneFromModel(const std::string& path,int index = 0) {
-	std::vector<vec3> vertices;
-	std::vector<vec2> uvs;
-	std::vector<vec3> normals;
-
-	// Load the OBJ file
-	OBJLoader::loadOBJ(path, vertices, uvs, normals);
+// The model is kept indexed as its own mesh next to the scene primitives instead of being expanded into them
+void Scene::CreateSceneFromModel(const std::string& path) {
+    IndexedMesh model;
+    if (MeshFile::loadModel(path, model)) {
+        models.push_back(std::move(model));
+    }
+    else {
+        missingModels.push_back(path);
+    }
 
-    primitives.resize(vertices.size()/3 + index);
     areaLights.resize(1);
     pointLights.resize(0);
 
-    size_t primIdx = index;
-    for (size_t i = 0; i < vertices.size(); i+=3)
-    {
-		primitives[primIdx].vertex1 = vertices[i];
-		primitives[primIdx].vertex2 = vertices[i + 1];
-		primitives[primIdx].vertex3 = vertices[i + 2];
-        primitives[primIdx].edge1 = primitives[primIdx].vertex2 - primitives[primIdx].vertex1;
-        primitives[primIdx].edge2 = primitives[primIdx].vertex3 - primitives[primIdx].vertex1;
-		primitives[primIdx].normal = normals[i];
-		primitives[primIdx].color = vec3(255, 100, 100) / 255.0f; // Arbitrary color
-        primitives[primIdx].ID = 0;
-        primitives[primIdx].smoothness = 0.0f;
-        primitives[primIdx].bounceOdds = 0.8f;
-        primitives[primIdx].materialType = 0;
-        primitives[primIdx].ior = 1.0f;
-
-		primIdx++;
-    }
     //pointLights[0].position = vec3(5.5, 0.0, 6.0);
     //pointLights[0].radiance = vec3(1.0, 1.0, 1.0) / 25.f;
 
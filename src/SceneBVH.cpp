@@ -0,0 +1,544 @@
+#include "SceneBVH.h"
+#include "RayIntersection.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+
+namespace {
+	void copyColumnMajor(const mat4& matrix, float* destination) {
+		mat4 columns = transpose(matrix);
+		std::copy(columns.m, columns.m + 16, destination);
+	}
+
+	bool sameBox(const BVHNode& node, const vec3& boxMin, const vec3& boxMax) {
+		return node.bBoxMin.x == boxMin.x && node.bBoxMin.y == boxMin.y && node.bBoxMin.z == boxMin.z
+			&& node.bBoxMax.x == boxMax.x && node.bBoxMax.y == boxMax.y && node.bBoxMax.z == boxMax.z;
+	}
+}
+
+void SceneBVH::clear()
+{
+	meshes.clear();
+	instances.clear();
+	instanceOrder.clear();
+	primitiveCount = 0;
+	geometryCount = 0;
+	triangleCount = 0;
+	vertexCount = 0;
+	nodeCount = 0;
+	materials.clear();
+	gpuInstances.clear();
+	topLevelNodes.clear();
+	topLevelParents.clear();
+	instanceLeaves.clear();
+}
+
+int SceneBVH::addMesh(const std::vector<Primitive>& meshPrimitives)
+{
+	for (int i = 0; i < int(meshes.size()); i++) {
+		if (meshes[i].source == &meshPrimitives) {
+			return i;
+		}
+	}
+	MeshEntry mesh;
+	mesh.source = &meshPrimitives;
+	meshes.push_back(std::move(mesh));
+	return meshes.size() - 1;
+}
+
+int SceneBVH::addMesh(const IndexedMesh& indexedMesh)
+{
+	for (int i = 0; i < int(meshes.size()); i++) {
+		if (meshes[i].indexedSource == &indexedMesh) {
+			return i;
+		}
+	}
+	MeshEntry mesh;
+	mesh.indexedSource = &indexedMesh;
+	meshes.push_back(std::move(mesh));
+	return meshes.size() - 1;
+}
+
+int SceneBVH::addInstance(int mesh, const mat4& modelMatrix)
+{
+	Instance instance;
+	instance.mesh = mesh;
+	instances.push_back(instance);
+	setInstanceTransform(instances.size() - 1, modelMatrix);
+	return instances.size() - 1;
+}
+
+void SceneBVH::setInstanceTransform(int instance, const mat4& modelMatrix)
+{
+	instances[instance].objectToWorld = modelMatrix;
+	instances[instance].worldToObject = InvertMat4(modelMatrix);
+}
+
+void SceneBVH::build()
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	primitiveCount = 0;
+	geometryCount = 0;
+	triangleCount = 0;
+	vertexCount = 0;
+	nodeCount = 0;
+	maxStackSize = 1;
+	for (MeshEntry& mesh : meshes) {
+		if (!mesh.tree) {
+			mesh.tree = std::make_unique<BVHTree>();
+			mesh.tree->setBuildSettings(settings);
+			mesh.tree->setCacheDirectory(cacheDirectory);
+			if (mesh.indexedSource) {
+				mesh.tree->rebuild(*mesh.indexedSource);
+			}
+			else {
+				mesh.tree->rebuild(*mesh.source);
+			}
+		}
+		if (mesh.wideTree.getNodeCount() == 0 || mesh.wideTree.getFormat() != nodeFormat) {
+			mesh.wideTree.build(mesh.tree->getNodes(), nodeFormat);
+		}
+		maxStackSize = std::max(maxStackSize, mesh.wideTree.getMaxStackSize());
+		int references = mesh.tree->getIndices().size();
+		mesh.firstPrimitive = primitiveCount;
+		mesh.firstNode = nodeCount;
+		primitiveCount += references;
+		nodeCount += mesh.wideTree.getNodeCount();
+		if (mesh.indexedSource) {
+			mesh.bufferOffset = triangleCount;
+			mesh.firstVertex = vertexCount;
+			triangleCount += references;
+			vertexCount += mesh.indexedSource->positions.size();
+		}
+		else {
+			mesh.bufferOffset = geometryCount;
+			mesh.firstVertex = -1;
+			geometryCount += references;
+		}
+	}
+
+	// The material table is shared by all meshes, so the geometry of every mesh is redone with it
+	materials.clear();
+	std::map<std::vector<char>, int> knownMaterials;
+	for (MeshEntry& mesh : meshes) {
+		ArrayView<const int> indices = mesh.tree->getIndices();
+		mesh.leafGeometry.clear();
+		mesh.leafTriangles.clear();
+		mesh.vertices.clear();
+
+		// Only the three vertex numbers of a triangle are copied per leaf reference
+		if (mesh.indexedSource) {
+			const IndexedMesh& source = *mesh.indexedSource;
+			int material = findMaterial(source.material, knownMaterials);
+			mesh.vertices.reserve(source.positions.size());
+			for (size_t i = 0; i < source.positions.size(); i++) {
+				mesh.vertices.push_back({ source.positions[i], packNormal(source.normals[i]) });
+			}
+			mesh.leafTriangles.reserve(indices.size());
+			for (int index : indices) {
+				mesh.leafTriangles.push_back({ source.indices[3 * index], source.indices[3 * index + 1], source.indices[3 * index + 2], material });
+			}
+			continue;
+		}
+
+		mesh.leafGeometry.reserve(indices.size());
+		int material = -1;
+		for (int index : indices) {
+			const Primitive& primitive = (*mesh.source)[index];
+			Material primitiveMaterial = materialOf(primitive);
+			// Neighbouring primitives mostly come from the same object, which saves the lookup
+			if (material < 0 || std::memcmp(&primitiveMaterial, &materials[material], sizeof(Material)) != 0) {
+				material = findMaterial(primitiveMaterial, knownMaterials);
+			}
+			mesh.leafGeometry.push_back(geometryOf(primitive, material));
+		}
+	}
+
+	builtNodeFormat = nodeFormat;
+	buildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+	buildTopLevel();
+	std::cout << "Scene BVH: " << meshes.size() << " meshes, " << instances.size() << " instances, "
+		<< geometryCount << " primitives, " << triangleCount << " indexed triangles over " << vertexCount << " vertices, "
+		<< materials.size() << " materials, " << nodeCount << " nodes\n\n";
+}
+
+SceneMeshBuffers SceneBVH::getMesh(int mesh) const
+{
+	const MeshEntry& entry = meshes[mesh];
+	SceneMeshBuffers buffers;
+	buffers.geometry = entry.leafGeometry;
+	buffers.triangles = entry.leafTriangles;
+	buffers.vertices = entry.vertices;
+	buffers.nodes = entry.wideTree.getNodes();
+	buffers.quantizedNodes = entry.wideTree.getQuantizedNodes();
+	buffers.firstPrimitive = entry.bufferOffset;
+	buffers.firstVertex = std::max(entry.firstVertex, 0);
+	buffers.firstNode = entry.firstNode;
+	return buffers;
+}
+
+Primitive SceneBVH::getPrimitive(int primitive) const
+{
+	ScenePrimitiveSource source = getPrimitiveSource(primitive);
+	const MeshEntry& mesh = meshes[source.mesh];
+	if (!mesh.indexedSource) {
+		return (*mesh.source)[source.primitive];
+	}
+
+	const IndexedMesh& indexed = *mesh.indexedSource;
+	uint32_t corner = indexed.indices[3 * source.primitive];
+	Primitive result = {};
+	result.vertex1 = indexed.positions[corner];
+	result.vertex2 = indexed.positions[indexed.indices[3 * source.primitive + 1]];
+	result.vertex3 = indexed.positions[indexed.indices[3 * source.primitive + 2]];
+	result.edge1 = result.vertex2 - result.vertex1;
+	result.edge2 = result.vertex3 - result.vertex1;
+	result.normal = indexed.normals[corner];
+	result.ID = 0;
+	result.color = indexed.material.color;
+	result.smoothness = indexed.material.smoothness;
+	result.materialType = indexed.material.materialType;
+	result.ior = indexed.material.ior;
+	result.bounceOdds = indexed.material.bounceOdds;
+	return result;
+}
+
+// Element index of the mesh's buffer. A triangle of an IndexedMesh gets the vertex of its first corner
+// and the edges to the other two, the same as loadPrimitive in the shader.
+PrimitiveGeometry SceneBVH::loadPrimitive(const MeshEntry& mesh, int index) const
+{
+	if (!mesh.indexedSource) {
+		return mesh.leafGeometry[index];
+	}
+	const IndexedTriangle& triangle = mesh.leafTriangles[index];
+	const MeshVertex& vertex1 = mesh.vertices[triangle.vertex1];
+	PrimitiveGeometry geometry;
+	geometry.vertex1 = vertex1.position;
+	geometry.ID = 0;
+	geometry.edge1 = mesh.vertices[triangle.vertex2].position - vertex1.position;
+	geometry.material = triangle.material;
+	geometry.edge2 = mesh.vertices[triangle.vertex3].position - vertex1.position;
+	geometry.normal = vertex1.normal;
+	return geometry;
+}
+
+int SceneBVH::findMaterial(const Material& material, std::map<std::vector<char>, int>& known)
+{
+	const char* bytes = reinterpret_cast<const char*>(&material);
+	auto [it, inserted] = known.try_emplace(std::vector<char>(bytes, bytes + sizeof(Material)), int(materials.size()));
+	if (inserted) {
+		materials.push_back(material);
+	}
+	return it->second;
+}
+
+ScenePrimitiveSource SceneBVH::getPrimitiveSource(int primitive) const
+{
+	// The last mesh that starts at or before the primitive
+	auto mesh = std::upper_bound(meshes.begin(), meshes.end(), primitive, [](int index, const MeshEntry& entry) {
+		return index < entry.firstPrimitive;
+	}) - 1;
+	ScenePrimitiveSource source;
+	source.mesh = mesh - meshes.begin();
+	// The index buffer of the tree is exactly the leaf order, so it doubles as the remap table
+	source.primitive = mesh->tree->getIndices()[primitive - mesh->firstPrimitive];
+	return source;
+}
+
+int SceneBVH::getCachedMeshCount() const
+{
+	return std::count_if(meshes.begin(), meshes.end(), [](const MeshEntry& mesh) {
+		return mesh.tree && mesh.tree->wasLoadedFromCache();
+	});
+}
+
+BVHStats SceneBVH::getMeshStats(int mesh) const
+{
+	return meshes[mesh].tree->computeStats();
+}
+
+BVHStats SceneBVH::getTopLevelStats() const
+{
+	// The leaves point into the instance array instead of an index buffer
+	BVHStats stats = BVHStats::compute(topLevelNodes, {}, gpuInstances.size());
+	stats.referenceCount = gpuInstances.size();
+	stats.buildTimings.hierarchyMs = topLevelBuildTimeMs;
+	stats.buildTimings.totalMs = topLevelBuildTimeMs;
+	return stats;
+}
+
+bool SceneBVH::writeStatsJson(const std::string& path) const
+{
+	std::ofstream out(path, std::ios::trunc);
+	if (!out.is_open()) {
+		std::cerr << "Failed to write BVH statistics: " << path << std::endl;
+		return false;
+	}
+	out << "{\n  \"buildTimeMs\": " << buildTimeMs << ",\n";
+	out << "  \"wideNodes\": { \"format\": \"" << (builtNodeFormat == BVHNodeFormat::Quantized ? "quantized" : "full")
+		<< "\", \"width\": " << GPU_BVH_WIDTH << ", \"count\": " << nodeCount << ", \"bytes\": " << nodeCount * getNodeSize() << " },\n";
+	out << "  \"meshes\": [";
+	for (int i = 0; i < getMeshCount(); i++) {
+		out << (i > 0 ? ",\n    " : "\n    ") << getMeshStats(i).toJson(4);
+	}
+	out << "\n  ],\n  \"topLevel\": " << getTopLevelStats().toJson(2) << "\n}\n";
+	return out.good();
+}
+
+AABB SceneBVH::worldBounds(const Instance& instance) const
+{
+	AABB bounds;
+	ArrayView<const BVHNode> meshNodes = meshes[instance.mesh].tree->getNodes();
+	if (meshNodes.empty()) {
+		return bounds; // Empty, no ray enters it
+	}
+
+	// The box around the transformed corners of the mesh's root box
+	const BVHNode& root = meshNodes[0];
+	for (int corner = 0; corner < 8; corner++) {
+		vec3 point((corner & 1) ? root.bBoxMax.x : root.bBoxMin.x,
+			(corner & 2) ? root.bBoxMax.y : root.bBoxMin.y,
+			(corner & 4) ? root.bBoxMax.z : root.bBoxMin.z);
+		point = instance.objectToWorld * point;
+		bounds.min = vec3::min(bounds.min, point);
+		bounds.max = vec3::max(bounds.max, point);
+	}
+	return bounds;
+}
+
+void SceneBVH::buildTopLevel()
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	topLevelNodes.clear();
+	gpuInstances.clear();
+	instanceOrder.resize(instances.size());
+	std::iota(instanceOrder.begin(), instanceOrder.end(), 0);
+
+	if (!instances.empty()) {
+		std::vector<AABB> bounds(instances.size());
+		for (int i = 0; i < int(instances.size()); i++) {
+			bounds[i] = worldBounds(instances[i]);
+		}
+		topLevelNodes.reserve(2 * instances.size());
+		buildTopLevelRecursive(bounds, 0, instances.size());
+	}
+
+	// Kept for refitInstance(), which walks from a leaf up to the root
+	topLevelParents.assign(topLevelNodes.size(), -1);
+	instanceLeaves.assign(instances.size(), -1);
+	for (int i = 0; i < int(topLevelNodes.size()); i++) {
+		const BVHNode& node = topLevelNodes[i];
+		if (node.leftChild == -1) {
+			instanceLeaves[instanceOrder[node.startTriangle]] = i;
+		}
+		else {
+			topLevelParents[node.leftChild] = i;
+			topLevelParents[node.rightChild] = i;
+		}
+	}
+	topLevelSAHCost = computeTopLevelSAHCost();
+	topLevelBuildSAHCost = topLevelSAHCost;
+
+	// The leaves point into gpuInstances, which therefore follows the reordered instanceOrder
+	for (int id : instanceOrder) {
+		const Instance& instance = instances[id];
+		const MeshEntry& mesh = meshes[instance.mesh];
+		BVHInstance gpuInstance;
+		copyColumnMajor(instance.worldToObject, gpuInstance.worldToObject);
+		copyColumnMajor(instance.objectToWorld, gpuInstance.objectToWorld);
+		gpuInstance.firstNode = mesh.firstNode;
+		gpuInstance.nodeCount = mesh.wideTree.getNodeCount();
+		gpuInstance.firstPrimitive = mesh.bufferOffset;
+		gpuInstance.firstVertex = mesh.firstVertex;
+		gpuInstances.push_back(gpuInstance);
+	}
+
+	topLevelBuildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+SceneRefitResult SceneBVH::refitInstance(int instance, const mat4& modelMatrix)
+{
+	SceneRefitResult result;
+	setInstanceTransform(instance, modelMatrix);
+	// An instance added since the last build has no leaf yet
+	if (instance >= int(instanceLeaves.size())) {
+		buildTopLevel();
+		result.rebuilt = true;
+		return result;
+	}
+
+	int slot = topLevelNodes[instanceLeaves[instance]].startTriangle;
+	copyColumnMajor(instances[instance].worldToObject, gpuInstances[slot].worldToObject);
+	copyColumnMajor(instances[instance].objectToWorld, gpuInstances[slot].objectToWorld);
+
+	// The nodes are in pre-order, so the ancestors that changed lie in one range ending at the leaf.
+	// The walk stops at the first box that stays the same, as nothing above it changes either.
+	int leaf = instanceLeaves[instance];
+	AABB bounds = worldBounds(instances[instance]);
+	topLevelNodes[leaf].bBoxMin = bounds.min;
+	topLevelNodes[leaf].bBoxMax = bounds.max;
+	int firstNode = leaf;
+	for (int parent = topLevelParents[leaf]; parent >= 0; parent = topLevelParents[parent]) {
+		BVHNode& node = topLevelNodes[parent];
+		const BVHNode& left = topLevelNodes[node.leftChild];
+		const BVHNode& right = topLevelNodes[node.rightChild];
+		vec3 boxMin = vec3::min(left.bBoxMin, right.bBoxMin);
+		vec3 boxMax = vec3::max(left.bBoxMax, right.bBoxMax);
+		if (sameBox(node, boxMin, boxMax)) {
+			break;
+		}
+		node.bBoxMin = boxMin;
+		node.bBoxMax = boxMax;
+		firstNode = parent;
+	}
+
+	topLevelSAHCost = computeTopLevelSAHCost();
+	if (topLevelSAHCost > topLevelBuildSAHCost * settings.refitRebuildRatio) {
+		buildTopLevel();
+		result.rebuilt = true;
+		return result;
+	}
+	result.instanceSlot = slot;
+	result.firstNode = firstNode;
+	result.nodeCount = leaf - firstNode + 1;
+	return result;
+}
+
+// Same cost model as BVHStats, relative to the surface area of the root
+float SceneBVH::computeTopLevelSAHCost() const
+{
+	if (topLevelNodes.empty()) {
+		return 0.0f;
+	}
+	float rootArea = surfaceArea({ topLevelNodes[0].bBoxMin, topLevelNodes[0].bBoxMax });
+	if (rootArea <= 0.0f) {
+		return 0.0f;
+	}
+
+	float Ct = 0.5f;
+	float Ci = 1.0f;
+	double cost = 0.0;
+	for (const BVHNode& node : topLevelNodes) {
+		float area = surfaceArea({ node.bBoxMin, node.bBoxMax });
+		cost += node.leftChild == -1 ? Ci * node.triangleCount * area : Ct * area;
+	}
+	return float(cost / rootArea);
+}
+
+// There are few instances, so a median split with one instance per leaf is good enough.
+// Written straight in pre-order with the same escapeIndex scheme as BVHTree::flattenRecursive.
+int SceneBVH::buildTopLevelRecursive(const std::vector<AABB>& bounds, int start, int count)
+{
+	int nodeIndex = topLevelNodes.size();
+	topLevelNodes.push_back({});
+
+	AABB nodeBounds;
+	AABB centroidBounds;
+	for (int i = start; i < start + count; i++) {
+		expandAABB(nodeBounds, bounds[instanceOrder[i]]);
+		vec3 centroid = centerOfAABB(bounds[instanceOrder[i]]);
+		expandAABB(centroidBounds, { centroid, centroid });
+	}
+	topLevelNodes[nodeIndex].bBoxMin = nodeBounds.min;
+	topLevelNodes[nodeIndex].bBoxMax = nodeBounds.max;
+	topLevelNodes[nodeIndex].pad1 = 0;
+
+	if (count == 1) {
+		topLevelNodes[nodeIndex].leftChild = -1;
+		topLevelNodes[nodeIndex].rightChild = -1;
+		topLevelNodes[nodeIndex].startTriangle = start;
+		topLevelNodes[nodeIndex].triangleCount = 1;
+		topLevelNodes[nodeIndex].escapeIndex = nodeIndex + 1;
+		return nodeIndex;
+	}
+
+	int axis = longestAxis(centroidBounds);
+	int mid = start + count / 2;
+	std::nth_element(instanceOrder.begin() + start, instanceOrder.begin() + mid, instanceOrder.begin() + start + count,
+		[&](int a, int b) {
+			return centerOfAABB(bounds[a])[axis] < centerOfAABB(bounds[b])[axis];
+		});
+
+	int leftChild = buildTopLevelRecursive(bounds, start, mid - start);
+	int rightChild = buildTopLevelRecursive(bounds, mid, start + count - mid);
+
+	topLevelNodes[nodeIndex].leftChild = leftChild;
+	topLevelNodes[nodeIndex].rightChild = rightChild;
+	topLevelNodes[nodeIndex].startTriangle = -1;
+	topLevelNodes[nodeIndex].triangleCount = 0;
+	topLevelNodes[leftChild].escapeIndex = rightChild;
+	topLevelNodes[nodeIndex].escapeIndex = topLevelNodes.size();
+	topLevelNodes[rightChild].escapeIndex = topLevelNodes[nodeIndex].escapeIndex;
+	return nodeIndex;
+}
+
+SceneHit SceneBVH::intersect(const vec3& origin, const vec3& direction, bool includeGlass) const
+{
+	SceneHit closest;
+	float closestT = 1e30f;
+	vec3 directionInv(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+
+	int topIndex = 0;
+	while (topIndex < int(topLevelNodes.size())) {
+		const BVHNode& topNode = topLevelNodes[topIndex];
+		if (intersectBox(origin, directionInv, topNode) >= closestT) {
+			topIndex = topNode.escapeIndex;
+			continue;
+		}
+		if (topNode.triangleCount == 0) {
+			topIndex = topNode.leftChild;
+			continue;
+		}
+
+		for (int instanceIndex = topNode.startTriangle; instanceIndex < topNode.startTriangle + topNode.triangleCount; instanceIndex++) {
+			const Instance& instance = instances[instanceOrder[instanceIndex]];
+			const MeshEntry& mesh = meshes[instance.mesh];
+
+			// The direction is not normalized again, so t means the same in both spaces
+			vec3 localOrigin = instance.worldToObject * origin;
+			vec3 localDirection = instance.worldToObject * (origin + direction) - localOrigin;
+			vec3 localDirectionInv(1.0f / localDirection.x, 1.0f / localDirection.y, 1.0f / localDirection.z);
+
+			mesh.wideTree.traverse(localOrigin, localDirectionInv, closestT, [&](int start, int count) {
+				for (int i = start; i < start + count; i++) {
+					PrimitiveGeometry primitive = loadPrimitive(mesh, i);
+					if (materials[primitive.material].materialType == 2 && !includeGlass) { // Glass does not cast shadows
+						continue;
+					}
+					float t = primitive.ID == 0
+						? intersectTriangle(localOrigin, localDirection, primitive)
+						: intersectSphere(localOrigin, localDirection, primitive);
+					if (t > 0.0f && t < closestT) {
+						closestT = t;
+						closest.t = t;
+						closest.primitive = mesh.firstPrimitive + i;
+						closest.instance = instanceIndex;
+					}
+				}
+			});
+		}
+		topIndex = topNode.escapeIndex;
+	}
+	return closest;
+}
+
+SceneSurface SceneBVH::getSurface(const SceneHit& hit) const
+{
+	const Instance& instance = instances[instanceOrder[hit.instance]];
+	const MeshEntry& mesh = meshes[instance.mesh];
+	PrimitiveGeometry primitive = loadPrimitive(mesh, hit.primitive - mesh.firstPrimitive);
+
+	SceneSurface surface;
+	surface.vertex1 = instance.objectToWorld * primitive.vertex1;
+	surface.ID = primitive.ID;
+	// Normals go through the inverse transpose, which keeps them perpendicular under non-uniform scaling
+	surface.normal = normalize(MultMat3Vec3(TransposeMat3(mat3(instance.worldToObject)), unpackNormal(primitive.normal)));
+	surface.material = materials[primitive.material];
+	return surface;
+}
@@ -0,0 +1,182 @@
+#include "SceneBVH.h"
+#include "RayIntersection.h"
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PACKET_X86 1
+#include <immintrin.h>
+#endif
+
+// The kernels of PacketKernel.h, one per instruction set. They need the private trees of SceneBVH.
+struct PacketTraversal {
+	static void intersectSSE2(const SceneBVH& scene, const vec3* origins, const vec3* directions, int count, SceneHit* hits, bool includeGlass);
+	static void intersectAVX2(const SceneBVH& scene, const vec3* origins, const vec3* directions, int count, SceneHit* hits, bool includeGlass);
+	static void intersectAVX512(const SceneBVH& scene, const vec3* origins, const vec3* directions, int count, SceneHit* hits, bool includeGlass);
+};
+
+#ifdef PACKET_X86
+
+// GCC and Clang only emit the wider instructions in functions that ask for them. MSVC emits any
+// intrinsic anywhere, so it needs nothing.
+#if defined(__GNUC__)
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+#else
+#define SSE2_TARGET
+#define AVX2_TARGET
+#define AVX512_TARGET
+#endif
+
+// Each namespace gives the kernel the same small vocabulary: Float holds one float per ray, Mask one
+// flag per ray, bits() turns a Mask into an int with bit i for lane i.
+
+namespace packetSSE2 {
+	struct Float { __m128 v; };
+	struct Mask { __m128 v; };
+
+	SSE2_TARGET inline Float broadcast(float x) { return { _mm_set1_ps(x) }; }
+	SSE2_TARGET inline Float load(const float* p) { return { _mm_load_ps(p) }; }
+	SSE2_TARGET inline void store(float* p, Float a) { _mm_store_ps(p, a.v); }
+	SSE2_TARGET inline Float operator+(Float a, Float b) { return { _mm_add_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Float operator-(Float a, Float b) { return { _mm_sub_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Float operator*(Float a, Float b) { return { _mm_mul_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Float operator/(Float a, Float b) { return { _mm_div_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Float min(Float a, Float b) { return { _mm_min_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Float max(Float a, Float b) { return { _mm_max_ps(a.v, b.v) }; }
+
+	SSE2_TARGET inline Mask operator<(Float a, Float b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Mask operator<=(Float a, Float b) { return { _mm_cmple_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Mask operator>(Float a, Float b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Mask operator>=(Float a, Float b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+	SSE2_TARGET inline Mask operator&(Mask a, Mask b) { return { _mm_and_ps(a.v, b.v) }; }
+	SSE2_TARGET inline int bits(Mask m) { return _mm_movemask_ps(m.v); }
+	// a where m is set, else b
+	SSE2_TARGET inline Float select(Mask m, Float a, Float b) { return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) }; }
+}
+
+namespace packetAVX2 {
+	struct Float { __m256 v; };
+	struct Mask { __m256 v; };
+
+	AVX2_TARGET inline Float broadcast(float x) { return { _mm256_set1_ps(x) }; }
+	AVX2_TARGET inline Float load(const float* p) { return { _mm256_load_ps(p) }; }
+	AVX2_TARGET inline void store(float* p, Float a) { _mm256_store_ps(p, a.v); }
+	AVX2_TARGET inline Float operator+(Float a, Float b) { return { _mm256_add_ps(a.v, b.v) }; }
+	AVX2_TARGET inline Float operator-(Float a, Float b) { return { _mm256_sub_ps(a.v, b.v) }; }
+	AVX2_TARGET inline Float operator*(Float a, Float b) { return { _mm256_mul_ps(a.v, b.v) }; }
+	AVX2_TARGET inline Float operator/(Float a, Float b) { return { _mm256_div_ps(a.v, b.v) }; }
+	AVX2_TARGET inline Float min(Float a, Float b) { return { _mm256_min_ps(a.v, b.v) }; }
+	AVX2_TARGET inline Float max(Float a, Float b) { return { _mm256_max_ps(a.v, b.v) }; }
+
+	AVX2_TARGET inline Mask operator<(Float a, Float b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+	AVX2_TARGET inline Mask operator<=(Float a, Float b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+	AVX2_TARGET inline Mask operator>(Float a, Float b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+	AVX2_TARGET inline Mask operator>=(Float a, Float b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+	AVX2_TARGET inline Mask operator&(Mask a, Mask b) { return { _mm256_and_ps(a.v, b.v) }; }
+	AVX2_TARGET inline int bits(Mask m) { return _mm256_movemask_ps(m.v); }
+	AVX2_TARGET inline Float select(Mask m, Float a, Float b) { return { _mm256_blendv_ps(b.v, a.v, m.v) }; }
+}
+
+// GCC 12 warns that _mm512_undefined_ps() in its own avx512fintrin.h may be used uninitialized when
+// min and max are inlined into the kernel. The value is never read, the warning is a known false
+// positive of the header, so it is silenced for the AVX-512 code only.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+namespace packetAVX512 {
+	struct Float { __m512 v; };
+	struct Mask { __mmask16 v; };
+
+	AVX512_TARGET inline Float broadcast(float x) { return { _mm512_set1_ps(x) }; }
+	AVX512_TARGET inline Float load(const float* p) { return { _mm512_load_ps(p) }; }
+	AVX512_TARGET inline void store(float* p, Float a) { _mm512_store_ps(p, a.v); }
+	AVX512_TARGET inline Float operator+(Float a, Float b) { return { _mm512_add_ps(a.v, b.v) }; }
+	AVX512_TARGET inline Float operator-(Float a, Float b) { return { _mm512_sub_ps(a.v, b.v) }; }
+	AVX512_TARGET inline Float operator*(Float a, Float b) { return { _mm512_mul_ps(a.v, b.v) }; }
+	AVX512_TARGET inline Float operator/(Float a, Float b) { return { _mm512_div_ps(a.v, b.v) }; }
+	AVX512_TARGET inline Float min(Float a, Float b) { return { _mm512_min_ps(a.v, b.v) }; }
+	AVX512_TARGET inline Float max(Float a, Float b) { return { _mm512_max_ps(a.v, b.v) }; }
+
+	AVX512_TARGET inline Mask operator<(Float a, Float b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+	AVX512_TARGET inline Mask operator<=(Float a, Float b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+	AVX512_TARGET inline Mask operator>(Float a, Float b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+	AVX512_TARGET inline Mask operator>=(Float a, Float b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+	AVX512_TARGET inline Mask operator&(Mask a, Mask b) { return { __mmask16(a.v & b.v) }; }
+	AVX512_TARGET inline int bits(Mask m) { return int(m.v); }
+	AVX512_TARGET inline Float select(Mask m, Float a, Float b) { return { _mm512_mask_blend_ps(m.v, b.v, a.v) }; }
+}
+
+#define PACKET_NAMESPACE packetSSE2
+#define PACKET_TARGET SSE2_TARGET
+#define PACKET_WIDTH 4
+#define PACKET_FUNCTION intersectSSE2
+#include "PacketKernel.h"
+#undef PACKET_NAMESPACE
+#undef PACKET_TARGET
+#undef PACKET_WIDTH
+#undef PACKET_FUNCTION
+
+#define PACKET_NAMESPACE packetAVX2
+#define PACKET_TARGET AVX2_TARGET
+#define PACKET_WIDTH 8
+#define PACKET_FUNCTION intersectAVX2
+#include "PacketKernel.h"
+#undef PACKET_NAMESPACE
+#undef PACKET_TARGET
+#undef PACKET_WIDTH
+#undef PACKET_FUNCTION
+
+#define PACKET_NAMESPACE packetAVX512
+#define PACKET_TARGET AVX512_TARGET
+#define PACKET_WIDTH 16
+#define PACKET_FUNCTION intersectAVX512
+#include "PacketKernel.h"
+#undef PACKET_NAMESPACE
+#undef PACKET_TARGET
+#undef PACKET_WIDTH
+#undef PACKET_FUNCTION
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#else
+
+// Never called, detectSIMDLevel() gives Scalar on other architectures
+void PacketTraversal::intersectSSE2(const SceneBVH&, const vec3*, const vec3*, int, SceneHit*, bool) {}
+void PacketTraversal::intersectAVX2(const SceneBVH&, const vec3*, const vec3*, int, SceneHit*, bool) {}
+void PacketTraversal::intersectAVX512(const SceneBVH&, const vec3*, const vec3*, int, SceneHit*, bool) {}
+
+#endif
+
+void SceneBVH::intersectPacket(const vec3* origins, const vec3* directions, int count, SceneHit* hits, bool includeGlass) const
+{
+	int width = simdLevelWidth(packetLevel);
+	for (int first = 0; first < count; first += width) {
+		int packetCount = std::min(width, count - first);
+		switch (packetLevel) {
+		case SIMDLevel::SSE2:
+			PacketTraversal::intersectSSE2(*this, origins + first, directions + first, packetCount, hits + first, includeGlass);
+			break;
+		case SIMDLevel::AVX2:
+			PacketTraversal::intersectAVX2(*this, origins + first, directions + first, packetCount, hits + first, includeGlass);
+			break;
+		case SIMDLevel::AVX512:
+			PacketTraversal::intersectAVX512(*this, origins + first, directions + first, packetCount, hits + first, includeGlass);
+			break;
+		default:
+			hits[first] = intersect(origins[first], directions[first], includeGlass);
+			break;
+		}
+	}
+}
+
+void SceneBVH::setPacketLevel(SIMDLevel level)
+{
+	packetLevel = std::min(level, detectSIMDLevel());
+}
@@ -22,6 +22,19 @@ std::string Shader::readShaderFile(const char* filePath) {
     return shaderStream.str();
 }
 
+std::string Shader::insertDefines(const std::string& source, const std::string& defines) {
+    // Nothing may come before #version
+    size_t versionLine = source.find("#version");
+    if (defines.empty() || versionLine == std::string::npos) {
+        return defines + source;
+    }
+    size_t lineEnd = source.find('\n', versionLine);
+    if (lineEnd == std::string::npos) {
+        return source + "\n" + defines;
+    }
+    return source.substr(0, lineEnd + 1) + defines + source.substr(lineEnd + 1);
+}
+
 unsigned int Shader::compileShader(const char* shaderSource, GLenum shaderType) {
     // Create the shader
     unsigned int shader = glCreateShader(shaderType);
@@ -0,0 +1,126 @@
+#include "ThreadPool.h"
+
+namespace {
+	// Lets a thread find its own queue without a lookup. Threads outside the pool use queue 0.
+	thread_local const ThreadPool* tlsPool = nullptr;
+	thread_local int tlsQueue = 0;
+}
+
+ThreadPool::ThreadPool(int threadCount)
+{
+	this->threadCount = threadCount > 0 ? threadCount : hardwareThreads();
+
+	for (int i = 0; i < this->threadCount; i++) {
+		queues.push_back(std::make_unique<WorkQueue>());
+	}
+	for (int i = 1; i < this->threadCount; i++) {
+		workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+int ThreadPool::hardwareThreads()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+int ThreadPool::currentQueue() const
+{
+	return tlsPool == this ? tlsQueue : 0;
+}
+
+void ThreadPool::submit(TaskGroup& group, std::function<void()> task)
+{
+	group.pending++;
+
+	WorkQueue& queue = *queues[currentQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back([&group, task = std::move(task)]() {
+			task();
+			group.pending--;
+		});
+	}
+	queuedTasks++;
+
+	if (!workers.empty()) {
+		// Taking the lock orders the push before a worker re-checks its sleep condition
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		wakeUp.notify_one();
+	}
+}
+
+bool ThreadPool::popOrSteal(int queueIndex, std::function<void()>& task)
+{
+	// Own work is taken LIFO to stay cache warm...
+	{
+		WorkQueue& own = *queues[queueIndex];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			queuedTasks--;
+			return true;
+		}
+	}
+
+	// ...while stolen work is taken FIFO, which tends to be the largest chunk left in that queue.
+	for (int i = 1; i < threadCount; i++) {
+		WorkQueue& victim = *queues[(queueIndex + i) % threadCount];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			queuedTasks--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::wait(TaskGroup& group)
+{
+	int queueIndex = currentQueue();
+	std::function<void()> task;
+
+	while (group.pending > 0) {
+		if (popOrSteal(queueIndex, task)) {
+			task();
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void ThreadPool::workerLoop(int queueIndex)
+{
+	tlsPool = this;
+	tlsQueue = queueIndex;
+
+	std::function<void()> task;
+	while (true) {
+		if (popOrSteal(queueIndex, task)) {
+			task();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeUp.wait(lock, [this]() { return stopping || queuedTasks > 0; });
+		if (stopping) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#include "ToolSupport.h"
+#include "Scene.h"
+#include "SceneBVH.h"
+#include <algorithm>
+#include <cstdio>
+
+bool ToolSupport::parseOptions(int argc, char** argv, const std::vector<std::string>& flags, const OptionHandler& handler)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string name = argv[i];
+		const char* value = nullptr;
+		if (std::find(flags.begin(), flags.end(), name) == flags.end()) {
+			if (i + 1 >= argc) {
+				std::fprintf(stderr, "Missing value for %s\n", name.c_str());
+				return false;
+			}
+			value = argv[++i];
+		}
+		OptionResult result = handler(name, value);
+		if (result == OptionResult::Unknown) {
+			std::fprintf(stderr, "Unknown option %s\n", name.c_str());
+			return false;
+		}
+		if (result == OptionResult::Invalid) {
+			std::fprintf(stderr, "Invalid value for %s: %s\n", name.c_str(), value ? value : "");
+			return false;
+		}
+	}
+	return true;
+}
+
+double ToolSupport::msSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string ToolSupport::jsonString(const std::string& text)
+{
+	std::string quoted = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			quoted += '\\';
+		}
+		quoted += c;
+	}
+	return quoted + "\"";
+}
+
+void ToolSupport::addSceneToBVH(SceneBVH& sceneBVH, const Scene& scene)
+{
+	if (!scene.primitives.empty()) {
+		sceneBVH.addInstance(sceneBVH.addMesh(scene.primitives), IdentityMatrix());
+	}
+	for (const IndexedMesh& model : scene.models) {
+		sceneBVH.addInstance(sceneBVH.addMesh(model), IdentityMatrix());
+	}
+}
@@ -0,0 +1,159 @@
+#include "WideBVH.h"
+#include "BoundingHelper.h"
+#include <cmath>
+
+template<int Width>
+void WideBVH<Width>::build(ArrayView<const BVHNode> binaryNodes, BVHNodeFormat nodeFormat)
+{
+	nodes.clear();
+	quantizedNodes.clear();
+	format = nodeFormat;
+	depth = 0;
+	if (binaryNodes.empty()) {
+		return;
+	}
+	// A binary tree with n leaves collapses into at most n - 1 wide nodes
+	nodes.reserve(binaryNodes.size() / 2 + 1);
+	collapseRecursive(binaryNodes, 0, 1);
+
+	if (format == BVHNodeFormat::Quantized) {
+		quantizedNodes.reserve(nodes.size());
+		for (const WideBVHNode<Width>& node : nodes) {
+			quantizedNodes.push_back(quantize(node));
+		}
+		nodes.clear();
+		nodes.shrink_to_fit();
+	}
+	else {
+		nodes.shrink_to_fit();
+	}
+}
+
+// Every decoded plane is checked with the same float operations as decode() and the shader, and
+// moved outwards a step until it is on the safe side, so rounding can never shrink a box.
+template<int Width>
+QuantizedWideBVHNode<Width> WideBVH<Width>::quantize(const WideBVHNode<Width>& node)
+{
+	QuantizedWideBVHNode<Width> quantized = {};
+	float origin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float extent[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	const float* mins[3] = { node.minX, node.minY, node.minZ };
+	const float* maxs[3] = { node.maxX, node.maxY, node.maxZ };
+	uint32_t* qMins[3] = { quantized.qMinX, quantized.qMinY, quantized.qMinZ };
+	uint32_t* qMaxs[3] = { quantized.qMaxX, quantized.qMaxY, quantized.qMaxZ };
+
+	int childCount = 0;
+	while (childCount < Width && node.count[childCount] >= 0) {
+		for (int axis = 0; axis < 3; axis++) {
+			origin[axis] = std::min(origin[axis], mins[axis][childCount]);
+			extent[axis] = std::max(extent[axis], maxs[axis][childCount]);
+		}
+		childCount++;
+	}
+
+	for (int axis = 0; axis < 3; axis++) {
+		float top = extent[axis];
+		// The smallest step for which 255 steps reach the top of the node, found from log2 of the extent
+		uint32_t biasedExponent = 1;
+		if (top > origin[axis]) {
+			biasedExponent = std::clamp(std::ilogb((top - origin[axis]) / 255.0f) + 127, 1, 254);
+			while (biasedExponent < 254 && origin[axis] + 255.0f * quantizationStep(biasedExponent) < top) {
+				biasedExponent++;
+			}
+		}
+		quantized.exponents |= biasedExponent << (8 * axis);
+		float step = quantizationStep(biasedExponent);
+
+		for (int i = 0; i < childCount; i++) {
+			int qMin = std::clamp(int(std::floor((mins[axis][i] - origin[axis]) / step)), 0, 255);
+			while (qMin > 0 && origin[axis] + float(qMin) * step > mins[axis][i]) {
+				qMin--;
+			}
+			int qMax = std::clamp(int(std::ceil((maxs[axis][i] - origin[axis]) / step)), 0, 255);
+			while (qMax < 255 && origin[axis] + float(qMax) * step < maxs[axis][i]) {
+				qMax++;
+			}
+			qMins[axis][i / 4] |= uint32_t(qMin) << ((i % 4) * 8);
+			qMaxs[axis][i / 4] |= uint32_t(qMax) << ((i % 4) * 8);
+		}
+	}
+	quantized.originX = origin[0];
+	quantized.originY = origin[1];
+	quantized.originZ = origin[2];
+	for (int i = 0; i < Width; i++) {
+		quantized.child[i] = node.child[i];
+		quantized.count[i] = node.count[i];
+	}
+	return quantized;
+}
+
+// The children of a wide node are found by opening the binary node with the largest surface area
+// among the current children until there are Width of them, the same greedy rule as in the
+// treelet optimization. Large boxes are the ones most rays enter, so they gain most from being skipped.
+template<int Width>
+int WideBVH<Width>::collapseRecursive(ArrayView<const BVHNode> binaryNodes, int binaryIndex, int nodeDepth)
+{
+	depth = std::max(depth, nodeDepth);
+	int nodeIndex = nodes.size();
+	nodes.emplace_back();
+
+	const BVHNode& binaryNode = binaryNodes[binaryIndex];
+	int children[Width];
+	int childCount = 0;
+	if (binaryNode.leftChild == -1) {
+		children[childCount++] = binaryIndex; // The root is a leaf
+	}
+	else {
+		children[childCount++] = binaryNode.leftChild;
+		children[childCount++] = binaryNode.rightChild;
+	}
+	while (childCount < Width) {
+		int largest = -1;
+		float largestArea = -1.0f;
+		for (int i = 0; i < childCount; i++) {
+			const BVHNode& candidate = binaryNodes[children[i]];
+			float area = surfaceArea({ candidate.bBoxMin, candidate.bBoxMax });
+			if (candidate.leftChild != -1 && area > largestArea) {
+				largest = i;
+				largestArea = area;
+			}
+		}
+		if (largest < 0) {
+			break;
+		}
+		const BVHNode& opened = binaryNodes[children[largest]];
+		children[largest] = opened.leftChild;
+		children[childCount++] = opened.rightChild;
+	}
+
+	// Filled locally, nodes may grow while the children are collapsed
+	WideBVHNode<Width> node;
+	for (int i = 0; i < Width; i++) {
+		node.minX[i] = node.minY[i] = node.minZ[i] = 0.0f;
+		node.maxX[i] = node.maxY[i] = node.maxZ[i] = 0.0f;
+		node.child[i] = -1;
+		node.count[i] = -1;
+	}
+	for (int i = 0; i < childCount; i++) {
+		const BVHNode& child = binaryNodes[children[i]];
+		node.minX[i] = child.bBoxMin.x;
+		node.minY[i] = child.bBoxMin.y;
+		node.minZ[i] = child.bBoxMin.z;
+		node.maxX[i] = child.bBoxMax.x;
+		node.maxY[i] = child.bBoxMax.y;
+		node.maxZ[i] = child.bBoxMax.z;
+		if (child.leftChild == -1) {
+			node.child[i] = child.startTriangle;
+			node.count[i] = child.triangleCount;
+		}
+		else {
+			node.child[i] = collapseRecursive(binaryNodes, children[i], nodeDepth + 1);
+			node.count[i] = 0;
+		}
+	}
+	nodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -0,0 +1,164 @@
+// Renders a scene on the CPU without a window or a GPU and writes the image, for batch rendering on
+// machines without a display. Run from the build directory like the application, so the presets
+// find ../models. Usage: HeadlessRender [options]
+//   --scene N            Preset 0-4 as in the UI (0)
+//   --model FILE         An .obj or .mesh under the light of the model scenes instead of a preset
+//   --position X,Y,Z     Camera position (0,0,-1)
+//   --forward X,Y,Z      Camera direction (0,0,1)
+//   --fov DEGREES        Vertical field of view (80)
+//   --size WxH           Resolution (800x600)
+//   --spp N              Samples per pixel (64)
+//   --bounces N          Max bounces (5)
+//   --threads N          Render and build threads, 0 for all (0)
+//   --output NAME        Writes NAME.pfm, linear HDR, and NAME.ppm, 8-bit like the window (render)
+#define MAIN
+#include "VectorUtils4.h"
+#include "CPUPathTracer.h"
+#include "ImageFile.h"
+#include "Scene.h"
+#include "ToolSupport.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace {
+	struct Options {
+		int scene = 0;
+		std::string model;
+		vec3 position = vec3(0.0f, 0.0f, -1.0f);
+		vec3 forward = vec3(0.0f, 0.0f, 1.0f);
+		float fov = 80.0f;
+		int width = 800;
+		int height = 600;
+		int samplesPerPixel = 64;
+		int maxBounces = 5;
+		int threads = 0;
+		std::string output = "render";
+	};
+
+	bool parseVec3(const char* text, vec3& value)
+	{
+		return std::sscanf(text, "%f,%f,%f", &value.x, &value.y, &value.z) == 3;
+	}
+
+	bool parseOptions(int argc, char** argv, Options& options)
+	{
+		return ToolSupport::parseOptions(argc, argv, {}, [&](const std::string& name, const char* value) {
+			bool valid = true;
+			if (name == "--scene") {
+				options.scene = std::atoi(value);
+				valid = options.scene >= 0 && options.scene <= 4;
+			}
+			else if (name == "--model") {
+				options.model = value;
+			}
+			else if (name == "--position") {
+				valid = parseVec3(value, options.position);
+			}
+			else if (name == "--forward") {
+				valid = parseVec3(value, options.forward) && Norm(options.forward) > 0.0f;
+			}
+			else if (name == "--fov") {
+				options.fov = float(std::atof(value));
+				valid = options.fov > 0.0f && options.fov < 180.0f;
+			}
+			else if (name == "--size") {
+				valid = std::sscanf(value, "%dx%d", &options.width, &options.height) == 2 && options.width > 0 && options.height > 0;
+			}
+			else if (name == "--spp") {
+				options.samplesPerPixel = std::atoi(value);
+				valid = options.samplesPerPixel > 0;
+			}
+			else if (name == "--bounces") {
+				options.maxBounces = std::atoi(value);
+				valid = options.maxBounces > 0;
+			}
+			else if (name == "--threads") {
+				options.threads = std::atoi(value);
+				valid = options.threads >= 0;
+			}
+			else if (name == "--output") {
+				options.output = value;
+			}
+			else {
+				return ToolSupport::OptionResult::Unknown;
+			}
+			return valid ? ToolSupport::OptionResult::Valid : ToolSupport::OptionResult::Invalid;
+		});
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		std::fprintf(stderr, "Usage: %s [--scene N | --model FILE] [--position X,Y,Z] [--forward X,Y,Z] [--fov DEGREES]\n"
+			"  [--size WxH] [--spp N] [--bounces N] [--threads N] [--output NAME]\n", argv[0]);
+		return 1;
+	}
+	auto totalStart = std::chrono::steady_clock::now();
+
+	// The scene is put together like Application::BindBuffersPathtraced does it
+	auto start = std::chrono::steady_clock::now();
+	Scene scene(options.model.empty() ? options.scene : -1);
+	if (!options.model.empty()) {
+		scene.CreateSceneFromModel(options.model);
+	}
+	// Rendering what is left would write a frame without the model and look like a success
+	if (!scene.missingModels.empty()) {
+		std::fprintf(stderr, "Cannot render without %s\n", scene.missingModels[0].c_str());
+		return 1;
+	}
+	double loadMs = ToolSupport::msSince(start);
+
+	SceneBVH sceneBVH;
+	sceneBVH.setCacheDirectory("bvhcache");
+	sceneBVH.setThreadCount(options.threads);
+	ToolSupport::addSceneToBVH(sceneBVH, scene);
+	sceneBVH.build();
+
+	Camera camera(options.position, options.forward, vec3(0.0f, 1.0f, 0.0f), options.fov, options.width, options.height);
+	CPUPathTracer tracer(sceneBVH, scene.areaLights, scene.pointLights);
+	CPURenderSettings settings;
+	settings.width = options.width;
+	settings.height = options.height;
+	settings.samplesPerPixel = 1;
+	settings.maxBounces = options.maxBounces;
+	settings.threadCount = options.threads;
+	tracer.setSettings(settings);
+
+	// One sample per frame like the window, so the progress can be shown as the frames come in
+	std::printf("Rendering %dx%d, %d samples per pixel, %d bounces, %s packets\n", options.width, options.height,
+		options.samplesPerPixel, options.maxBounces, simdLevelName(sceneBVH.getPacketLevel()));
+	start = std::chrono::steady_clock::now();
+	int reported = 0;
+	for (int frame = 0; frame < options.samplesPerPixel; frame++) {
+		tracer.renderFrame(camera);
+		int percent = (frame + 1) * 100 / options.samplesPerPixel;
+		if (percent / 10 > reported / 10) {
+			reported = percent;
+			std::printf("  %3d%%  %.1f s\n", percent, ToolSupport::msSince(start) / 1000.0);
+			std::fflush(stdout);
+		}
+	}
+	double renderMs = ToolSupport::msSince(start);
+
+	start = std::chrono::steady_clock::now();
+	std::string hdrPath = options.output + ".pfm";
+	std::string ldrPath = options.output + ".ppm";
+	if (!ImageFile::writePFM(hdrPath, tracer.getImage(), options.width, options.height)
+		|| !ImageFile::writePPM(ldrPath, tracer.getImage(), options.width, options.height)) {
+		return 1;
+	}
+	double writeMs = ToolSupport::msSince(start);
+
+	std::printf("Wrote %s and %s\n", hdrPath.c_str(), ldrPath.c_str());
+	std::printf("Scene load   %10.1f ms\n", loadMs);
+	std::printf("BVH build    %10.1f ms (%d of %d meshes from cache)\n", sceneBVH.getBuildTimeMs(), sceneBVH.getCachedMeshCount(), sceneBVH.getMeshCount());
+	std::printf("Render       %10.1f ms, %.0f samples/s, %.1f ms per frame of one sample per pixel\n", renderMs, tracer.getSamplesPerSecond(), renderMs / options.samplesPerPixel);
+	std::printf("Image write  %10.1f ms\n", writeMs);
+	std::printf("Total        %10.1f ms\n", ToolSupport::msSince(totalStart));
+	return 0;
+}
@@ -0,0 +1,44 @@
+// Converts OBJ files into the binary format of MeshFile, which loads without parsing.
+// Usage: ObjToMesh input.obj [output.mesh]
+// Without an output the .mesh is written next to the input, where the scenes and the file
+// dialog pick it up in place of the .obj for as long as it is newer.
+#define MAIN
+#include "VectorUtils4.h"
+#include "MeshFile.h"
+#include "OBJLoader.h"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+int main(int argc, char** argv)
+{
+	if (argc < 2 || argc > 3) {
+		std::fprintf(stderr, "Usage: %s input.obj [output.mesh]\n", argv[0]);
+		return 1;
+	}
+	std::string input = argv[1];
+	std::string output = argc > 2 ? argv[2] : std::filesystem::path(input).replace_extension(".mesh").string();
+
+	auto start = std::chrono::steady_clock::now();
+	IndexedMesh mesh;
+	if (!OBJLoader::loadOBJ(input, mesh) || !MeshFile::save(output, mesh)) {
+		return 1;
+	}
+	double convertMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// Loaded back, which also shows what the conversion saves on every start
+	start = std::chrono::steady_clock::now();
+	IndexedMesh loaded;
+	AABB bounds;
+	if (!MeshFile::load(output, loaded, &bounds)) {
+		return 1;
+	}
+	double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::printf("%s: %zu triangles, %zu vertices, bounds (%g %g %g) - (%g %g %g)\n", output.c_str(),
+		loaded.triangleCount(), loaded.positions.size(),
+		bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z);
+	std::printf("parsed and written in %.2f ms, loads in %.2f ms\n", convertMs, loadMs);
+	return 0;
+}